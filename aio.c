@@ -0,0 +1,525 @@
+#define _GNU_SOURCE // For sync_file_range()
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+#include "aio.h"
+
+typedef enum
+{
+    e_slot_free,
+    e_slot_reading,
+    e_slot_ready,
+    e_slot_writing
+} SlotState;
+
+/* One block buffer of the pipeline */
+typedef struct
+{
+    char *buf;
+    size_t block;           // Block held by the buffer
+    size_t done;            // Bytes of the current read or write already transferred
+    SlotState state;
+} AioSlot;
+
+static size_t block_len(const AioJob *job, size_t i)
+{
+    return job->bounds[i + 1] - job->bounds[i];
+}
+
+/* Positioned read of exactly len bytes, retried on short reads */
+static Status read_full(int fd, char *buf, size_t len, uint64_t off, uint64_t *calls)
+{
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, buf, len, off);
+        (*calls)++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return e_failure;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return e_success;
+}
+
+/* Positioned write of exactly len bytes, retried on short writes */
+static Status write_full(int fd, const char *buf, size_t len, uint64_t off, uint64_t *calls)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, buf, len, off);
+        (*calls)++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return e_failure;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return e_success;
+}
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+/* Submission and completion rings shared with the kernel, set up without liburing */
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned queued;        // SQEs filled in but not yet passed to the kernel
+} Ring;
+
+static Status ring_init(Ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return e_failure;
+
+    // IORING_OP_READ and IORING_OP_WRITE came with the same kernel as this feature bit
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(r->fd);
+        return e_failure;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = 0;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                      IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+    {
+        close(r->fd);
+        return e_failure;
+    }
+    r->cq_ring = r->sq_ring;
+    if (r->cq_ring_size)
+    {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+        {
+            munmap(r->sq_ring, r->sq_ring_size);
+            close(r->fd);
+            return e_failure;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        if (r->cq_ring_size)
+            munmap(r->cq_ring, r->cq_ring_size);
+        munmap(r->sq_ring, r->sq_ring_size);
+        close(r->fd);
+        return e_failure;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return e_success;
+}
+
+static void ring_free(Ring *r)
+{
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ring_size)
+        munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+/* Queue a read or write of the untransferred part of slot s, the ring always has room for every slot twice */
+static void ring_queue(Ring *r, const AioJob *job, AioSlot *slots, int s)
+{
+    AioSlot *slot = &slots[s];
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = slot->state == e_slot_reading ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = slot->state == e_slot_reading ? job->fd_in : job->fd_out;
+    sqe->addr = (uint64_t)(uintptr_t)(slot->buf + slot->done);
+    sqe->len = block_len(job, slot->block) - slot->done;
+    sqe->off = job->bounds[slot->block] + slot->done;
+    sqe->user_data = s;
+    r->sq_array[idx] = idx;
+
+    // The entry must be complete before the kernel can see the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+}
+
+/* Pass the queued entries to the kernel and wait for at least min_complete completions */
+static Status ring_enter(Ring *r, unsigned min_complete, uint64_t *calls)
+{
+    for (;;)
+    {
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, r->queued, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        (*calls)++;
+        if (n >= 0)
+        {
+            r->queued -= n;
+            if (r->queued == 0)
+                return e_success;
+            continue;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return e_failure;
+    }
+}
+
+/* Start reading block into slot s */
+static void start_read(Ring *r, AioJob *job, AioSlot *slots, int s, size_t block)
+{
+    slots[s].block = block;
+    slots[s].done = 0;
+    slots[s].state = e_slot_reading;
+    ring_queue(r, job, slots, s);
+}
+
+/* Run the pipeline on io_uring, e_failure with nothing submitted when the kernel has no io_uring */
+static Status run_uring(AioJob *job, AioSlot *slots, int depth, int *started)
+{
+    Ring r;
+    size_t next_read = 0, next_fn = 0, written = 0;
+    int inflight = 0;
+    Status ret = e_success;
+
+    *started = 0;
+    if (ring_init(&r, 2 * depth) == e_failure)
+        return e_failure;
+    *started = 1;
+
+    // Fill every buffer with a read, then keep them cycling: read, transform, write, read the next block
+    for (int s = 0; s < depth && next_read < job->nblocks; s++, inflight++)
+        start_read(&r, job, slots, s, next_read++);
+
+    while (written < job->nblocks && (ret == e_success || inflight > 0))
+    {
+        // Transform the next block as soon as its read has landed, in block order
+        int s;
+        for (s = 0; ret == e_success && s < depth; s++)
+            if (slots[s].state == e_slot_ready && slots[s].block == next_fn)
+                break;
+        if (ret == e_success && s < depth)
+        {
+            if (job->fn(slots[s].buf, next_fn, block_len(job, next_fn), job->arg) == e_failure)
+                ret = e_failure;
+            else
+            {
+                slots[s].done = 0;
+                slots[s].state = e_slot_writing;
+                ring_queue(&r, job, slots, s);
+                inflight++;
+                next_fn++;
+                continue;
+            }
+        }
+        if (inflight == 0)
+            break;
+
+        // Submit what is queued and wait for at least one completion
+        if (ring_enter(&r, 1, &job->io_calls) == e_failure)
+        {
+            // Closing the ring below cancels whatever is still in flight
+            ret = e_failure;
+            break;
+        }
+
+        unsigned head = *r.cq_head;
+        unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            AioSlot *slot = &slots[cqe->user_data];
+            int res = cqe->res;
+
+            inflight--;
+            if (res == -EINTR || res == -EAGAIN)
+                res = 0;
+            else if (res <= 0)
+            {
+                // Errors and an early end of the input fail the job once everything in flight is back
+                ret = e_failure;
+                slot->state = e_slot_free;
+                continue;
+            }
+            slot->done += res;
+
+            if (slot->done < block_len(job, slot->block))
+            {
+                // Short transfer, queue the rest of the block
+                if (ret == e_success)
+                {
+                    ring_queue(&r, job, slots, (int)cqe->user_data);
+                    inflight++;
+                }
+                else
+                    slot->state = e_slot_free;
+            }
+            else if (slot->state == e_slot_reading)
+                slot->state = e_slot_ready;
+            else
+            {
+                written++;
+                slot->state = e_slot_free;
+                if (ret == e_success && next_read < job->nblocks)
+                {
+                    start_read(&r, job, slots, (int)cqe->user_data, next_read++);
+                    inflight++;
+                }
+            }
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (written != job->nblocks)
+        ret = e_failure;
+    ring_free(&r);
+    return ret;
+}
+
+#else
+
+static Status run_uring(AioJob *job, AioSlot *slots, int depth, int *started)
+{
+    (void)job;
+    (void)slots;
+    (void)depth;
+    *started = 0;
+    return e_failure;
+}
+
+#endif
+
+/* State shared by the reader, the writer and the transforming caller of the thread backend */
+typedef struct
+{
+    AioJob *job;
+    AioSlot *slots;
+    int depth;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t nread;           // Blocks read, ready for fn
+    size_t nfn;             // Blocks transformed, ready to be written
+    size_t nwritten;        // Blocks written, their buffers are free again
+    int failed;
+    uint64_t reader_calls;
+    uint64_t writer_calls;
+} AioThreads;
+
+/* Wait until *count passes limit, 0 when the job failed meanwhile */
+static int wait_for(AioThreads *t, const size_t *count, size_t limit)
+{
+    pthread_mutex_lock(&t->lock);
+    while (!t->failed && *count <= limit)
+        pthread_cond_wait(&t->cond, &t->lock);
+    int ok = !t->failed;
+    pthread_mutex_unlock(&t->lock);
+    return ok;
+}
+
+/* Advance *count, or mark the job failed */
+static void post(AioThreads *t, size_t *count, Status status)
+{
+    pthread_mutex_lock(&t->lock);
+    if (status == e_success)
+        (*count)++;
+    else
+        t->failed = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void *reader_main(void *p)
+{
+    AioThreads *t = p;
+    AioJob *job = t->job;
+
+    for (size_t i = 0; i < job->nblocks; i++)
+    {
+        // Block i reuses the buffer of block i - depth once that one is written
+        if (i >= (size_t)t->depth && !wait_for(t, &t->nwritten, i - t->depth))
+            break;
+        AioSlot *slot = &t->slots[i % t->depth];
+        post(t, &t->nread, read_full(job->fd_in, slot->buf, block_len(job, i), job->bounds[i], &t->reader_calls));
+    }
+    return NULL;
+}
+
+static void *writer_main(void *p)
+{
+    AioThreads *t = p;
+    AioJob *job = t->job;
+
+    for (size_t i = 0; i < job->nblocks; i++)
+    {
+        if (!wait_for(t, &t->nfn, i))
+            break;
+        AioSlot *slot = &t->slots[i % t->depth];
+        post(t, &t->nwritten, write_full(job->fd_out, slot->buf, block_len(job, i), job->bounds[i], &t->writer_calls));
+    }
+    return NULL;
+}
+
+/* Run the pipeline on a reader and a writer thread, the caller transforms */
+static Status run_threads(AioJob *job, AioSlot *slots, int depth)
+{
+    AioThreads t;
+    pthread_t reader, writer;
+
+    memset(&t, 0, sizeof(t));
+    t.job = job;
+    t.slots = slots;
+    t.depth = depth;
+    pthread_mutex_init(&t.lock, NULL);
+    pthread_cond_init(&t.cond, NULL);
+
+    if (pthread_create(&reader, NULL, reader_main, &t))
+        t.failed = 1;
+    else if (pthread_create(&writer, NULL, writer_main, &t))
+    {
+        post(&t, &t.nfn, e_failure);
+        pthread_join(reader, NULL);
+        t.failed = 1;
+    }
+    else
+    {
+        for (size_t i = 0; i < job->nblocks; i++)
+        {
+            if (!wait_for(&t, &t.nread, i))
+                break;
+            post(&t, &t.nfn, job->fn(slots[i % depth].buf, i, block_len(job, i), job->arg));
+        }
+        pthread_join(reader, NULL);
+        pthread_join(writer, NULL);
+    }
+
+    pthread_mutex_destroy(&t.lock);
+    pthread_cond_destroy(&t.cond);
+    job->io_calls += t.reader_calls + t.writer_calls;
+    return t.failed || t.nwritten != job->nblocks ? e_failure : e_success;
+}
+
+Status aio_run(AioJob *job)
+{
+    int depth = job->nblocks < AIO_DEPTH ? (int)job->nblocks : AIO_DEPTH;
+    size_t max_len = 0;
+    Status ret = e_success;
+
+    job->backend = "threads";
+    if (job->nblocks == 0)
+        return e_success;
+
+    for (size_t i = 0; i < job->nblocks; i++)
+        if (block_len(job, i) > max_len)
+            max_len = block_len(job, i);
+
+    AioSlot *slots = calloc(depth, sizeof(AioSlot));
+    if (slots == NULL)
+        return e_failure;
+    for (int s = 0; s < depth && ret == e_success; s++)
+        if ((slots[s].buf = malloc(max_len)) == NULL)
+            ret = e_failure;
+
+    if (ret == e_success)
+    {
+        // Fall back to the threads only when io_uring could not even be set up
+        int started = 0;
+        if (job->mode != e_aio_threads)
+            ret = run_uring(job, slots, depth, &started);
+        if (started)
+            job->backend = "io_uring";
+        else
+            ret = run_threads(job, slots, depth);
+    }
+
+    for (int s = 0; s < depth; s++)
+        free(slots[s].buf);
+    free(slots);
+    return ret;
+}
+
+void aio_window_init(AioWindow *w, const void *map, int fd, int dirty)
+{
+    w->map = (char *)map;
+    w->fd = fd;
+    w->dirty = dirty;
+    w->started = 0;
+    w->released = 0;
+}
+
+void aio_window_advance(AioWindow *w, size_t pos)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (w->map == NULL || pos < w->started + AIO_WINDOW)
+        return;
+    pos = pos / page * page;
+
+    // Clean pages are only unmapped, the kernel keeps them cached or reclaims them
+    if (!w->dirty)
+    {
+        madvise(w->map + w->released, pos - w->released, MADV_DONTNEED);
+        w->started = w->released = pos;
+        return;
+    }
+
+#ifdef __linux__
+    // Start writing back the window just walked, then wait for the one before it
+    sync_file_range(w->fd, w->started, pos - w->started, SYNC_FILE_RANGE_WRITE);
+    if (w->started > w->released)
+        sync_file_range(w->fd, w->released, w->started - w->released,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+    if (w->started > w->released)
+        msync(w->map + w->released, w->started - w->released, MS_SYNC);
+#endif
+
+    // That one is on disk now, its pages are neither needed here nor in the cache
+    if (w->started > w->released)
+    {
+        madvise(w->map + w->released, w->started - w->released, MADV_DONTNEED);
+        posix_fadvise(w->fd, w->released, w->started - w->released, POSIX_FADV_DONTNEED);
+        w->released = w->started;
+    }
+    w->started = pos;
+}
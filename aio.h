@@ -0,0 +1,74 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Asynchronous block pipeline between two files.
+ * Block i of fd_in is read, transformed in place by fn on the calling
+ * thread and written to the same offsets of fd_out. Up to depth blocks
+ * are in flight: the next blocks are read ahead and the previous ones
+ * written behind while fn works on the current one, so disk and CPU stay
+ * busy at the same time. io_uring is used when the kernel offers it,
+ * otherwise a reader and a writer thread do blocking pread()/pwrite().
+ */
+
+#define AIO_DEPTH 4                 // Blocks in flight
+#define AIO_BLOCK_CARRIER (1 << 19) // Carrier bytes per block
+
+typedef enum
+{
+    e_aio_off,          // Synchronous stdio, the default
+    e_aio_auto,         // io_uring, threads when it is not available
+    e_aio_threads       // Reader and writer threads even when io_uring is available
+} AioMode;
+
+/* Transform block i of len bytes in place, called in block order */
+typedef Status (*AioBlockFn)(char *buf, size_t block, size_t len, void *arg);
+
+typedef struct _AioJob
+{
+    int fd_in;              // Source of the blocks, read with positioned reads
+    int fd_out;             // Destination, written at the offsets the blocks were read from
+    size_t nblocks;         // Number of blocks
+    const uint64_t *bounds; // Block i covers [bounds[i], bounds[i + 1]) of both files
+    AioMode mode;           // e_aio_auto or e_aio_threads
+    AioBlockFn fn;          // Transform run on the calling thread
+    void *arg;              // Passed to fn
+    const char *backend;    // Set by aio_run(): "io_uring" or "threads"
+    uint64_t io_calls;      // Syscalls issued for the reads and writes
+} AioJob;
+
+/* Run every block through the pipeline and wait for the last write, fails on the first error */
+Status aio_run(AioJob *job);
+
+/*
+ * Window over a file mapping that is walked front to back. Once the walk
+ * has moved AIO_WINDOW bytes past the last release, the pages behind it
+ * leave the process: a mapping that is written is first written back, one
+ * window behind so the disk works while the next window is filled, and its
+ * pages are also dropped from the page cache. Resident and dirty memory
+ * then stay at a few windows however large the file is. Pages walked again
+ * later are simply read back in.
+ */
+
+#define AIO_WINDOW (48 << 20)      // Bytes walked between releases, a multiple of every depth
+
+typedef struct _AioWindow
+{
+    char *map;              // Mapping walked, NULL turns the window off (caller buffers)
+    int fd;                 // File mapped, written back and dropped from the cache when dirty
+    int dirty;              // The mapping is shared and written
+    size_t started;         // Write back started up to this offset, the walk released up to here when clean
+    size_t released;        // Pages in front of this offset are released
+} AioWindow;
+
+/* Start a window over map, a mapping of fd */
+void aio_window_init(AioWindow *w, const void *map, int fd, int dirty);
+
+/* The walk reached offset pos of the mapping, releases the pages behind it once per AIO_WINDOW */
+void aio_window_advance(AioWindow *w, size_t pos);
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void *arena_alloc(Arena *a, size_t n)
+{
+    if (a == NULL)
+        return malloc(n ? n : 1);
+
+    n = ALIGN_UP(n ? n : 1);
+    if (n <= a->size - a->used)
+    {
+        void *p = a->base + a->used;
+        a->used += n;
+        return p;
+    }
+
+    // Does not fit, a block of its own until the next reset makes room
+    ArenaBlock *b = aligned_alloc(ARENA_ALIGN, ALIGN_UP(sizeof(ArenaBlock)) + n);
+    if (b == NULL)
+        return NULL;
+    b->next = a->spill;
+    a->spill = b;
+    a->spilled += n;
+    a->heap_allocs++;
+    return (char *)b + ALIGN_UP(sizeof(ArenaBlock));
+}
+
+void arena_release(Arena *a, void *p)
+{
+    if (a == NULL)
+        free(p);
+}
+
+char *arena_strdup(Arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p = arena_alloc(a, len);
+    if (p)
+        memcpy(p, s, len);
+    return p;
+}
+
+static void free_spill(Arena *a)
+{
+    while (a->spill)
+    {
+        ArenaBlock *next = a->spill->next;
+        free(a->spill);
+        a->spill = next;
+    }
+}
+
+void arena_reset(Arena *a)
+{
+    size_t need = a->used + a->spilled;
+
+    free_spill(a);
+
+    // One block for everything the last job allocated, with room to spare for a slightly larger one
+    if (need > a->size)
+    {
+        size_t size = ALIGN_UP(need + need / 4);
+        char *base = aligned_alloc(ARENA_ALIGN, size);
+        if (base)
+        {
+            free(a->base);
+            a->base = base;
+            a->size = size;
+            a->heap_allocs++;
+        }
+    }
+    a->used = 0;
+    a->spilled = 0;
+}
+
+void arena_free(Arena *a)
+{
+    free_spill(a);
+    free(a->base);
+    a->base = NULL;
+    a->size = a->used = a->spilled = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for what one job allocates: file names, the compressed
+ * secret, inline images and scratch tables. Nothing is freed on its own,
+ * arena_reset() releases everything at once and keeps the memory for the
+ * next job. An allocation that does not fit gets a heap block of its own,
+ * and the next reset replaces the arena by one large enough for the whole
+ * job, so once the largest job has been seen the heap is no longer touched.
+ *
+ * Functions taking an arena also accept NULL and then use the heap, so
+ * code shared with callers that have no arena calls them unconditionally.
+ */
+
+#define ARENA_ALIGN 64          // Every allocation starts on a cache line
+
+typedef struct _ArenaBlock
+{
+    struct _ArenaBlock *next;
+} ArenaBlock;
+
+typedef struct _Arena
+{
+    char *base;                 // Memory kept across resets
+    size_t size;                // Size of base
+    size_t used;                // Bytes of base handed out since the last reset
+    ArenaBlock *spill;          // Heap blocks of the allocations that did not fit, freed by the next reset
+    size_t spilled;             // Bytes of them
+    size_t heap_allocs;         // Heap allocations made so far, constant once the arena is warm
+} Arena;
+
+/* n bytes aligned to ARENA_ALIGN, malloc() when a is NULL */
+void *arena_alloc(Arena *a, size_t n);
+
+/* free() for memory from arena_alloc(NULL, ...), nothing with an arena */
+void arena_release(Arena *a, void *p);
+
+/* Copy of s, of its own length */
+char *arena_strdup(Arena *a, const char *s);
+
+/* Release every allocation, grows base to what the last job needed */
+void arena_reset(Arena *a);
+
+/* Give all memory back to the heap, the arena can be used again afterwards */
+void arena_free(Arena *a);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "encode.h"
+#include "decode.h"
+#include "metrics.h"
+#include "pool.h"
+#include "job.h"
+
+typedef struct
+{
+    BatchJob *jobs;
+    Job **ctx;              // One reusable job context per worker
+} Batch;
+
+/* Parse the manifest into jobs, returns the number of jobs or -1 */
+static long read_manifest(const char *manifest, BatchJob **out)
+{
+    FILE *fp = fopen(manifest, "r");
+    char line[4096];
+    long n = 0, cap = 0;
+    BatchJob *jobs = NULL;
+    int lineno = 0;
+
+    if (fp == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", manifest);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *save, *tok[BATCH_MAX_FIELDS + 1];
+        int ntok = 0;
+        size_t len = strlen(line);
+        OperationType op = e_unsupported;
+        int c = EOF;
+
+        lineno++;
+
+        // A line longer than the buffer is one bad job, the rest of it is skipped rather than read as another line
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n' && (c = fgetc(fp)) != EOF)
+        {
+            while (c != EOF && c != '\n')
+                c = fgetc(fp);
+            fprintf(stderr, "ERROR: %s:%d: line longer than %zu bytes\n", manifest, lineno, sizeof(line) - 2);
+        }
+        else
+        {
+            for (char *t = strtok_r(line, " \t\r\n", &save); t && ntok <= BATCH_MAX_FIELDS; t = strtok_r(NULL, " \t\r\n", &save))
+                tok[ntok++] = t;
+            if (ntok == 0 || tok[0][0] == '#')
+                continue;
+
+            // e <src> <secret> <stego> or d <stego> <output>, anything else is kept as a failed job so it is counted
+            op = !strcmp(tok[0], "e") ? e_encode : !strcmp(tok[0], "d") ? e_decode : e_unsupported;
+            if ((op == e_encode && ntok != 4) || (op == e_decode && ntok != 3) || op == e_unsupported)
+            {
+                fprintf(stderr, "ERROR: %s:%d: expected 'e <image.bmp> <secret.txt> <stego.bmp>' or 'd <stego.bmp> <output>'\n",
+                        manifest, lineno);
+                op = e_unsupported;
+            }
+        }
+
+        if (n == cap)
+        {
+            cap = cap ? 2 * cap : 64;
+            BatchJob *grown = realloc(jobs, cap * sizeof(BatchJob));
+            if (grown == NULL)
+            {
+                fclose(fp);
+                free(jobs);
+                return -1;
+            }
+            jobs = grown;
+        }
+        memset(&jobs[n], 0, sizeof(BatchJob));
+        jobs[n].op = op;
+        jobs[n].line = lineno;
+        jobs[n].status = e_failure;
+        for (int i = 1; op != e_unsupported && i < ntok; i++)
+            jobs[n].args[i - 1] = strdup(tok[i]);
+        n++;
+    }
+
+    fclose(fp);
+    *out = jobs;
+    return n;
+}
+
+/* Worker callback, runs one job quietly on the worker's own context */
+static void run_job(size_t index, int worker, void *arg)
+{
+    Batch *batch = arg;
+    BatchJob *job = &batch->jobs[index];
+    Metrics metrics;
+    uint64_t start = metrics_now_ns();
+
+    // A bad manifest line stays failed
+    if (job->op == e_unsupported)
+        return;
+
+    job_reset(batch->ctx[worker]);
+    if (job->op == e_encode)
+    {
+        EncodeInfo *encInfo = job_encode(batch->ctx[worker]);
+        encInfo->src_image_fname = job->args[0];
+        encInfo->secret_fname = job->args[1];
+        encInfo->stego_image_fname = job->args[2];
+        encInfo->quiet = 1;
+        encInfo->threads = 1; // The pool already runs one job per worker
+        encInfo->metrics = &metrics;
+        job->status = do_encoding(encInfo);
+        if (job->status == e_failure)
+            close_files(encInfo);
+    }
+    else
+    {
+        Dec_Info *decinfo = job_decode(batch->ctx[worker]);
+        decinfo->input_fname = job->args[0];
+        decinfo->output_fname = job->args[1];
+        decinfo->quiet = 1;
+        decinfo->threads = 1;
+        decinfo->metrics = &metrics;
+        job->status = do_decoding(decinfo);
+        if (job->status == e_failure)
+            close_files_for_decode(decinfo);
+    }
+
+    job->ns = metrics_now_ns() - start;
+    for (int s = 0; s < e_stage_count; s++)
+        job->bytes += metrics.stage[s].bytes_written;
+}
+
+Status do_batch(const char *manifest, int nthreads)
+{
+    Batch batch = {0};
+    long njobs = read_manifest(manifest, &batch.jobs);
+    Status ret = e_success;
+
+    if (njobs < 0)
+        return e_failure;
+    if (nthreads <= 0)
+        nthreads = pool_cpu_count();
+
+    // Contexts are allocated once per worker and reused for all of its jobs
+    batch.ctx = calloc(nthreads, sizeof(Job *));
+    for (int i = 0; batch.ctx && i < nthreads; i++)
+        if ((batch.ctx[i] = job_new()) == NULL)
+            ret = e_failure;
+
+    uint64_t start = metrics_now_ns();
+    if (ret == e_success && (batch.ctx == NULL || pool_run(njobs, nthreads, run_job, &batch)))
+        ret = e_failure;
+    uint64_t wall = metrics_now_ns() - start;
+
+    // Per job status, in manifest order
+    long ok = 0;
+    uint64_t bytes = 0;
+    for (long i = 0; i < njobs; i++)
+    {
+        BatchJob *job = &batch.jobs[i];
+        if (job->op == e_unsupported)
+            printf("%s:%d invalid line FAILED\n", manifest, job->line);
+        else
+            printf("%s:%d %s %s %s %.3f ms\n", manifest, job->line, job->op == e_encode ? "encode" : "decode",
+                   job->args[0], job->status == e_success ? "OK" : "FAILED", job->ns / 1e6);
+        if (job->status == e_success)
+            ok++;
+        bytes += job->bytes;
+        for (int f = 0; f < BATCH_MAX_FIELDS; f++)
+            free(job->args[f]);
+    }
+
+    // Aggregate throughput over the wall time of the whole batch
+    double secs = wall / 1e9;
+    printf("INFO : %ld jobs, %ld succeeded, %ld failed, %d threads, %.3f s, %.1f jobs/s, %.1f MB/s written\n",
+           njobs, ok, njobs - ok, nthreads, secs, secs > 0 ? njobs / secs : 0, secs > 0 ? bytes / 1e6 / secs : 0);
+
+    for (int i = 0; batch.ctx && i < nthreads; i++)
+        job_free(batch.ctx[i]);
+    free(batch.ctx);
+    free(batch.jobs);
+
+    if (ok != njobs)
+        ret = e_failure;
+    return ret;
+}
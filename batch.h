@@ -0,0 +1,32 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Batch mode: run every job listed in a manifest inside one process.
+ * One job per line, blank lines and lines starting with '#' are skipped:
+ *
+ *   e <source_image.bmp> <secret.txt> <stego_image.bmp>
+ *   d <stego_image.bmp> <output_file>
+ *
+ * Any other line, or one too long for the line buffer, is a failed job.
+ */
+
+#define BATCH_MAX_FIELDS 4
+
+typedef struct _BatchJob
+{
+    OperationType op;       // e_encode or e_decode
+    char *args[BATCH_MAX_FIELDS]; // File names of the job, in command line order
+    int line;               // Manifest line, for the status report
+    Status status;          // Result of the job
+    uint64_t ns;            // Wall time of the job
+    uint64_t bytes;         // Carrier and payload bytes written
+} BatchJob;
+
+/* Run all jobs of the manifest on nthreads workers (0 = one per CPU) */
+Status do_batch(const char *manifest, int nthreads);
+
+#endif
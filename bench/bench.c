@@ -0,0 +1,438 @@
+/*
+ * Benchmarks for the encode/decode pipeline.
+ *
+ * Build from the repository root:
+ *   gcc -O2 -I. bench/bench.c encode.c decode.c bmp.c png.c lz.c aio.c crc32c.c container.c scatter.c arena.c lsb.c metrics.c pool.c rs.c -o steg_bench
+ *
+ * Usage: ./steg_bench [--quick] [--max-mp=N] [--dir=PATH] [--reps=N]
+ *
+ * Microbenchmarks time the LSB primitives on in-memory buffers, the end to
+ * end benchmarks run do_encoding()/do_decoding() on generated 24bpp BMPs.
+ * All inputs come from a fixed-seed generator so runs are comparable across
+ * commits. Every line is CSV: suite,case,kernel,bytes,best_ns,MB/s,ns/byte,peak_rss_kb
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "encode.h"
+#include "decode.h"
+#include "lsb.h"
+#include "crc32c.h"
+#include "rs.h"
+#include "metrics.h"
+
+static int reps = 3;
+static char dir[256] = "/tmp";
+
+/* Fixed-seed xorshift generator, the same bytes on every run */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void fill(char *buf, size_t n, int text)
+{
+    for (size_t i = 0; i < n; i++)
+        buf[i] = text ? (char)('a' + rng() % 26) : (char)rng();
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static void report(const char *suite, const char *name, const char *kernel, size_t bytes, uint64_t best_ns)
+{
+    double mbs = best_ns ? (double)bytes / 1e6 / ((double)best_ns / 1e9) : 0;
+    printf("%s,%s,%s,%zu,%llu,%.1f,%.3f,%ld\n", suite, name, kernel, bytes,
+           (unsigned long long)best_ns, mbs, bytes ? (double)best_ns / bytes : 0, peak_rss_kb());
+    fflush(stdout);
+}
+
+/* Microbenchmarks of the LSB primitives, payload bytes are the unit */
+static void bench_micro(size_t n)
+{
+    char *data = malloc(n);
+    char *carrier = malloc(8 * n);
+    char *out = malloc(8 * n);
+    uint64_t best;
+
+    fill(data, n, 0);
+    fill(carrier, 8 * n, 0);
+
+    // encode_byte_to_lsb, one call per payload byte
+    best = UINT64_MAX;
+    for (int r = 0; r < reps; r++)
+    {
+        uint64_t t = metrics_now_ns();
+        for (size_t i = 0; i < n; i++)
+            encode_byte_to_lsb(data[i], carrier + 8 * i);
+        t = metrics_now_ns() - t;
+        if (t < best)
+            best = t;
+    }
+    report("micro", "encode_byte_to_lsb", lsb_kernel_name(), n, best);
+
+    // decode_byte_from_lsb, one call per payload byte
+    best = UINT64_MAX;
+    for (int r = 0; r < reps; r++)
+    {
+        uint64_t t = metrics_now_ns();
+        for (size_t i = 0; i < n; i++)
+            data[i] = decode_byte_from_lsb(carrier + 8 * i, (int)i);
+        t = metrics_now_ns() - t;
+        if (t < best)
+            best = t;
+    }
+    report("micro", "decode_byte_from_lsb", lsb_kernel_name(), n, best);
+
+    // Bulk kernels, once per kernel set the CPU supports
+    const char *kernels[] = {"scalar", "sse2", "bmi2", "avx2"};
+    const char *active = lsb_kernel_name();
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        if (lsb_select_kernel(kernels[k]))
+            continue;
+
+        best = UINT64_MAX;
+        for (int r = 0; r < reps; r++)
+        {
+            uint64_t t = metrics_now_ns();
+            lsb_encode_bytes(data, n, carrier, out);
+            t = metrics_now_ns() - t;
+            if (t < best)
+                best = t;
+        }
+        report("micro", "lsb_encode_bytes", lsb_kernel_name(), n, best);
+
+        best = UINT64_MAX;
+        for (int r = 0; r < reps; r++)
+        {
+            uint64_t t = metrics_now_ns();
+            lsb_decode_bytes(out, n, data);
+            t = metrics_now_ns() - t;
+            if (t < best)
+                best = t;
+        }
+        report("micro", "lsb_decode_bytes", lsb_kernel_name(), n, best);
+    }
+    lsb_select_kernel(active);
+
+    // Payload checksum, once per implementation the CPU supports
+    const char *crc_kernels[] = {"slice8", "sse4.2"};
+    const char *crc_active = crc32c_kernel_name();
+    for (size_t k = 0; k < sizeof(crc_kernels) / sizeof(crc_kernels[0]); k++)
+    {
+        if (crc32c_select_kernel(crc_kernels[k]))
+            continue;
+        volatile uint32_t crc = 0;
+        best = UINT64_MAX;
+        for (int r = 0; r < reps; r++)
+        {
+            uint64_t t = metrics_now_ns();
+            crc = crc32c_update(crc, data, n);
+            t = metrics_now_ns() - t;
+            if (t < best)
+                best = t;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "crc32c/%s", crc_kernels[k]);
+        report("micro", name, crc32c_kernel_name(), n, best);
+    }
+    crc32c_select_kernel(crc_active);
+
+    // Reed-Solomon blocks at the default parity, the payload laid out in out, once per kernel the CPU supports
+    const char *rs_kernels[] = {"scalar", "ssse3", "avx2"};
+    const char *rs_active = rs_kernel_name();
+    RsCode rs;
+    size_t room = RS_DATA_BYTES(RS_DEFAULT_PARITY), blocks = n / room;
+    rs_init(&rs, RS_DEFAULT_PARITY);
+    for (size_t b = 0; b < blocks; b++)
+        memcpy(out + b * RS_BLOCK, data + b * room, room);
+    for (size_t k = 0; k < sizeof(rs_kernels) / sizeof(rs_kernels[0]); k++)
+    {
+        if (rs_select_kernel(rs_kernels[k]))
+            continue;
+        char name[32];
+        best = UINT64_MAX;
+        for (int r = 0; r < reps; r++)
+        {
+            uint64_t t = metrics_now_ns();
+            for (size_t b = 0; b < blocks; b++)
+                rs_encode_block(&rs, (unsigned char *)out + b * RS_BLOCK);
+            t = metrics_now_ns() - t;
+            if (t < best)
+                best = t;
+        }
+        snprintf(name, sizeof(name), "rs_encode/%s", rs_kernels[k]);
+        report("micro", name, rs_kernel_name(), blocks * room, best);
+
+        // Undamaged blocks, the syndromes are the whole cost
+        best = UINT64_MAX;
+        for (int r = 0; r < reps; r++)
+        {
+            uint64_t t = metrics_now_ns();
+            for (size_t b = 0; b < blocks; b++)
+                rs_decode_block(&rs, (unsigned char *)out + b * RS_BLOCK);
+            t = metrics_now_ns() - t;
+            if (t < best)
+                best = t;
+        }
+        snprintf(name, sizeof(name), "rs_decode/%s", rs_kernels[k]);
+        report("micro", name, rs_kernel_name(), blocks * room, best);
+    }
+    rs_select_kernel(rs_active);
+
+    // encode_size_to_lsb through the mapped backend, pointed at plain memory
+    EncodeInfo encInfo = {0};
+    encInfo.src_map = carrier;
+    encInfo.stego_map = out;
+    encInfo.map_size = 8 * n;
+    bmp_plan_flat(&encInfo.plan, 8 * n);
+    encInfo.quiet = 1;
+    size_t fields = 8 * n / 32;
+    best = UINT64_MAX;
+    for (int r = 0; r < reps; r++)
+    {
+        encInfo.carrier_pos = 0;
+        uint64_t t = metrics_now_ns();
+        for (size_t i = 0; i < fields; i++)
+            encode_size_to_lsb((int)i, &encInfo);
+        t = metrics_now_ns() - t;
+        if (t < best)
+            best = t;
+    }
+    report("micro", "encode_size_to_lsb", lsb_kernel_name(), fields * 4, best);
+
+    free(data);
+    free(carrier);
+    free(out);
+}
+
+/* Write a 24bpp BMP of about mp megapixels with a 4-byte aligned row size */
+static long make_bmp(const char *path, double mp)
+{
+    uint32_t width = 4 * (uint32_t)(2000 * mp / 1.5 / 4 + 1);
+    uint32_t height = (uint32_t)(mp * 1e6 / width) + 1;
+    uint32_t image = width * height * 3;
+    unsigned char h[54] = {'B', 'M'};
+    uint32_t v;
+
+    v = 54 + image; memcpy(h + 2, &v, 4);
+    v = 54; memcpy(h + 10, &v, 4);
+    v = 40; memcpy(h + 14, &v, 4);
+    memcpy(h + 18, &width, 4);
+    memcpy(h + 22, &height, 4);
+    h[26] = 1; h[28] = 24;
+    memcpy(h + 34, &image, 4);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+    fwrite(h, 54, 1, fp);
+    char *row = malloc(1 << 20);
+    for (uint32_t done = 0; done < image;)
+    {
+        uint32_t n = image - done < (1 << 20) ? image - done : (1 << 20);
+        fill(row, n, 0);
+        fwrite(row, 1, n, fp);
+        done += n;
+    }
+    free(row);
+    fclose(fp);
+    return image;
+}
+
+static int make_secret(const char *path, size_t size)
+{
+    FILE *fp = fopen(path, "w");
+    char *buf = malloc(1 << 16);
+    if (!fp || !buf)
+        return -1;
+    for (size_t done = 0; done < size;)
+    {
+        size_t n = size - done < (1 << 16) ? size - done : (1 << 16);
+        fill(buf, n, 1);
+        fwrite(buf, 1, n, fp);
+        done += n;
+    }
+    free(buf);
+    fclose(fp);
+    return 0;
+}
+
+/* A failed stage ends the run, a row without it would read as a result */
+static void fail(const char *what, const char *path)
+{
+    fprintf(stderr, "ERROR: %s failed on %s\n", what, path);
+    exit(1);
+}
+
+/* Whether the two files hold the same bytes */
+static int same_file(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+    static char ba[1 << 16], bb[1 << 16];
+    int same = fa && fb;
+
+    while (same)
+    {
+        size_t na = fread(ba, 1, sizeof(ba), fa), nb = fread(bb, 1, sizeof(bb), fb);
+        same = na == nb && !memcmp(ba, bb, na);
+        if (na == 0)
+            break;
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return same;
+}
+
+/* One encode of secret into stego and decode of it into output, *enc_ns and *dec_ns receive the times */
+static void run_e2e(char *bmp, char *secret, char *stego, char *output, uint64_t *enc_ns, uint64_t *dec_ns)
+{
+    EncodeInfo encInfo = {0};
+    Dec_Info decinfo = {0};
+
+    encInfo.src_image_fname = bmp;
+    encInfo.secret_fname = secret;
+    encInfo.stego_image_fname = stego;
+    encInfo.quiet = 1;
+    uint64_t t = metrics_now_ns();
+    if (do_encoding(&encInfo) != e_success)
+        fail("do_encoding", stego);
+    *enc_ns = metrics_now_ns() - t;
+
+    decinfo.input_fname = stego;
+    decinfo.output_fname = output;
+    decinfo.quiet = 1;
+    t = metrics_now_ns();
+    if (do_decoding(&decinfo) != e_success)
+        fail("do_decoding", stego);
+    *dec_ns = metrics_now_ns() - t;
+}
+
+/* End to end encode and decode, payload bytes are the unit */
+static void bench_e2e(double mp, size_t payload)
+{
+    char bmp[300], secret[300], stego[300], output[300], name[64];
+    uint64_t best_enc = UINT64_MAX, best_dec = UINT64_MAX, enc, dec;
+
+    snprintf(bmp, sizeof(bmp), "%s/steg_bench_carrier.bmp", dir);
+    snprintf(secret, sizeof(secret), "%s/steg_bench_secret.txt", dir);
+    snprintf(stego, sizeof(stego), "%s/steg_bench_stego.bmp", dir);
+    snprintf(output, sizeof(output), "%s/steg_bench_output.txt", dir);
+
+    long capacity = make_bmp(bmp, mp);
+    if (capacity < 0)
+        fail("make_bmp", bmp);
+    // Full capacity: everything but the header fields, a payload the carrier cannot hold is no case of this size
+    if (payload == 0)
+        payload = capacity / 8 - 64;
+    if ((long)(payload * 8 + 512) > capacity)
+    {
+        remove(bmp);
+        return;
+    }
+    if (make_secret(secret, payload))
+        fail("make_secret", secret);
+
+    // A kernel that decodes the wrong bytes must not get a throughput number
+    run_e2e(bmp, secret, stego, output, &enc, &dec);
+    if (!same_file(secret, output))
+        fail("comparing the decoded output with the secret", output);
+
+    for (int r = 0; r < reps; r++)
+    {
+        run_e2e(bmp, secret, stego, output, &enc, &dec);
+        if (enc < best_enc)
+            best_enc = enc;
+        if (dec < best_dec)
+            best_dec = dec;
+    }
+
+    snprintf(name, sizeof(name), "do_encoding/%.1fMP/%zuB", mp, payload);
+    report("e2e", name, lsb_kernel_name(), payload, best_enc);
+    snprintf(name, sizeof(name), "do_decoding/%.1fMP/%zuB", mp, payload);
+    report("e2e", name, lsb_kernel_name(), payload, best_dec);
+
+    // The tail copy on its own, the whole carrier after the header is the unit
+    EncodeInfo encInfo = {0};
+    encInfo.fptr_src_image = fopen(bmp, "r");
+    encInfo.fptr_stego_image = fopen(stego, "w");
+    if (encInfo.fptr_src_image && encInfo.fptr_stego_image)
+    {
+        uint64_t best = UINT64_MAX;
+        for (int r = 0; r < reps; r++)
+        {
+            fseek(encInfo.fptr_src_image, 54, SEEK_SET);
+            fseek(encInfo.fptr_stego_image, 0, SEEK_SET);
+            uint64_t t = metrics_now_ns();
+            copy_remaining_img_data(&encInfo);
+            t = metrics_now_ns() - t;
+            if (t < best)
+                best = t;
+        }
+        snprintf(name, sizeof(name), "copy_remaining_img_data/%.1fMP", mp);
+        report("e2e", name, lsb_kernel_name(), capacity, best);
+    }
+    if (encInfo.fptr_src_image)
+        fclose(encInfo.fptr_src_image);
+    if (encInfo.fptr_stego_image)
+        fclose(encInfo.fptr_stego_image);
+
+    remove(bmp);
+    remove(secret);
+    remove(stego);
+    remove(output);
+}
+
+int main(int argc, char *argv[])
+{
+    double max_mp = 200;
+    int quick = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--quick"))
+            quick = 1;
+        else if (!strncmp(argv[i], "--max-mp=", 9))
+            max_mp = atof(argv[i] + 9);
+        else if (!strncmp(argv[i], "--dir=", 6))
+            snprintf(dir, sizeof(dir), "%s", argv[i] + 6);
+        else if (!strncmp(argv[i], "--reps=", 7))
+            reps = atoi(argv[i] + 7) > 0 ? atoi(argv[i] + 7) : 1;
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--max-mp=N] [--dir=PATH] [--reps=N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (quick)
+        max_mp = max_mp < 2 ? max_mp : 2;
+
+    printf("suite,case,kernel,bytes,best_ns,MB/s,ns/byte,peak_rss_kb\n");
+    bench_micro(quick ? (1 << 16) : (1 << 22));
+
+    const double sizes_mp[] = {0.3, 2, 12, 50, 200};
+    const size_t payloads[] = {1024, 64 * 1024, 1024 * 1024, 0};
+    for (size_t s = 0; s < sizeof(sizes_mp) / sizeof(sizes_mp[0]); s++)
+    {
+        if (sizes_mp[s] > max_mp)
+            break;
+        for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++)
+            bench_e2e(sizes_mp[s], payloads[p]);
+    }
+    return 0;
+}
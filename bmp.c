@@ -0,0 +1,186 @@
+#include <string.h>
+#include <sys/stat.h>
+#include "bmp.h"
+#include "lsb.h"
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+Status bmp_parse(const unsigned char *hdr, size_t hdr_len, uint64_t file_size, BmpPlan *plan)
+{
+    if (hdr_len < BMP_HEADER_SIZE || hdr[0] != 'B' || hdr[1] != 'M')
+        return e_failure;
+
+    uint32_t data_offset = get_u32(hdr + 10);
+    uint32_t info_size = get_u32(hdr + 14);
+    int32_t width = (int32_t)get_u32(hdr + 18);
+    int32_t height = (int32_t)get_u32(hdr + 22);
+    uint16_t planes = get_u16(hdr + 26);
+    uint16_t bpp = get_u16(hdr + 28);
+    uint32_t compression = get_u32(hdr + 30);
+
+    // BITMAPINFOHEADER or a later version (V4, V5) that extends it
+    if (info_size < 40 || data_offset < 14 + info_size)
+        return e_failure;
+    if (width <= 0 || height == 0 || height == INT32_MIN || planes != 1)
+        return e_failure;
+
+    // Uncompressed true colour only, 32bpp may describe its channels with bit fields
+    if (!(bpp == 24 && compression == 0) && !(bpp == 32 && (compression == 0 || compression == 3)))
+        return e_failure;
+
+    uint64_t row = (uint64_t)width * (bpp / 8);
+    uint64_t stride = (row + 3) & ~(uint64_t)3;
+    uint64_t rows = height < 0 ? -(int64_t)height : height;
+    if (data_offset + stride * rows > file_size)
+        return e_failure;
+
+    plan->data_offset = data_offset;
+    plan->width = width;
+    plan->height = (int32_t)rows;
+    plan->top_down = height < 0;
+    plan->bits_per_pixel = bpp;
+    plan->stride = stride;
+
+    // Without padding the whole pixel array is one run and the kernels never stop at a row end
+    if (stride == row)
+    {
+        plan->run_len = row * rows;
+        plan->run_stride = plan->run_len;
+        plan->nruns = 1;
+    }
+    else
+    {
+        plan->run_len = row;
+        plan->run_stride = stride;
+        plan->nruns = rows;
+    }
+    plan->capacity = plan->run_len * plan->nruns;
+    return e_success;
+}
+
+Status bmp_read_plan(FILE *fp, unsigned char *hdr, BmpPlan *plan)
+{
+    struct stat st;
+
+    if (fstat(fileno(fp), &st))
+        return e_failure;
+    if (fread(hdr, 1, BMP_HEADER_SIZE, fp) != BMP_HEADER_SIZE)
+        return e_failure;
+    return bmp_parse(hdr, BMP_HEADER_SIZE, S_ISREG(st.st_mode) ? (uint64_t)st.st_size : UINT64_MAX, plan);
+}
+
+void bmp_plan_flat(BmpPlan *plan, size_t len)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->run_len = len ? len : 1;
+    plan->run_stride = plan->run_len;
+    plan->nruns = 1;
+    plan->capacity = len;
+}
+
+/* Logical end of the run holding logical position pos */
+static size_t run_end(const BmpPlan *plan, size_t pos)
+{
+    return (pos / plan->run_len + 1) * plan->run_len;
+}
+
+void bmp_encode_bits(const BmpPlan *plan, size_t pos, const char *data, size_t n,
+                     const char *src, char *dst, size_t base, int depth, int threads)
+{
+    // Every depth bytes of data fill one group of 8 carrier bytes
+    while (n > 0)
+    {
+        size_t end = run_end(plan, pos);
+        size_t carrier = lsb_carrier_bytes(n, depth);
+        size_t off = bmp_phys(plan, pos) - base;
+
+        // The rest fits in this run, the common case and the only one without padding
+        if (pos + carrier <= end)
+        {
+            lsb_encode_bits_mt(data, n, src + off, dst + off, depth, threads);
+            return;
+        }
+
+        // Whole groups up to the end of the run
+        size_t groups = (end - pos) / 8;
+        if (groups)
+        {
+            lsb_encode_bits_mt(data, groups * depth, src + off, dst + off, depth, threads);
+            pos += groups * 8;
+            data += groups * depth;
+            n -= groups * depth;
+            continue;
+        }
+
+        // One group split by padding, gather its carrier bytes
+        char tmp[8];
+        size_t len = n < (size_t)depth ? n : (size_t)depth;
+        size_t cb = lsb_carrier_bytes(len, depth);
+        for (size_t i = 0; i < cb; i++)
+            tmp[i] = src[bmp_phys(plan, pos + i) - base];
+        lsb_encode_bits(data, len, tmp, tmp, depth);
+        for (size_t i = 0; i < cb; i++)
+            dst[bmp_phys(plan, pos + i) - base] = tmp[i];
+        pos += cb;
+        data += len;
+        n -= len;
+    }
+}
+
+void bmp_decode_bits(const BmpPlan *plan, size_t pos, const char *src, size_t base,
+                     size_t n, char *data, int depth, int threads)
+{
+    while (n > 0)
+    {
+        size_t end = run_end(plan, pos);
+        size_t carrier = lsb_carrier_bytes(n, depth);
+        size_t off = bmp_phys(plan, pos) - base;
+
+        if (pos + carrier <= end)
+        {
+            lsb_decode_bits_mt(src + off, n, data, depth, threads);
+            return;
+        }
+
+        size_t groups = (end - pos) / 8;
+        if (groups)
+        {
+            lsb_decode_bits_mt(src + off, groups * depth, data, depth, threads);
+            pos += groups * 8;
+            data += groups * depth;
+            n -= groups * depth;
+            continue;
+        }
+
+        char tmp[8];
+        size_t len = n < (size_t)depth ? n : (size_t)depth;
+        size_t cb = lsb_carrier_bytes(len, depth);
+        for (size_t i = 0; i < cb; i++)
+            tmp[i] = src[bmp_phys(plan, pos + i) - base];
+        lsb_decode_bits(tmp, len, data, depth);
+        pos += cb;
+        data += len;
+        n -= len;
+    }
+}
+
+void bmp_copy_padding(const BmpPlan *plan, size_t from, size_t pos, const char *src, char *dst)
+{
+    size_t pad = plan->run_stride - plan->run_len;
+
+    if (pad == 0)
+        return;
+    for (size_t run = (from + plan->run_len - 1) / plan->run_len; run * plan->run_len < pos && run < plan->nruns; run++)
+    {
+        size_t off = plan->data_offset + run * plan->run_stride + plan->run_len;
+        memcpy(dst + off, src + off, pad);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef BMP_H
+#define BMP_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * BMP carrier layout.
+ * bmp_parse() reads bfOffBits, the image size and biBitCount once and turns
+ * them into a plan of embeddable runs: every row holds width * bpp / 8
+ * pixel bytes followed by padding up to the 4-byte aligned stride. Rows
+ * without padding (32bpp, or 24bpp with a width divisible by 4) merge into
+ * a single run covering the whole pixel array.
+ *
+ * Carrier positions used by the encoder and decoder are logical: byte 0 is
+ * the first pixel byte and padding bytes are never counted.
+ */
+
+#define BMP_HEADER_SIZE 54  // File header plus BITMAPINFOHEADER, the part every supported header starts with
+
+typedef struct _BmpPlan
+{
+    uint32_t data_offset;   // bfOffBits, file offset of the pixel array
+    int32_t width;          // biWidth in pixels
+    int32_t height;         // Rows in the pixel array, |biHeight|
+    int top_down;           // biHeight was negative, the first row in the file is the top one
+    uint16_t bits_per_pixel;// biBitCount, 24 or 32
+    size_t stride;          // Bytes per row in the file, including the padding
+    size_t run_len;         // Embeddable bytes per run
+    size_t run_stride;      // File distance between the starts of consecutive runs
+    size_t nruns;           // Number of runs
+    size_t capacity;        // Embeddable bytes in the whole pixel array
+} BmpPlan;
+
+/* Parse the first hdr_len bytes of a BMP of file_size bytes, fails on unsupported or truncated images */
+Status bmp_parse(const unsigned char *hdr, size_t hdr_len, uint64_t file_size, BmpPlan *plan);
+
+/*
+ * Read and parse the header of a BMP file positioned at its start, forward
+ * only so pipes work too. hdr receives the BMP_HEADER_SIZE bytes read. The
+ * size of files that are not regular is unknown, a short pixel array is
+ * then only found when it runs out.
+ */
+Status bmp_read_plan(FILE *fp, unsigned char *hdr, BmpPlan *plan);
+
+/* Plan covering len contiguous carrier bytes at offset 0, for carriers that are not BMP files */
+void bmp_plan_flat(BmpPlan *plan, size_t len);
+
+/* File offset of logical carrier byte pos */
+static inline size_t bmp_phys(const BmpPlan *plan, size_t pos)
+{
+    size_t run = pos / plan->run_len;
+    return plan->data_offset + run * plan->run_stride + (pos - run * plan->run_len);
+}
+
+/* File offset just past the last of the first pos carrier bytes (data_offset when pos is 0) */
+static inline size_t bmp_phys_end(const BmpPlan *plan, size_t pos)
+{
+    return pos ? bmp_phys(plan, pos - 1) + 1 : plan->data_offset;
+}
+
+/*
+ * Embed n data bytes at depth into the carrier bytes starting at logical
+ * position pos. src and dst hold the file bytes from offset base on, only
+ * embeddable bytes are written. Spans inside one run go straight to the LSB
+ * kernels, only carrier groups split by padding are gathered.
+ */
+void bmp_encode_bits(const BmpPlan *plan, size_t pos, const char *data, size_t n,
+                     const char *src, char *dst, size_t base, int depth, int threads);
+
+/* Extract n data bytes at depth from the carrier bytes starting at logical position pos */
+void bmp_decode_bits(const BmpPlan *plan, size_t pos, const char *src, size_t base,
+                     size_t n, char *data, int depth, int threads);
+
+/* Copy the padding of the runs starting in [from, pos) of the logical positions from src to dst, both hold the whole file */
+void bmp_copy_padding(const BmpPlan *plan, size_t from, size_t pos, const char *src, char *dst);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Client for the daemon mode (./a.out -S socket).
+ *
+ * Build from the repository root:
+ *   gcc -O2 -I. client/steg_client.c -o steg_client
+ *
+ * Usage:
+ *   ./steg_client SOCKET encode SRC SECRET STEGO [-n N] [--inline] [--depth=N] [--compress] [--crc]
+ *   ./steg_client SOCKET decode STEGO OUTPUT [-n N] [--inline]
+ *   ./steg_client SOCKET stats
+ *
+ * File jobs pass the open files to the daemon, --inline sends the image
+ * bytes over the socket and writes the answer back. -n repeats the job N
+ * times over one connection and prints the round trip percentiles seen by
+ * the client next to the service time reported by the daemon.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "daemon.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int read_full(int fd, void *buf, size_t n)
+{
+    for (size_t done = 0; done < n;)
+    {
+        ssize_t k = read(fd, (char *)buf + done, n - done);
+        if (k <= 0)
+            return -1;
+        done += k;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n)
+{
+    for (size_t done = 0; done < n;)
+    {
+        ssize_t k = write(fd, (const char *)buf + done, n - done);
+        if (k <= 0)
+            return -1;
+        done += k;
+    }
+    return 0;
+}
+
+/* Send a request header with nfds descriptors attached */
+static int send_request(int sock, const DaemonRequest *req, const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))] = {0};
+    struct iovec iov = {(void *)req, sizeof(*req)};
+    struct msghdr msg = {0};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    }
+    return sendmsg(sock, &msg, 0) == (ssize_t)sizeof(*req) ? 0 : -1;
+}
+
+/* Whole file in memory, NULL on error */
+static char *slurp(const char *fname, size_t *len)
+{
+    FILE *fp = fopen(fname, "rb");
+    char *buf = NULL;
+    long size;
+
+    if (fp == NULL)
+        return NULL;
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+        (buf = malloc(size ? size : 1)) && fread(buf, 1, size, fp) == (size_t)size)
+        *len = size;
+    else
+    {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    return buf;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "Usage: steg_client SOCKET encode SRC SECRET STEGO [-n N] [--inline] [--depth=N] [--compress] [--crc]\n"
+                    "       steg_client SOCKET decode STEGO OUTPUT [-n N] [--inline]\n"
+                    "       steg_client SOCKET stats\n");
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    DaemonRequest req = {DAEMON_MAGIC, 0, 1, 0, {0}, 0, 0};
+    struct sockaddr_un addr = {0};
+    char *args[4] = {0};
+    int nargs = 0, repeat = 1, inline_job = 0;
+
+    if (argc < 3)
+        return usage();
+    for (int i = 3; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--inline"))
+            inline_job = 1;
+        else if (!strncmp(argv[i], "--depth=", 8))
+            req.depth = atoi(argv[i] + 8);
+        else if (!strcmp(argv[i], "--compress"))
+            req.flags |= DAEMON_COMPRESS;
+        else if (!strcmp(argv[i], "--crc"))
+            req.flags |= DAEMON_CRC;
+        else if (nargs < 4 && strncmp(argv[i], "--", 2))
+            args[nargs++] = argv[i];
+        else
+            return usage();
+    }
+
+    if (!strcmp(argv[2], "encode") && nargs == 3)
+        req.op = inline_job ? e_daemon_encode_inline : e_daemon_encode_fds;
+    else if (!strcmp(argv[2], "decode") && nargs == 2)
+        req.op = inline_job ? e_daemon_decode_inline : e_daemon_decode_fds;
+    else if (!strcmp(argv[2], "stats") && nargs == 0)
+        req.op = e_daemon_stats;
+    else
+        return usage();
+    if (repeat < 1)
+        repeat = 1;
+
+    // The extension is recorded like the encoder does, from the last '.' of the secret's name
+    if (req.op == e_daemon_encode_fds || req.op == e_daemon_encode_inline)
+    {
+        const char *base = strrchr(args[1], '/') ? strrchr(args[1], '/') + 1 : args[1];
+        const char *p = strrchr(base, '.') ? strrchr(base, '.') : "";
+        if (strlen(p) >= sizeof(req.extn))
+        {
+            fprintf(stderr, "ERROR: The extension %s is longer than %d characters\n", p, (int)sizeof(req.extn) - 1);
+            return 1;
+        }
+        strcpy(req.extn, p);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        perror("connect");
+        return 1;
+    }
+
+    // Inline jobs send the same buffer every time
+    char *buf = NULL, *reply = NULL;
+    size_t carrier_len = 0, payload_len = 0;
+    if (inline_job)
+    {
+        char *carrier = slurp(args[0], &carrier_len);
+        char *payload = req.op == e_daemon_encode_inline ? slurp(args[1], &payload_len) : NULL;
+        if (carrier == NULL || (req.op == e_daemon_encode_inline && payload == NULL) ||
+            (buf = malloc(carrier_len + payload_len + 1)) == NULL)
+        {
+            fprintf(stderr, "ERROR: Unable to read %s\n", carrier ? args[1] : args[0]);
+            return 1;
+        }
+        memcpy(buf, carrier, carrier_len);
+        if (payload_len)
+            memcpy(buf + carrier_len, payload, payload_len);
+        free(carrier);
+        free(payload);
+        req.carrier_len = carrier_len;
+        req.payload_len = payload_len;
+    }
+
+    uint64_t *rtt = malloc(repeat * sizeof(uint64_t)), *svc = malloc(repeat * sizeof(uint64_t));
+    DaemonResponse resp = {0};
+    int failed = 0;
+    uint64_t start = now_ns();
+
+    for (int r = 0; r < repeat; r++)
+    {
+        int fds[DAEMON_MAX_FDS], nfds = 0;
+        uint64_t t0 = now_ns();
+
+        // File jobs open the files again for every request, the daemon closes its copies
+        if (req.op == e_daemon_encode_fds)
+        {
+            fds[nfds++] = open(args[0], O_RDONLY);
+            fds[nfds++] = open(args[1], O_RDONLY);
+            fds[nfds++] = open(args[2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+        else if (req.op == e_daemon_decode_fds)
+        {
+            fds[nfds++] = open(args[0], O_RDONLY);
+            fds[nfds++] = open(args[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+        for (int i = 0; i < nfds; i++)
+            if (fds[i] < 0)
+            {
+                perror(args[i]);
+                return 1;
+            }
+
+        if (send_request(sock, &req, fds, nfds) || (inline_job && write_full(sock, buf, carrier_len + payload_len)) ||
+            read_full(sock, &resp, sizeof(resp)) || resp.magic != DAEMON_MAGIC)
+        {
+            fprintf(stderr, "ERROR: The daemon closed the connection\n");
+            return 1;
+        }
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+
+        if (resp.len)
+        {
+            reply = realloc(reply, resp.len);
+            if (reply == NULL || read_full(sock, reply, resp.len))
+            {
+                fprintf(stderr, "ERROR: The daemon closed the connection\n");
+                return 1;
+            }
+        }
+        rtt[r] = now_ns() - t0;
+        svc[r] = resp.ns;
+        failed += resp.status != 0;
+    }
+    double total = (now_ns() - start) / 1e9;
+
+    if (req.op == e_daemon_stats)
+    {
+        DaemonStats st;
+        memcpy(&st, reply, sizeof(st));
+        printf("INFO : %llu jobs, %llu failed, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", (unsigned long long)st.jobs,
+               (unsigned long long)st.failed, st.p50_ns / 1e6, st.p99_ns / 1e6, st.max_ns / 1e6);
+        return 0;
+    }
+
+    // The answer of the last inline job is written out, file jobs already wrote theirs
+    if (inline_job && resp.status == 0)
+    {
+        const char *out = req.op == e_daemon_encode_inline ? args[2] : args[1];
+        FILE *fp = fopen(out, "wb");
+        if (fp == NULL || fwrite(reply, 1, resp.len, fp) != resp.len || fclose(fp))
+        {
+            fprintf(stderr, "ERROR: Unable to write %s\n", out);
+            return 1;
+        }
+    }
+    if (resp.status)
+        fprintf(stderr, "ERROR: The job failed (status %d)\n", resp.status);
+
+    qsort(rtt, repeat, sizeof(uint64_t), cmp_u64);
+    qsort(svc, repeat, sizeof(uint64_t), cmp_u64);
+    printf("INFO : %d jobs, %d failed, %.0f jobs/s, round trip p50 %.3f ms p99 %.3f ms, service p50 %.3f ms p99 %.3f ms\n",
+           repeat, failed, repeat / total, rtt[(repeat - 1) / 2] / 1e6, rtt[(repeat - 1) * 99 / 100] / 1e6,
+           svc[(repeat - 1) / 2] / 1e6, svc[(repeat - 1) * 99 / 100] / 1e6);
+    return failed ? 1 : 0;
+}
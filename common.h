@@ -4,4 +4,35 @@
 /* Magic string to identify whether stegged or not */
 #define MAGIC_STRING "#*"
 
+/*
+ * Magic string of images that use options, it is followed by a 32-bit
+ * flags word. Both are stored at depth 1, everything after the flags
+ * word uses the depth recorded in it. Images without options keep the
+ * original MAGIC_STRING layout.
+ */
+#define MAGIC_STRING_EXT "#*+"
+
+/* Header flags */
+#define FLAG_DEPTH_MASK 0x3     // Embedding depth - 1
+#define FLAG_COMPRESSED 0x4     // The size field counts the compressed stream written by compress_secret()
+#define FLAG_FRAMED 0x8         // No size field, the data is frames of [32-bit length][bytes] ending with length 0
+#define FLAG_CRC 0x10           // A CRC32C of the data stage bytes follows them (after the end frame when framed)
+#define FLAG_CONTAINER 0x20     // A directory of several files replaces the size field, see container.h
+#define FLAG_SCATTER 0x40       // Everything after the flags word is scattered with a key, see scatter.h
+#define FLAG_SIZE64 0x80        // Sizes are 64-bit, [high 32 bits][low 32 bits]: the size field, the size at the start
+                                // of a compressed stream and the entry sizes of a container index
+#define FLAG_ECC_MASK 0xff00    // Reed-Solomon parity bytes per 255, 0 = none: everything after the flags word is
+                                // in blocks of rs.h, and the flags word is stored three times
+#define FLAG_ECC_SHIFT 8
+#define FLAG_KNOWN 0xffff       // Flags this version understands, images with others are refused
+
+/* Largest size a 32-bit size field holds, larger ones set FLAG_SIZE64 */
+#define SIZE32_MAX 0x7fffffffL
+
+/* Bytes checksummed and then embedded or extracted at a time, so the checksum reads them while they are in cache */
+#define CRC_PIECE (3 << 20)
+
+/* File name that stands for stdin or stdout */
+#define STDIO_NAME "-"
+
 #endif
@@ -0,0 +1,547 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "container.h"
+#include "lsb.h"
+#include "crc32c.h"
+#include "common.h"
+
+/* Print a progress message unless the job runs quietly */
+static void info(const EncodeInfo *encInfo, const char *msg)
+{
+    if (!encInfo->quiet)
+        printf("INFO : %s\n", msg);
+}
+
+/* Store a 32-bit value of the index, most significant byte first like the other fields */
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Bytes of an entry in front of its name: the size and the name length */
+static size_t entry_head(const Container *c)
+{
+    return (c->size64 ? 8 : 4) + 1;
+}
+
+/* Size of a body in the image, padded so the next one starts on a carrier group boundary */
+static uint64_t padded(uint64_t size)
+{
+    return (size + (uint64_t)CONTAINER_ALIGN - 1) / CONTAINER_ALIGN * CONTAINER_ALIGN;
+}
+
+/* Entry names are plain file names, an index that says otherwise could write outside the current directory */
+static int valid_name(const char *name)
+{
+    return name[0] && strcmp(name, ".") && strcmp(name, "..") && strchr(name, '/') == NULL;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp((*(const ContainerEntry *const *)a)->name, (*(const ContainerEntry *const *)b)->name);
+}
+
+/* Whether two entries share a name, they could not both be extracted */
+static int has_duplicates(const Container *c)
+{
+    const ContainerEntry **sorted = malloc(c->count * sizeof(*sorted));
+    int dup = 0;
+
+    if (sorted == NULL)
+        return 1;
+    for (int i = 0; i < c->count; i++)
+        sorted[i] = &c->entries[i];
+    qsort(sorted, c->count, sizeof(*sorted), compare_names);
+    for (int i = 1; i < c->count && !dup; i++)
+        dup = !strcmp(sorted[i - 1]->name, sorted[i]->name);
+    free(sorted);
+    return dup;
+}
+
+Status container_build(Container *c, char *paths[], int count)
+{
+    size_t index_size = 4;
+    struct stat st;
+
+    memset(c, 0, sizeof(*c));
+    if (count < 1 || count > CONTAINER_MAX_FILES)
+        return e_failure;
+    c->entries = calloc(count, sizeof(ContainerEntry));
+    if (c->entries == NULL)
+        return e_failure;
+    c->count = count;
+
+    for (int i = 0; i < count; i++)
+    {
+        ContainerEntry *e = &c->entries[i];
+        const char *name = strrchr(paths[i], '/') ? strrchr(paths[i], '/') + 1 : paths[i];
+
+        if (stat(paths[i], &st) || !S_ISREG(st.st_mode))
+        {
+            fprintf(stderr, "ERROR: %s is not a regular file\n", paths[i]);
+            return e_failure;
+        }
+        if (!valid_name(name) || strlen(name) > CONTAINER_NAME_MAX)
+        {
+            fprintf(stderr, "ERROR: %s has no usable file name\n", paths[i]);
+            return e_failure;
+        }
+        strcpy(e->name, name);
+        e->size = st.st_size;
+        e->offset = c->data_size;
+        e->path = paths[i];
+        c->data_size += padded(e->size);
+        c->size64 |= e->size > SIZE32_MAX;
+    }
+    if (has_duplicates(c))
+    {
+        fprintf(stderr, "ERROR: Two of the files share a name, entries are stored without their directories\n");
+        return e_failure;
+    }
+
+    // Serialize the index once, check_capacity() needs its size and encode_container() its bytes
+    for (int i = 0; i < count; i++)
+        index_size += entry_head(c) + strlen(c->entries[i].name);
+    c->index = malloc(index_size);
+    if (c->index == NULL)
+        return e_failure;
+    c->index_size = index_size;
+    put_u32(c->index, count);
+    unsigned char *p = c->index + 4;
+    for (int i = 0; i < count; i++)
+    {
+        size_t len = strlen(c->entries[i].name);
+        if (c->size64)
+        {
+            put_u32(p, (uint32_t)(c->entries[i].size >> 32));
+            p += 4;
+        }
+        put_u32(p, (uint32_t)c->entries[i].size);
+        p[4] = (unsigned char)len;
+        memcpy(p + 5, c->entries[i].name, len);
+        p += 5 + len;
+    }
+    return e_success;
+}
+
+void container_free(Container *c)
+{
+    free(c->entries);
+    free(c->index);
+    memset(c, 0, sizeof(*c));
+}
+
+uint64_t container_carrier_bytes(const Container *c, int depth, int checksum)
+{
+    return lsb_carrier_bytes(sizeof(int), depth) + lsb_carrier_bytes(c->index_size, depth) +
+           lsb_carrier_bytes(c->data_size, depth) + (checksum ? lsb_carrier_bytes(4 * (size_t)c->count, depth) : 0);
+}
+
+/* Embed n bytes of a body, a piece that is not a multiple of CONTAINER_ALIGN ends the body and is padded */
+static Status embed_piece(const char *p, size_t n, uint32_t *crc, EncodeInfo *encInfo)
+{
+    size_t head = n - n % CONTAINER_ALIGN;
+
+    if (encInfo->checksum)
+        *crc = crc32c_update(*crc, p, n);
+    if (head && encode_data_to_image(p, head, encInfo) == e_failure)
+        return e_failure;
+    if (head == n)
+        return e_success;
+
+    char pad[CONTAINER_ALIGN] = {0};
+    memcpy(pad, p + head, n - head);
+    return encode_data_to_image(pad, CONTAINER_ALIGN, encInfo);
+}
+
+/* Embed the body of entry e, mapped like a single secret when the image is mapped */
+static Status embed_body(const ContainerEntry *e, uint32_t *crc, EncodeInfo *encInfo)
+{
+    FILE *fp = fopen(e->path, "r");
+    Status ret = e_success;
+    size_t total = 0, n;
+
+    if (fp == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", e->path);
+        return e_failure;
+    }
+    metrics_io(encInfo->metrics, 0, 0, 2);
+
+    void *map = encInfo->src_map && e->size ? mmap(NULL, e->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0) : MAP_FAILED;
+    if (map != MAP_FAILED)
+    {
+        // Checksummed pieces stay in cache between the two passes, CRC_PIECE and AIO_WINDOW keep the alignment
+        size_t piece = encInfo->checksum ? CRC_PIECE : AIO_WINDOW;
+        AioWindow win;
+        aio_window_init(&win, map, -1, 0);
+        madvise(map, e->size, MADV_SEQUENTIAL);
+        for (total = 0; ret == e_success && total < e->size; total += n)
+        {
+            n = e->size - total < piece ? e->size - total : piece;
+            ret = embed_piece((const char *)map + total, n, crc, encInfo);
+            aio_window_advance(&win, total + n);
+        }
+        metrics_io(encInfo->metrics, e->size, 0, 1);
+        munmap(map, e->size);
+    }
+    else
+    {
+        // MAX_SECRET_BUF_SIZE is a multiple of CONTAINER_ALIGN, only the last chunk is padded
+        while (ret == e_success && (n = fread(encInfo->secret_data, 1, MAX_SECRET_BUF_SIZE, fp)) > 0)
+        {
+            metrics_io(encInfo->metrics, n, 0, 1);
+            if (total + n > e->size)
+                break;
+            ret = embed_piece(encInfo->secret_data, n, crc, encInfo);
+            total += n;
+        }
+    }
+
+    // The body must have exactly the size recorded in the index
+    if (ferror(fp) || total != e->size)
+    {
+        fprintf(stderr, "ERROR: %s changed while it was being packed\n", e->path);
+        ret = e_failure;
+    }
+    fclose(fp);
+    return ret;
+}
+
+Status encode_container(EncodeInfo *encInfo)
+{
+    Container *c = encInfo->container;
+    Status ret;
+
+    // The index size takes the place of the size field
+    metrics_stage(encInfo->metrics, e_stage_size);
+    info(encInfo, "Encoding container index Started!");
+    ret = encode_size_to_lsb(c->index_size, encInfo);
+    if (ret == e_success)
+        ret = encode_data_to_image((const char *)c->index, c->index_size, encInfo);
+    if (ret == e_failure)
+        return e_failure;
+    c->data_pos = encInfo->carrier_pos;
+    info(encInfo, "Encoding container index Completed!");
+
+    metrics_stage(encInfo->metrics, e_stage_data);
+    info(encInfo, "Encoding container files Started!");
+    unsigned char *crcs = encInfo->checksum ? malloc(4 * (size_t)c->count) : NULL;
+    if (encInfo->checksum && crcs == NULL)
+        return e_failure;
+    for (int i = 0; ret == e_success && i < c->count; i++)
+    {
+        uint32_t crc = 0;
+        ret = embed_body(&c->entries[i], &crc, encInfo);
+        if (crcs)
+            put_u32(crcs + 4 * i, crc);
+    }
+
+    // One CRC32C per file, so a single entry can be checked on its own
+    if (ret == e_success && crcs)
+        ret = encode_data_to_image((const char *)crcs, 4 * (size_t)c->count, encInfo);
+    free(crcs);
+    if (ret == e_success)
+        info(encInfo, "Encoding container files Completed!");
+    return ret;
+}
+
+Status container_read_index(Dec_Info *decinfo, Container *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->size64 = (decinfo->flags & FLAG_SIZE64) != 0;
+
+    int size = decode_size_from_lsb(decinfo);
+    size_t room = (decinfo->plan.capacity - decinfo->carrier_pos) * decinfo->depth / 8;
+    if (size < 4 || (size_t)size > room)
+        return e_failure;
+    c->index = malloc(size);
+    if (c->index == NULL)
+        return e_failure;
+    c->index_size = size;
+
+    // Blocks of DATA_LEN keep every read on a carrier group boundary
+    for (int done = 0, n; done < size; done += n)
+    {
+        n = size - done < DATA_LEN ? size - done : DATA_LEN;
+        if (decode_data_from_image(n, (char *)c->index + done, decinfo) == e_failure)
+            return e_failure;
+    }
+    c->data_pos = decinfo->carrier_pos;
+
+    uint32_t count = get_u32(c->index);
+    if (count < 1 || count > CONTAINER_MAX_FILES)
+        return e_failure;
+    c->entries = calloc(count, sizeof(ContainerEntry));
+    if (c->entries == NULL)
+        return e_failure;
+    c->count = count;
+
+    // Offsets are not stored, every body starts where the padded one before it ends
+    const unsigned char *p = c->index + 4, *end = c->index + size;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ContainerEntry *e = &c->entries[i];
+        if (end - p < (long)entry_head(c))
+            return e_failure;
+        if (c->size64)
+        {
+            e->size = (uint64_t)get_u32(p) << 32;
+            p += 4;
+        }
+        e->size |= get_u32(p);
+        if (end - p - 5 < p[4])
+            return e_failure;
+        memcpy(e->name, p + 5, p[4]);
+        e->name[p[4]] = '\0';
+        e->offset = c->data_size;
+        if (!valid_name(e->name) || e->size > (c->size64 ? (uint64_t)INT64_MAX : (uint64_t)SIZE32_MAX))
+            return e_failure;
+        c->data_size += padded(e->size);
+        p += 5 + p[4];
+    }
+    if (p != end || decinfo->carrier_pos + lsb_carrier_bytes(c->data_size, decinfo->depth) > decinfo->plan.capacity)
+        return e_failure;
+    return e_success;
+}
+
+/* Check the CRC32C of every wanted entry against the table after the last body, read once and forward only */
+static Status check_crcs(Dec_Info *decinfo, const Container *c, const char *wanted, const uint32_t *crcs)
+{
+    size_t len = 4 * (size_t)c->count;
+
+    if (decode_seek(decinfo, c->data_pos + lsb_carrier_bytes(c->data_size, decinfo->depth)) == e_failure)
+        return e_failure;
+    for (size_t done = 0, n; done < len; done += n)
+    {
+        // DATA_LEN is a multiple of 4, a block never splits a slot
+        n = len - done < DATA_LEN ? len - done : DATA_LEN;
+        if (decode_data_from_image(n, decinfo->data, decinfo) == e_failure)
+            return e_failure;
+        for (size_t k = 0; k < n; k += 4)
+        {
+            size_t i = (done + k) / 4;
+            if (wanted[i] && get_u32((const unsigned char *)decinfo->data + k) != crcs[i])
+            {
+                fprintf(stderr, "ERROR: Checksum mismatch, %s in %s is corrupted\n", c->entries[i].name,
+                        decinfo->input_fname);
+                return e_failure;
+            }
+        }
+    }
+    return e_success;
+}
+
+Status container_extract(Dec_Info *decinfo, const Container *c, int i)
+{
+    const ContainerEntry *e = &c->entries[i];
+
+    // The body starts on a group boundary, its position follows from the index
+    if (decode_seek(decinfo, c->data_pos + lsb_carrier_bytes(e->offset, decinfo->depth)) == e_failure)
+        return e_failure;
+    decinfo->crc = 0;
+    decinfo->data_len = e->size;
+
+    // Large bodies of a mapped image are decoded in parallel stripes like a single secret
+    if (decode_data_to_mapped_output(decinfo) == e_failure)
+    {
+        long done = 0;
+        for (int n; done < decinfo->data_len; done += n)
+        {
+            n = decinfo->data_len - done < DATA_LEN ? decinfo->data_len - done : DATA_LEN;
+            if (decode_data_from_image(n, decinfo->data, decinfo) == e_failure)
+                return e_failure;
+            if (decinfo->flags & FLAG_CRC)
+                decinfo->crc = crc32c_update(decinfo->crc, decinfo->data, n);
+            if (fwrite(decinfo->data, 1, n, decinfo->fp_output) != (size_t)n)
+                return e_failure;
+            metrics_io(decinfo->metrics, 0, n, 1);
+        }
+    }
+    return fflush(decinfo->fp_output) ? e_failure : e_success;
+}
+
+Status do_pack(EncodeInfo *encInfo, char *files[])
+{
+    Container c;
+    int count = 0;
+    Status ret = e_failure;
+
+    while (files[count])
+        count++;
+    info(encInfo, "Packing started!");
+    metrics_start(encInfo->metrics, "pack");
+    metrics_stage(encInfo->metrics, e_stage_open);
+    if (container_build(&c, files, count) == e_failure)
+    {
+        container_free(&c);
+        return e_failure;
+    }
+
+    // Everything except the secret is opened the way open_files() does it
+    metrics_io(encInfo->metrics, 0, 0, 2);
+    encInfo->fptr_src_image = open_stream(encInfo->src_image_fname, "r");
+    encInfo->fptr_stego_image = encInfo->fptr_src_image ? open_stream(encInfo->stego_image_fname, "w+") : NULL;
+    if (encInfo->fptr_stego_image)
+    {
+        encInfo->container = &c;
+        encInfo->extn_secret_file[0] = '\0';
+        encInfo->src_pos = 0;
+        map_files(encInfo);
+
+        ret = encode_image(encInfo);
+        if (ret == e_failure)
+            discard_files(encInfo);
+        else if (close_files(encInfo) == e_failure)
+            ret = e_failure;
+        encInfo->container = NULL;
+    }
+    else
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n",
+                encInfo->fptr_src_image ? encInfo->stego_image_fname : encInfo->src_image_fname);
+        close_files(encInfo);
+    }
+    if (ret == e_success)
+    {
+        metrics_finish(encInfo->metrics);
+        if (!encInfo->quiet)
+            printf("INFO : Packed %d files, %llu bytes with padding\n", c.count, (unsigned long long)c.data_size);
+    }
+    container_free(&c);
+    return ret;
+}
+
+/* Index of the entry called name, -1 when there is none */
+static int find_entry(const Container *c, const char *name)
+{
+    for (int i = 0; i < c->count; i++)
+        if (!strcmp(c->entries[i].name, name))
+            return i;
+    return -1;
+}
+
+/* Extract the entries that are wanted, in index order so a piped image is read forward only */
+static Status extract_entries(Dec_Info *decinfo, const Container *c, char *names[])
+{
+    char *wanted = calloc(c->count, 1);
+    uint32_t *crcs = calloc(c->count, sizeof(uint32_t));
+    Status ret = wanted && crcs ? e_success : e_failure;
+
+    for (int i = 0; ret == e_success && i < c->count; i++)
+        wanted[i] = names[0] == NULL;
+    for (int j = 0; ret == e_success && names[j]; j++)
+    {
+        int i = find_entry(c, names[j]);
+        if (i < 0)
+        {
+            fprintf(stderr, "ERROR: %s has no entry called %s\n", decinfo->input_fname, names[j]);
+            ret = e_failure;
+        }
+        else
+            wanted[i] = 1;
+    }
+
+    for (int i = 0; ret == e_success && i < c->count; i++)
+    {
+        if (!wanted[i])
+            continue;
+        decinfo->fp_output = fopen(c->entries[i].name, "w+");
+        if (decinfo->fp_output == NULL)
+        {
+            perror("fopen");
+            fprintf(stderr, "ERROR: Unable to open file %s\n", c->entries[i].name);
+            ret = e_failure;
+            break;
+        }
+        metrics_io(decinfo->metrics, 0, 0, 1);
+        ret = container_extract(decinfo, c, i);
+        crcs[i] = decinfo->crc;
+        if (fclose(decinfo->fp_output))
+            ret = e_failure;
+        decinfo->fp_output = NULL;
+        if (ret == e_success && !decinfo->quiet)
+            printf("INFO : Extracted %s, %llu bytes\n", c->entries[i].name, (unsigned long long)c->entries[i].size);
+    }
+
+    // The checksums sit after the last body, they are checked once every wanted entry is out
+    if (ret == e_success && (decinfo->flags & FLAG_CRC))
+        ret = check_crcs(decinfo, c, wanted, crcs);
+    free(wanted);
+    free(crcs);
+    return ret;
+}
+
+Status do_unpack(const char *fname, char *names[], int extract, int quiet, const char *key, Metrics *metrics)
+{
+    Dec_Info *decinfo = calloc(1, sizeof(Dec_Info));
+    Container c = {0};
+    Status ret = e_failure;
+
+    if (decinfo == NULL)
+        return e_failure;
+    decinfo->input_fname = (char *)fname;
+    decinfo->quiet = 1; // The stage messages of the decoder are not wanted here
+    decinfo->threads = 0;
+    decinfo->key = key;
+    decinfo->metrics = metrics;
+    metrics_start(metrics, extract ? "extract" : "list");
+    metrics_stage(metrics, e_stage_open);
+    metrics_io(metrics, 0, 0, 1);
+    decinfo->fp_input = open_stream(fname, "r");
+    if (decinfo->fp_input == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", fname);
+        free(decinfo);
+        return e_failure;
+    }
+    map_input_file(decinfo);
+
+    metrics_stage(metrics, e_stage_header);
+    if (skip_header(decinfo) == e_success && decode_magic_string(decinfo) == e_success &&
+        decode_extension(decinfo) == e_success)
+    {
+        metrics_stage(metrics, e_stage_size);
+        if (!(decinfo->flags & FLAG_CONTAINER))
+            fprintf(stderr, "ERROR: %s holds a single file, decode it with -d\n", fname);
+        else if (container_read_index(decinfo, &c) == e_failure)
+            fprintf(stderr, "ERROR: The container index of %s is corrupted\n", fname);
+        else
+            ret = e_success;
+    }
+
+    if (ret == e_success && !extract)
+    {
+        printf("INFO : %s : container of %d files (depth %d)\n", fname, c.count, decinfo->depth);
+        for (int i = 0; i < c.count; i++)
+            printf("%12llu  %s\n", (unsigned long long)c.entries[i].size, c.entries[i].name);
+    }
+    else if (ret == e_success)
+    {
+        metrics_stage(metrics, e_stage_data);
+        decinfo->quiet = quiet;
+        ret = extract_entries(decinfo, &c, names);
+    }
+
+    container_free(&c);
+    close_files_for_decode(decinfo);
+    free(decinfo);
+    if (ret == e_success)
+        metrics_finish(metrics);
+    return ret;
+}
@@ -0,0 +1,72 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stdint.h>
+#include "types.h"
+#include "encode.h"
+#include "decode.h"
+
+/*
+ * Container images hold any number of files of any type (FLAG_CONTAINER).
+ * The extension field is empty and the size field is replaced by the
+ * directory: the size of the index, then the index itself
+ *
+ *     [32-bit count] count x ([32-bit size][8-bit name length][name])
+ *
+ * followed by the file bodies back to back. Entry sizes are 64-bit, high
+ * half first, when one of the files does not fit 32 bits (FLAG_SIZE64).
+ * Every body is padded with zero bytes to a multiple of CONTAINER_ALIGN, so
+ * each one starts on a carrier group boundary at every depth and its
+ * carrier position follows from the index alone: one entry is extracted
+ * without decoding the ones before it.
+ * With FLAG_CRC a table of one CRC32C per file follows the last body.
+ */
+
+#define CONTAINER_ALIGN 12      // Body alignment in data bytes, a multiple of every depth
+#define CONTAINER_NAME_MAX 255  // Longest entry name, names are stored without directories
+#define CONTAINER_MAX_FILES 65536
+
+typedef struct _ContainerEntry
+{
+    char name[CONTAINER_NAME_MAX + 1];
+    uint64_t size;              // Size of the file
+    uint64_t offset;            // Offset of the body from the first one, a multiple of CONTAINER_ALIGN
+    const char *path;           // File packed by the encoder, NULL on the decoder side
+} ContainerEntry;
+
+typedef struct _Container
+{
+    int count;                  // Number of entries
+    int size64;                 // Entry sizes are 64-bit in the index (FLAG_SIZE64)
+    ContainerEntry *entries;
+    unsigned char *index;       // Serialized index as stored in the image
+    uint32_t index_size;
+    uint64_t data_size;         // Padded size of all bodies
+    size_t data_pos;            // Logical carrier position of the first body, set while encoding or decoding
+} Container;
+
+/* Build the index of the files in paths, fails on unreadable files or duplicate names */
+Status container_build(Container *c, char *paths[], int count);
+
+/* Release what container_build() or container_read_index() allocated */
+void container_free(Container *c);
+
+/* Carrier bytes taken by the directory, the bodies and the CRC table at depth */
+uint64_t container_carrier_bytes(const Container *c, int depth, int checksum);
+
+/* Encode the directory and every body, replaces the size and data stages */
+Status encode_container(EncodeInfo *encInfo);
+
+/* Decode the directory that follows the extension field, leaves carrier_pos on the first body */
+Status container_read_index(Dec_Info *decinfo, Container *c);
+
+/* Extract entry i to decinfo->fp_output, only its own carrier bytes are read. With FLAG_CRC, decinfo->crc receives its CRC32C */
+Status container_extract(Dec_Info *decinfo, const Container *c, int i);
+
+/* Pack files into a copy of encInfo->src_image_fname written to encInfo->stego_image_fname */
+Status do_pack(EncodeInfo *encInfo, char *files[]);
+
+/* List the entries of a container image, or extract the named ones (all of them when names is empty) */
+Status do_unpack(const char *fname, char *names[], int extract, int quiet, const char *key, Metrics *metrics);
+
+#endif
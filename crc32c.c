@@ -0,0 +1,115 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_X86 1
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78U     // Reversed Castagnoli polynomial
+
+/* table[k][b] is the CRC of byte b followed by k zero bytes */
+static uint32_t table[8][256];
+
+/* Portable slicing-by-8, eight table lookups per 8 input bytes */
+static uint32_t update_slice8(uint32_t crc, const unsigned char *p, size_t n)
+{
+    while (n && ((uintptr_t)p & 7))
+    {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        n--;
+    }
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    }
+    while (n--)
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32C_X86
+/* One crc32 instruction per 8 input bytes */
+__attribute__((target("sse4.2")))
+static uint32_t update_sse42(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t c = crc;
+
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c = _mm_crc32_u64(c, x);
+    }
+    crc = (uint32_t)c;
+    while (n--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+typedef struct
+{
+    const char *name;
+    uint32_t (*update)(uint32_t crc, const unsigned char *p, size_t n);
+} Crc32cKernel;
+
+static const Crc32cKernel kernels[] = {
+#ifdef CRC32C_X86
+    {"sse4.2", update_sse42},
+#endif
+    {"slice8", update_slice8},
+};
+
+static const Crc32cKernel *active = &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+
+/* Build the tables and pick the instruction when the CPU has it, before main() runs */
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint32_t c = b;
+        for (int j = 0; j < 8; j++)
+            c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+        table[0][b] = c;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int b = 0; b < 256; b++)
+            table[k][b] = table[0][table[k - 1][b] & 0xFF] ^ (table[k - 1][b] >> 8);
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        active = &kernels[0];
+#endif
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t n)
+{
+    return ~active->update(~crc, data, n);
+}
+
+const char *crc32c_kernel_name(void)
+{
+    return active->name;
+}
+
+int crc32c_select_kernel(const char *name)
+{
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        if (strcmp(kernels[k].name, name))
+            continue;
+#ifdef CRC32C_X86
+        if (kernels[k].update == update_sse42 && !__builtin_cpu_supports("sse4.2"))
+            return -1;
+#endif
+        active = &kernels[k];
+        return 0;
+    }
+    return -1;
+}
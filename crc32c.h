@@ -0,0 +1,22 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), the checksum stored after the payload of FLAG_CRC
+ * images. The SSE4.2 crc32 instruction is used when the CPU has it,
+ * slicing-by-8 tables otherwise, both give the same values.
+ */
+
+/* Extend crc (0 to start) with n bytes of data, e.g. crc32c_update(0, "123456789", 9) == 0xE3069283 */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t n);
+
+/* Name of the implementation selected for this CPU, "sse4.2" or "slice8" */
+const char *crc32c_kernel_name(void);
+
+/* Force an implementation by name, 0 on success */
+int crc32c_select_kernel(const char *name);
+
+#endif
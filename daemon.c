@@ -0,0 +1,578 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "encode.h"
+#include "decode.h"
+#include "steg.h"
+#include "metrics.h"
+#include "pool.h"
+#include "job.h"
+#include "lsb.h"
+#include "common.h"
+
+/* Warm state of one worker, allocated once and reused for every request */
+typedef struct
+{
+    Job *job;               // Job context, its arena also holds the inline images
+    int conn;               // Connection being served, -1 when idle
+} Worker;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int queue[DAEMON_QUEUE]; // Accepted connections, a ring
+    size_t head, count;
+    int stopping;
+    Worker *workers;
+
+    pthread_mutex_t stats_lock;
+    uint64_t jobs, failed;
+    uint64_t samples[DAEMON_SAMPLES]; // Service times, a ring over the latest jobs
+} Daemon;
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* Read exactly n bytes, fails on EOF or error */
+static Status read_full(int fd, void *buf, size_t n)
+{
+    for (size_t done = 0; done < n;)
+    {
+        ssize_t k = read(fd, (char *)buf + done, n - done);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return e_failure;
+        done += k;
+    }
+    return e_success;
+}
+
+static Status write_full(int fd, const void *buf, size_t n)
+{
+    for (size_t done = 0; done < n;)
+    {
+        ssize_t k = send(fd, (const char *)buf + done, n - done, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return e_failure;
+        done += k;
+    }
+    return e_success;
+}
+
+/* Receive a request header and the descriptors sent with it, returns the number of descriptors or -1 at the end */
+static int read_request(int conn, DaemonRequest *req, int fds[DAEMON_MAX_FDS])
+{
+    char control[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    struct iovec iov = {req, sizeof(*req)};
+    struct msghdr msg = {0};
+    int nfds = 0;
+    ssize_t k;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do
+        k = recvmsg(conn, &msg, 0);
+    while (k < 0 && errno == EINTR);
+    if (k <= 0)
+        return -1;
+
+    // The descriptors arrive with the first byte of the header
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        {
+            int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < n; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (nfds < DAEMON_MAX_FDS)
+                    fds[nfds++] = fd;
+                else
+                    close(fd);
+            }
+        }
+
+    if ((size_t)k < sizeof(*req) && read_full(conn, (char *)req + k, sizeof(*req) - k) == e_failure)
+        nfds = -1;
+    if (nfds >= 0 && req->magic != DAEMON_MAGIC)
+        nfds = -1;
+    if (nfds < 0)
+        for (int i = 0; i < DAEMON_MAX_FDS && fds[i] >= 0; i++)
+            close(fds[i]);
+    return nfds;
+}
+
+/* Encoder state of the worker's context with the options of a request */
+static EncodeInfo *start_encode(Worker *w, const DaemonRequest *req)
+{
+    EncodeInfo *encInfo = job_encode(w->job);
+    encInfo->quiet = 1;
+    encInfo->threads = 1; // The workers already run one job per CPU
+    encInfo->depth = req->depth;
+    encInfo->compress = (req->flags & DAEMON_COMPRESS) != 0;
+    encInfo->checksum = (req->flags & DAEMON_CRC) != 0;
+    memcpy(encInfo->extn_secret_file, req->extn, MAX_FILE_SUFFIX);
+    encInfo->extn_secret_file[MAX_FILE_SUFFIX - 1] = '\0';
+    return encInfo;
+}
+
+/* Run an encode on the source image, secret and stego image descriptors, which are closed afterwards */
+static Status encode_fds(Worker *w, const DaemonRequest *req, int fds[])
+{
+    EncodeInfo *encInfo = start_encode(w, req);
+    struct stat st;
+    Status ret = e_failure;
+
+    encInfo->fptr_src_image = fdopen(fds[0], "r");
+    encInfo->fptr_secret = fdopen(fds[1], "r");
+    encInfo->fptr_stego_image = fdopen(fds[2], "w+");
+
+    // From here on the streams own the descriptors
+    if (encInfo->fptr_src_image == NULL)
+        close(fds[0]);
+    if (encInfo->fptr_secret == NULL)
+        close(fds[1]);
+    if (encInfo->fptr_stego_image == NULL)
+        close(fds[2]);
+    if (encInfo->fptr_src_image && encInfo->fptr_secret && encInfo->fptr_stego_image)
+    {
+        encInfo->framed = fstat(fds[1], &st) || !S_ISREG(st.st_mode);
+        map_files(encInfo);
+        ret = encode_image(encInfo);
+    }
+    if (close_files(encInfo) == e_failure)
+        ret = e_failure;
+    return ret;
+}
+
+/* Run a decode on the stego image and output descriptors, which are closed afterwards */
+static Status decode_fds(Worker *w, int fds[])
+{
+    Dec_Info *decinfo = job_decode(w->job);
+    Status ret = e_failure;
+
+    decinfo->quiet = 1;
+    decinfo->threads = 1;
+    decinfo->fp_input = fdopen(fds[0], "r");
+    decinfo->fp_output = fdopen(fds[1], "w+");
+    if (decinfo->fp_input == NULL)
+        close(fds[0]);
+    if (decinfo->fp_output == NULL)
+        close(fds[1]);
+    if (decinfo->fp_input && decinfo->fp_output)
+    {
+        map_input_file(decinfo);
+        ret = decode_image(decinfo);
+    }
+    if (close_files_for_decode(decinfo) == e_failure)
+        ret = e_failure;
+    return ret;
+}
+
+/* Encode the inline carrier in buf in place, with the payload that follows it */
+static StegStatus encode_inline(Worker *w, const DaemonRequest *req, char *buf)
+{
+    BmpPlan plan;
+
+    if (req->depth > LSB_MAX_DEPTH)
+        return e_steg_invalid_arg;
+    if (bmp_parse((const unsigned char *)buf, req->carrier_len, req->carrier_len, &plan) == e_failure)
+        return e_steg_bad_carrier;
+
+    // Same stages as steg_encode(), on the worker's context
+    EncodeInfo *encInfo = start_encode(w, req);
+    encInfo->src_map = buf;
+    encInfo->stego_map = buf;
+    encInfo->map_size = req->carrier_len;
+    encInfo->secret_mem = buf + req->carrier_len;
+    encInfo->size_secret_file = req->payload_len;
+
+    StegStatus ret = e_steg_ok;
+    if (encInfo->compress && compress_secret(encInfo) == e_failure)
+        ret = e_steg_no_memory;
+    else if (check_capacity(encInfo) == e_failure)
+        ret = e_steg_no_capacity;
+    else if (encode_image(encInfo) == e_failure)
+        ret = e_steg_corrupt;
+    return ret;
+}
+
+/* Decode the inline stego image in buf, *out receives the payload. The first attempt decodes into room for
+ * any uncompressed payload, a larger compressed one is retried once with its size known */
+static StegStatus decode_inline(Worker *w, const DaemonRequest *req, const char *buf, char **out, size_t *len,
+                                char *extn)
+{
+    BmpPlan plan;
+    size_t cap = req->carrier_len / 2;
+
+    if (bmp_parse((const unsigned char *)buf, req->carrier_len, req->carrier_len, &plan) == e_failure)
+        return e_steg_bad_carrier;
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        Dec_Info *decinfo = job_decode(w->job);
+        if ((*out = arena_alloc(&w->job->arena, cap)) == NULL)
+            return e_steg_no_memory;
+        decinfo->in_map = buf;
+        decinfo->map_size = req->carrier_len;
+        decinfo->out_mem = *out;
+        decinfo->out_cap = cap;
+        decinfo->quiet = 1;
+        decinfo->threads = 1;
+        decinfo->data_len = -1;
+
+        if (decode_image(decinfo) == e_success)
+        {
+            *len = decinfo->data_len;
+            strcpy(extn, decinfo->extn);
+            return e_steg_ok;
+        }
+
+        // Tell apart the stages that can fail from how far decoding got, like steg_decode()
+        if (strcmp(decinfo->magic_string, MAGIC_STRING) && strcmp(decinfo->magic_string, MAGIC_STRING_EXT))
+            return e_steg_no_payload;
+        if (decinfo->data_len < 0 || (size_t)decinfo->data_len <= cap)
+            return e_steg_corrupt;
+        cap = decinfo->data_len;
+    }
+    return e_steg_corrupt;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Percentiles over the kept samples */
+static void get_stats(Daemon *d, DaemonStats *st)
+{
+    pthread_mutex_lock(&d->stats_lock);
+    size_t n = d->jobs < DAEMON_SAMPLES ? d->jobs : DAEMON_SAMPLES;
+    uint64_t *sorted = malloc((n ? n : 1) * sizeof(uint64_t));
+    memset(st, 0, sizeof(*st));
+    st->jobs = d->jobs;
+    st->failed = d->failed;
+    if (sorted)
+        memcpy(sorted, d->samples, n * sizeof(uint64_t));
+    pthread_mutex_unlock(&d->stats_lock);
+
+    if (sorted && n)
+    {
+        qsort(sorted, n, sizeof(uint64_t), cmp_u64);
+        st->p50_ns = sorted[(n - 1) / 2];
+        st->p99_ns = sorted[(n - 1) * 99 / 100];
+        st->max_ns = sorted[n - 1];
+    }
+    free(sorted);
+}
+
+static void record(Daemon *d, uint64_t ns, int failed)
+{
+    pthread_mutex_lock(&d->stats_lock);
+    d->samples[d->jobs % DAEMON_SAMPLES] = ns;
+    d->jobs++;
+    d->failed += failed;
+    pthread_mutex_unlock(&d->stats_lock);
+}
+
+/* Serve the requests of one connection until the client closes it, a broken request ends the connection */
+static void serve(Daemon *d, Worker *w, int conn)
+{
+    DaemonRequest req;
+    int fds[DAEMON_MAX_FDS];
+    int nfds;
+
+    for (;;)
+    {
+        for (int i = 0; i < DAEMON_MAX_FDS; i++)
+            fds[i] = -1;
+        if ((nfds = read_request(conn, &req, fds)) < 0)
+            return;
+
+        uint64_t start = metrics_now_ns();
+        DaemonResponse resp = {DAEMON_MAGIC, 0, 0, 0, {0}};
+        const void *body = NULL;
+        DaemonStats st;
+        int wanted = req.op == e_daemon_encode_fds ? 3 : req.op == e_daemon_decode_fds ? 2 : 0;
+
+        if (nfds != wanted)
+        {
+            for (int i = 0; i < nfds; i++)
+                close(fds[i]);
+            return;
+        }
+
+        job_reset(w->job);
+        if (req.op == e_daemon_encode_fds)
+            resp.status = encode_fds(w, &req, fds) == e_success ? 0 : -1;
+        else if (req.op == e_daemon_decode_fds)
+            resp.status = decode_fds(w, fds) == e_success ? 0 : -1;
+        else if (req.op == e_daemon_encode_inline || req.op == e_daemon_decode_inline)
+        {
+            // Inline images are read into the arena, the stream cannot be resynced after a bad length
+            uint64_t payload = req.op == e_daemon_encode_inline ? req.payload_len : 0;
+            char *buf = NULL;
+            if (req.carrier_len > DAEMON_MAX_INLINE || payload > DAEMON_MAX_INLINE)
+            {
+                // Refused with a status so the client learns why, the bytes it sends next cannot be skipped
+                resp.status = e_steg_invalid_arg;
+                write_full(conn, &resp, sizeof(resp));
+                return;
+            }
+            if ((buf = arena_alloc(&w->job->arena, req.carrier_len + payload)) == NULL ||
+                read_full(conn, buf, req.carrier_len + payload) == e_failure)
+                return;
+            start = metrics_now_ns();
+
+            if (req.op == e_daemon_encode_inline)
+            {
+                resp.status = encode_inline(w, &req, buf);
+                resp.len = resp.status == e_steg_ok ? req.carrier_len : 0;
+                body = buf;
+            }
+            else
+            {
+                size_t len = 0;
+                char *out = NULL;
+                resp.status = decode_inline(w, &req, buf, &out, &len, resp.extn);
+                resp.len = resp.status == e_steg_ok ? len : 0;
+                body = out;
+            }
+        }
+        else if (req.op == e_daemon_stats)
+        {
+            get_stats(d, &st);
+            resp.len = sizeof(st);
+            body = &st;
+        }
+        else
+            return;
+
+        resp.ns = metrics_now_ns() - start;
+        if (req.op != e_daemon_stats)
+            record(d, resp.ns, resp.status != 0);
+        if (write_full(conn, &resp, sizeof(resp)) == e_failure ||
+            (resp.len && write_full(conn, body, resp.len) == e_failure))
+            return;
+    }
+}
+
+static Daemon daemon_state;
+
+static void *worker_main(void *arg)
+{
+    Daemon *d = &daemon_state;
+    Worker *w = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&d->lock);
+        while (d->count == 0 && !d->stopping)
+            pthread_cond_wait(&d->ready, &d->lock);
+        if (d->count == 0)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return NULL;
+        }
+        int conn = d->queue[d->head];
+        d->head = (d->head + 1) % DAEMON_QUEUE;
+        d->count--;
+        w->conn = conn;
+        pthread_mutex_unlock(&d->lock);
+
+        serve(d, w, conn);
+
+        pthread_mutex_lock(&d->lock);
+        w->conn = -1;
+        pthread_mutex_unlock(&d->lock);
+        close(conn);
+    }
+}
+
+/* Whether nothing listens on the socket file at addr any more, a daemon that ended without cleaning up left it */
+static int stale_socket(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 0;
+    int live = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+    close(fd);
+    return !live;
+}
+
+/* Listening socket at path, only a stale socket file left by a previous run is replaced */
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr = {0};
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "ERROR: Socket path %s is too long\n", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Anything else at path is kept: a file the path was mistyped for, or the socket of a running daemon
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode) || !stale_socket(&addr))
+        {
+            fprintf(stderr, "ERROR: %s already exists and is %s\n", path,
+                    S_ISSOCK(st.st_mode) ? "served by another daemon" : "not a socket");
+            return -1;
+        }
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, DAEMON_QUEUE))
+    {
+        perror("bind");
+        fprintf(stderr, "ERROR: Unable to listen on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+Status do_daemon(const char *path, int nthreads)
+{
+    Daemon *d = &daemon_state;
+    struct sigaction sa = {0};
+    pthread_t *tids;
+    int fd, started = 0;
+
+    if (nthreads <= 0)
+        nthreads = pool_cpu_count();
+
+    // No SA_RESTART, so a signal interrupts accept()
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((fd = listen_on(path)) < 0)
+        return e_failure;
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->ready, NULL);
+    pthread_mutex_init(&d->stats_lock, NULL);
+    d->workers = calloc(nthreads, sizeof(Worker));
+    tids = calloc(nthreads, sizeof(pthread_t));
+    if (d->workers == NULL || tids == NULL)
+    {
+        fprintf(stderr, "ERROR: Memory allocation failed\n");
+        free(d->workers);
+        free(tids);
+        close(fd);
+        unlink(path);
+        return e_failure;
+    }
+
+    // The workers block the stop signals, so they always interrupt accept() in this thread
+    sigset_t stop, old;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, &old);
+
+    // The job contexts hold large scratch buffers, each worker allocates them once
+    for (int i = 0; i < nthreads; i++)
+    {
+        Worker *w = &d->workers[i];
+        w->conn = -1;
+        w->job = job_new();
+        if (w->job == NULL || pthread_create(&tids[i], NULL, worker_main, w))
+        {
+            job_free(w->job);
+            break;
+        }
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (started)
+        printf("INFO : Serving on %s with %d workers\n", path, started);
+    else
+        fprintf(stderr, "ERROR: Unable to start the workers\n");
+
+    // Hand every connection to the queue, a full queue refuses it rather than stalling the accept loop
+    while (started && !stop_requested)
+    {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("accept");
+                break;
+            }
+            continue;
+        }
+        pthread_mutex_lock(&d->lock);
+        if (d->count == DAEMON_QUEUE)
+            close(conn);
+        else
+        {
+            d->queue[(d->head + d->count) % DAEMON_QUEUE] = conn;
+            d->count++;
+            pthread_cond_signal(&d->ready);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    close(fd);
+    unlink(path);
+
+    // Drop the waiting connections and end the ones being served, workers finish their current job first
+    pthread_mutex_lock(&d->lock);
+    d->stopping = 1;
+    for (; d->count; d->count--, d->head = (d->head + 1) % DAEMON_QUEUE)
+        close(d->queue[d->head]);
+    for (int i = 0; i < started; i++)
+        if (d->workers[i].conn >= 0)
+            shutdown(d->workers[i].conn, SHUT_RDWR);
+    pthread_cond_broadcast(&d->ready);
+    pthread_mutex_unlock(&d->lock);
+
+    for (int i = 0; i < started; i++)
+    {
+        Worker *w = &d->workers[i];
+        pthread_join(tids[i], NULL);
+        job_free(w->job);
+    }
+    free(d->workers);
+    free(tids);
+
+    DaemonStats st;
+    get_stats(d, &st);
+    printf("INFO : %llu jobs, %llu failed, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", (unsigned long long)st.jobs,
+           (unsigned long long)st.failed, st.p50_ns / 1e6, st.p99_ns / 1e6, st.max_ns / 1e6);
+    return started ? e_success : e_failure;
+}
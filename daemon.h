@@ -0,0 +1,84 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Daemon mode: serve encode and decode jobs over a Unix domain socket, so
+ * a job costs a round trip instead of a process start, argument checks and
+ * a fresh set of job buffers. Every connection carries any number of
+ * requests, each a DaemonRequest answered by a DaemonResponse:
+ *
+ *   file jobs    the open files travel with the request as SCM_RIGHTS
+ *                descriptors: source image, secret and stego image for an
+ *                encode, stego image and output for a decode. The stego
+ *                image and the output must be open for reading and writing.
+ *   inline jobs  the images travel in the stream: carrier_len bytes of
+ *                carrier then payload_len bytes of payload for an encode,
+ *                answered by the stego image; carrier_len bytes of stego
+ *                image for a decode, answered by the payload.
+ *   stats        answered by a DaemonStats with the latency percentiles.
+ *
+ * Connections are served by a fixed set of worker threads, each keeping
+ * its job context (job.h) from one request to the next; the inline images
+ * live in its arena, so steady inline traffic does not touch the heap.
+ * Because an inline job is held in memory whole, its image and payload are
+ * each limited to DAEMON_MAX_INLINE; a larger one is answered with
+ * e_steg_invalid_arg and the connection is closed. Larger images and
+ * payloads go through file jobs, which stream them like -e and -d.
+ * Integers are in host byte order, the socket never leaves the machine.
+ */
+
+#define DAEMON_MAGIC 0x53544744u        // "STGD"
+#define DAEMON_MAX_FDS 3
+#define DAEMON_MAX_INLINE (1ull << 31)  // Largest inline image or payload, file jobs have no limit
+#define DAEMON_QUEUE 256                // Accepted connections waiting for a worker
+#define DAEMON_SAMPLES 65536            // Latest service times kept for the percentiles
+
+/* Request flags */
+#define DAEMON_COMPRESS 0x1     // --compress
+#define DAEMON_CRC 0x2          // --crc
+
+typedef enum
+{
+    e_daemon_encode_fds,
+    e_daemon_decode_fds,
+    e_daemon_encode_inline,
+    e_daemon_decode_inline,
+    e_daemon_stats
+} DaemonOp;
+
+typedef struct _DaemonRequest
+{
+    uint32_t magic;         // DAEMON_MAGIC
+    uint32_t op;            // DaemonOp
+    uint32_t depth;         // Carrier LSBs per carrier byte for encodes, 1..4 (0 = 1)
+    uint32_t flags;         // DAEMON_COMPRESS, DAEMON_CRC
+    char extn[8];           // Extension recorded by encodes, NUL terminated
+    uint64_t carrier_len;   // Inline jobs, bytes of carrier or stego image that follow
+    uint64_t payload_len;   // Inline encodes, bytes of payload after the carrier
+} DaemonRequest;
+
+typedef struct _DaemonResponse
+{
+    uint32_t magic;         // DAEMON_MAGIC
+    int32_t status;         // 0 on success, the StegStatus of a failed inline job, -1 for a failed file job
+    uint64_t ns;            // Service time in the daemon, from the request header to the response
+    uint64_t len;           // Bytes that follow: stego image, payload or DaemonStats
+    char extn[8];           // Extension recorded with a decoded payload
+} DaemonResponse;
+
+typedef struct _DaemonStats
+{
+    uint64_t jobs;          // Jobs served
+    uint64_t failed;        // Jobs that failed
+    uint64_t p50_ns;        // Median service time over the latest DAEMON_SAMPLES jobs
+    uint64_t p99_ns;        // 99th percentile over the same jobs
+    uint64_t max_ns;        // Slowest of them
+} DaemonStats;
+
+/* Serve on the socket at path with nthreads workers (0 = one per CPU) until SIGINT or SIGTERM */
+Status do_daemon(const char *path, int nthreads);
+
+#endif
@@ -1,206 +1,871 @@
-#include<stdio.h>
-#include <unistd.h> // For the sleep() function
-#include "decode.h"
-#include<string.h>
-#include "types.h"
-#include "common.h"
-
-// Main function to perform decoding
-Status do_decoding(Dec_Info *decinfo)
-{
-    printf("Decoding started!\n");
-    // Open the input and output files for decoding
-    OperationType ret = open_files_for_decode(decinfo);
-    if(ret == e_failure)
-        return e_failure;
-    sleep(1);
-    
-    // Skip the BMP header
-    ret = skip_header(decinfo->fp_input);
-    if(ret == e_failure)
-        return e_failure;
-    printf("Header skipping completed!\n");
-    sleep(1);
-
-    // Decode the magic string to verify the file
-    ret = decode_magic_string(decinfo);
-    if(ret == e_failure)
-        return e_failure;
-    sleep(1);
-
-    // Decode the file extension of the hidden data
-    ret = decode_extension(decinfo);
-    if(ret == e_failure)
-        return e_failure;
-    sleep(1);
-
-    // Decode the actual hidden data from the image
-    ret = decode_data(decinfo);
-    if(ret == e_failure)
-        return e_failure;
-    sleep(1);
-
-    printf("Decoding completed successfully!\n");
-    return e_success;
-}
-
-// Function to open the required files for decoding
-Status open_files_for_decode(Dec_Info *decinfo)
-{
-    printf("\t\t\t\t\t\t:::::::OPEN FILES STARTED ::::::::\n");
-    
-    // Open the input image file
-    decinfo->fp_input = fopen(decinfo->input_fname, "r");
-    if(decinfo->fp_input == NULL)
-    {
-        perror("fopen");
-        fprintf(stderr, "ERROR: Unable to open file %s\n", decinfo->input_fname);
-        return e_failure;
-    }
-
-    // Open the output file to write the decoded data
-    decinfo->fp_output = fopen(decinfo->output_fname, "w");
-    if(decinfo->fp_output == NULL)
-    {
-        perror("fopen");
-        fprintf(stderr, "ERROR: Unable to open file %s\n", decinfo->output_fname);
-        return e_failure;
-    }
-    
-    printf("\t\t\t\t\t\t:::::::OPEN FILES COMPLETED ::::::::\n");
-    sleep(1); // Delay after file opening
-    return e_success;
-}
-
-// Function to skip the BMP header
-Status skip_header(FILE *fp)
-{
-    fseek(fp, 54, SEEK_SET); // Skip the first 54 bytes (BMP header)
-    int offset = ftell(fp);  // Get the current file position
-    printf("offset = %d\n", offset);
-
-    // Verify if the file pointer moved to the correct position
-    if(offset == 54)
-        return e_success;
-    else
-        return e_failure;
-}
-
-// Function to decode the magic string for file verification
-Status decode_magic_string(Dec_Info *decinfo)
-{
-    printf("\t\t\t\t\t\t:::::::MAGIC STRING DECODE STARTED ::::::::\n");
-    
-    // Decode the size of the magic string
-    decinfo->magic_string_len = decode_size_from_lsb(decinfo->fp_input);
-    printf("length of magic string: %d\n", decinfo->magic_string_len);
-    
-    // Decode the magic string data
-    OperationType ret = decode_data_from_image(decinfo->magic_string_len, decinfo->magic_string, decinfo->fp_input, decinfo->fp_output);
-    printf("magic string = %s\n", decinfo->magic_string);
-    printf("\t\t\t\t\t\t:::::::MAGIC STRING DECODE COMPLETED ::::::::\n");
-    sleep(1); // Delay after decoding the magic string
-
-    if(ret == e_failure)
-        return e_failure;
-    else
-        return e_success;
-}
-
-// Function to decode the size of data from the least significant bits (LSBs)
-int decode_size_from_lsb(FILE *fp)
-{
-    char buffer[32];
-    int len = 0;
-    fread(buffer, 32, 1, fp); // Read 32 bits from the image
-
-    // Decode the size from the LSBs
-    for(int i = 31; i >= 0; i--)
-    {
-        if(buffer[31 - i] & 0x01)
-            len |= (1 << i); // Set the bit if LSB is 1
-        else
-            len &= (~(1 << i)); // Clear the bit if LSB is 0
-    }
-    return len;
-}
-
-// Function to decode data from the image
-Status decode_data_from_image(int len, char *data, FILE *fp_input, FILE *fp_output)
-{
-    char buffer[8];
-    int i;
-
-    // Decode each byte from the image data
-    for(i = 0; i < len; i++)
-    {
-        fread(buffer, 8, 1, fp_input); // Read 8 bits (1 byte) from the image
-        data[i] = decode_byte_from_lsb(buffer, i);
-    }
-    data[i] = '\0'; // Null-terminate the string
-    printf("string = %s\n", data);
-    
-    // Return success or failure based on the decoding result
-    if(i == len)
-        return e_success;
-    else
-        return e_failure;
-}
-
-// Function to decode a single byte from LSBs of image data
-char decode_byte_from_lsb(char *data, int i)
-{
-    char ch = 0;
-
-    // Extract bits from the LSBs
-    for(int j = 0; j < 8; j++)
-    {
-        if(data[j] & 0x01)
-            ch |= (1 << (7 - j)); // Set the bit if LSB is 1
-        else
-            ch &= ~(1 << (7 - j)); // Clear the bit if LSB is 0
-    }
-    return ch;
-}
-
-// Function to decode the file extension of the secret file
-Status decode_extension(Dec_Info *decinfo)
-{
-    printf("\t\t\t\t\t\t:::::::EXTENSION DECODE STARTED ::::::::\n");
-    
-    // Decode the length of the extension
-    decinfo->extn_len = decode_size_from_lsb(decinfo->fp_input);
-    printf("file extn size = %d\n", decinfo->extn_len);
-    
-    // Decode the extension data
-    OperationType ret = decode_data_from_image(decinfo->extn_len, decinfo->extn, decinfo->fp_input, decinfo->fp_output);
-    printf("\t\t\t\t\t\t:::::::EXTENSION DECODE COMPLETED ::::::::\n");
-    sleep(1); // Delay after decoding the extension
-
-    if(ret == e_success)
-        return e_success;
-    else
-        return e_failure;
-}
-
-// Function to decode the main data from the image
-Status decode_data(Dec_Info *decinfo)
-{
-    printf("\t\t\t\t\t\t:::::::DATA DECODE STARTED ::::::::\n");
-    
-    // Decode the size of the data
-    decinfo->data_len = decode_size_from_lsb(decinfo->fp_input);
-    printf("secret data size = %d\n", decinfo->data_len);
-    
-    // Decode the actual data
-    OperationType ret = decode_data_from_image(decinfo->data_len, decinfo->data, decinfo->fp_input, decinfo->fp_output);
-    if(ret == e_success)
-    {
-        fwrite(decinfo->data, decinfo->data_len, 1, decinfo->fp_output); // Write the decoded data to the output file
-        printf("\t\t\t\t\t\t:::::::DATA DECODE COMPLETED ::::::::\n");
-        sleep(1); // Delay after data decoding
-        return e_success;
-    }
-    else
-        return e_failure;
-}
+#include<stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "decode.h"
+#include "encode.h"
+#include "lsb.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "container.h"
+#include<string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "common.h"
+
+// Print a progress message unless the job runs quietly
+static void info(const Dec_Info *decinfo, const char *fmt, ...)
+{
+    va_list ap;
+
+    if(decinfo->quiet)
+        return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+// Main function to perform decoding
+Status do_decoding(Dec_Info *decinfo)
+{
+    info(decinfo, "Decoding started!\n");
+    metrics_start(decinfo->metrics, "decode");
+    // Open the input and output files for decoding
+    if(open_files_for_decode(decinfo) == e_failure)
+        return e_failure;
+
+    // Run the extraction stages on the opened files
+    if(decode_image(decinfo) == e_failure)
+        return e_failure;
+
+    // Unmap the image and close the output so every block is on disk
+    if(close_files_for_decode(decinfo) == e_failure)
+        return e_failure;
+    metrics_finish(decinfo->metrics);
+
+    info(decinfo, "Decoding completed successfully!\n");
+    return e_success;
+}
+
+// Function to run every stage after open_files_for_decode(), on files or caller buffers
+Status decode_image(Dec_Info *decinfo)
+{
+    Status ret;
+
+    // Skip the BMP header
+    metrics_stage(decinfo->metrics, e_stage_header);
+    ret = skip_header(decinfo);
+    if(ret == e_failure)
+        return e_failure;
+    info(decinfo, "Header skipping completed!\n");
+
+    // Decode the magic string to verify the file
+    metrics_stage(decinfo->metrics, e_stage_magic);
+    ret = decode_magic_string(decinfo);
+    if(ret == e_failure)
+        return e_failure;
+
+    // Decode the file extension of the hidden data
+    metrics_stage(decinfo->metrics, e_stage_extension);
+    ret = decode_extension(decinfo);
+    if(ret == e_failure)
+        return e_failure;
+
+    // Decode the actual hidden data from the image
+    ret = decode_data(decinfo);
+    if(ret == e_success && decinfo->ecc)
+        info(decinfo, "error correction repaired %ld damaged bytes\n", decinfo->ecc_fixed);
+    return ret;
+}
+
+// Function to open the required files for decoding
+Status open_files_for_decode(Dec_Info *decinfo)
+{
+    info(decinfo, "\t\t\t\t\t\t:::::::OPEN FILES STARTED ::::::::\n");
+    
+    metrics_io(decinfo->metrics, 0, 0, 2);
+
+    // Open the input image file
+    decinfo->fp_input = open_stream(decinfo->input_fname, "r");
+    if(decinfo->fp_input == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", decinfo->input_fname);
+        return e_failure;
+    }
+
+    // Open the output file to write the decoded data
+    decinfo->fp_output = open_stream(decinfo->output_fname, "w+");
+    if(decinfo->fp_output == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", decinfo->output_fname);
+        return e_failure;
+    }
+    
+    // Prefer reading the LSBs from a mapping, stdio keeps working if mapping fails
+    map_input_file(decinfo);
+
+    info(decinfo, "\t\t\t\t\t\t:::::::OPEN FILES COMPLETED ::::::::\n");
+    return e_success;
+}
+
+// Function to map the encoded image read-only
+Status map_input_file(Dec_Info *decinfo)
+{
+    struct stat st;
+
+    decinfo->in_map = NULL;
+    decinfo->map_size = 0;
+    decinfo->carrier_pos = 0;
+    aio_window_init(&decinfo->in_win, NULL, -1, 0);
+
+    // Only regular, non-empty files can be mapped, and PNG pixels only exist once inflated
+    if(fstat(fileno(decinfo->fp_input), &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || png_sniff(decinfo->fp_input))
+        return e_failure;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(decinfo->fp_input), 0);
+    if(map == MAP_FAILED)
+        return e_failure;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    decinfo->in_map = map;
+    decinfo->map_size = st.st_size;
+    aio_window_init(&decinfo->in_win, map, -1, 0);
+    if(decinfo->metrics)
+        decinfo->metrics->backend = "mmap";
+    metrics_io(decinfo->metrics, 0, 0, 3);
+    return e_success;
+}
+
+// Function to release the mapping and close the files
+Status close_files_for_decode(Dec_Info *decinfo)
+{
+    Status ret = e_success;
+
+    if(decinfo->in_map)
+        munmap((void *)decinfo->in_map, decinfo->map_size);
+    decinfo->in_map = NULL;
+    scatter_free(decinfo->scatter);
+    decinfo->scatter = NULL;
+    png_reader_close(decinfo->png_in);
+    decinfo->png_in = NULL;
+
+    if(decinfo->fp_input)
+        close_stream(decinfo->fp_input);
+    if(decinfo->fp_output && close_stream(decinfo->fp_output))
+        ret = e_failure;
+    decinfo->fp_input = NULL;
+    decinfo->fp_output = NULL;
+    return ret;
+}
+
+// Function to parse the BMP header and skip to the pixel array
+Status skip_header(Dec_Info *decinfo)
+{
+    unsigned char hdr[BMP_HEADER_SIZE];
+    Status ret;
+
+    // With a mapping, the header is parsed in place and skipping it is just resetting the carrier position
+    if(decinfo->in_map)
+        ret = bmp_parse((const unsigned char *)decinfo->in_map, decinfo->map_size, decinfo->map_size, &decinfo->plan);
+    else if(png_sniff(decinfo->fp_input))
+    {
+        // The chunks in front of the pixel data are read through, the rows are inflated as the payload needs them
+        decinfo->png_in = png_reader_open(decinfo->fp_input, NULL, decinfo->arena, &decinfo->plan);
+        ret = decinfo->png_in ? e_success : e_failure;
+        if(decinfo->png_in)
+        {
+            if(decinfo->metrics)
+                decinfo->metrics->backend = "png";
+            metrics_io(decinfo->metrics, png_bytes_read(decinfo->png_in), 0, 3);
+        }
+    }
+    else
+    {
+        ret = bmp_read_plan(decinfo->fp_input, hdr, &decinfo->plan);
+        metrics_io(decinfo->metrics, BMP_HEADER_SIZE, 0, 3);
+    }
+    if(ret == e_failure)
+    {
+        if(decinfo->input_fname)
+            fprintf(stderr, "ERROR: %s is not an uncompressed 24bpp or 32bpp BMP image or an 8-bit non-interlaced PNG image\n",
+                    decinfo->input_fname);
+        return e_failure;
+    }
+    decinfo->carrier_pos = 0;
+    decinfo->in_pos = 0;
+    if(decinfo->in_map || decinfo->png_in)
+        return e_success;
+
+    // Skip everything before the pixel array by reading it, the image may be a pipe
+    for(decinfo->in_pos = BMP_HEADER_SIZE; decinfo->in_pos < decinfo->plan.data_offset;)
+    {
+        size_t n = decinfo->plan.data_offset - decinfo->in_pos;
+        if(n > sizeof(decinfo->image_data))
+            n = sizeof(decinfo->image_data);
+        if(fread(decinfo->image_data, 1, n, decinfo->fp_input) != n)
+            return e_failure;
+        metrics_io(decinfo->metrics, n, 0, 1);
+        decinfo->in_pos += n;
+    }
+    info(decinfo, "offset = %ld\n", (long)decinfo->in_pos);
+    return e_success;
+}
+
+// Function to decode the magic string for file verification
+Status decode_magic_string(Dec_Info *decinfo)
+{
+    info(decinfo, "\t\t\t\t\t\t:::::::MAGIC STRING DECODE STARTED ::::::::\n");
+
+    // The magic string and the flags are always stored at depth 1
+    decinfo->depth = 1;
+    decinfo->flags = 0;
+    decinfo->ecc = 0;
+    
+    // Decode the size of the magic string
+    decinfo->magic_string_len = decode_size_from_lsb(decinfo);
+    info(decinfo, "length of magic string: %d\n", decinfo->magic_string_len);
+    if(decinfo->magic_string_len < 0 || decinfo->magic_string_len >= MAG_SIZE)
+        return e_failure;
+    
+    // Decode the magic string data
+    OperationType ret = decode_data_from_image(decinfo->magic_string_len, decinfo->magic_string, decinfo);
+    decinfo->magic_string[decinfo->magic_string_len] = '\0';
+    info(decinfo, "magic string = %s\n", decinfo->magic_string);
+    if(ret == e_failure)
+        return e_failure;
+
+    // Only images written by the encoder carry one of the two magic strings
+    if(!strcmp(decinfo->magic_string, MAGIC_STRING_EXT))
+        ret = decode_header_flags(decinfo);
+    else if(strcmp(decinfo->magic_string, MAGIC_STRING))
+    {
+        // Buffers passed in by library callers have no name, they only get the status
+        if(decinfo->input_fname)
+            fprintf(stderr, "ERROR: %s does not contain hidden data\n", decinfo->input_fname);
+        return e_failure;
+    }
+    info(decinfo, "\t\t\t\t\t\t:::::::MAGIC STRING DECODE COMPLETED ::::::::\n");
+
+    return ret;
+}
+
+// Function to decode one copy of the flags word
+static Status decode_flags_word(Dec_Info *decinfo, uint *flags)
+{
+    unsigned char bytes[4];
+
+    if(decode_data_from_image(4, (char *)bytes, decinfo) == e_failure)
+        return e_failure;
+    *flags = (uint)bytes[0] << 24 | (uint)bytes[1] << 16 | (uint)bytes[2] << 8 | bytes[3];
+    return e_success;
+}
+
+// Function to decode the flags word and switch to the depth it records
+Status decode_header_flags(Dec_Info *decinfo)
+{
+    uint flags, b, c;
+    if(decode_flags_word(decinfo, &flags) == e_failure)
+        return e_failure;
+
+    // An image with error correction has two more copies, each bit is what at least two of them say
+    if(flags & FLAG_ECC_MASK)
+    {
+        if(decode_flags_word(decinfo, &b) == e_failure || decode_flags_word(decinfo, &c) == e_failure)
+            return e_failure;
+        flags = (flags & b) | (flags & c) | (b & c);
+    }
+
+    // A newer encoder may have changed the layout in ways this one cannot follow
+    if(flags & ~FLAG_KNOWN)
+    {
+        if(decinfo->input_fname)
+            fprintf(stderr, "ERROR: %s was written by a newer version, header flags 0x%x are not supported\n",
+                    decinfo->input_fname, flags);
+        return e_failure;
+    }
+
+    decinfo->flags = flags;
+    decinfo->depth = (flags & FLAG_DEPTH_MASK) + 1;
+    info(decinfo, "header flags = 0x%x, depth = %d\n", decinfo->flags, decinfo->depth);
+
+    // Everything after the flags word is scattered, decode_extension() refuses to go on without the key
+    scatter_free(decinfo->scatter);
+    decinfo->scatter = NULL;
+    if((flags & FLAG_SCATTER) && decinfo->key && decinfo->in_map)
+    {
+        decinfo->scatter = scatter_new(decinfo->key, decinfo->carrier_pos, decinfo->plan.capacity);
+        if(decinfo->scatter == NULL)
+            return e_failure;
+    }
+
+    // From here on the fields come out of repaired blocks, containers are never written with error correction
+    int ecc = (flags & FLAG_ECC_MASK) >> FLAG_ECC_SHIFT;
+    if(ecc && ((flags & FLAG_CONTAINER) || rs_init(&decinfo->rs, ecc)))
+    {
+        if(decinfo->input_fname)
+            fprintf(stderr, "ERROR: %s has inconsistent header flags 0x%x\n", decinfo->input_fname, flags);
+        return e_failure;
+    }
+    decinfo->ecc = ecc;
+    decinfo->ecc_pos = decinfo->ecc_len = 0;
+    decinfo->ecc_fixed = 0;
+    return e_success;
+}
+
+// Function to decode the size of data from the least significant bits (LSBs)
+int decode_size_from_lsb(Dec_Info *decinfo)
+{
+    unsigned char bytes[4];
+
+    // Decode the size from the LSBs, most significant byte first
+    if(decode_data_from_image(4, (char *)bytes, decinfo) == e_failure)
+        return -1;
+    return (int)((uint)bytes[0] << 24 | (uint)bytes[1] << 16 | (uint)bytes[2] << 8 | bytes[3]);
+}
+
+// Function to decode a size field, two 32-bit halves with the high one first in FLAG_SIZE64 images
+long decode_length_from_lsb(Dec_Info *decinfo)
+{
+    unsigned char bytes[8];
+    int n = decinfo->flags & FLAG_SIZE64 ? 8 : 4;
+
+    if(decode_data_from_image(n, (char *)bytes, decinfo) == e_failure)
+        return -1;
+    uint64_t size = 0;
+    for(int i = 0; i < n; i++)
+        size = size << 8 | bytes[i];
+    // Sizes never reach the sign bit, one that does is damage
+    return size > (n == 8 ? (uint64_t)LONG_MAX : (uint64_t)SIZE32_MAX) ? -1 : (long)size;
+}
+
+// Function to read the next n image bytes into image_data, the pixel bytes of the next rows for a PNG
+static Status read_image(Dec_Info *decinfo, size_t n)
+{
+    if(decinfo->png_in)
+        return png_read(decinfo->png_in, (unsigned char *)decinfo->image_data, n);
+    return fread(decinfo->image_data, 1, n, decinfo->fp_input) == n ? e_success : e_failure;
+}
+
+// Function to decode data from the next carrier bytes
+static Status read_carrier(int len, char *data, Dec_Info *decinfo)
+{
+    if(len < 0 || len > DATA_LEN)
+        return e_failure;
+    int depth = decinfo->depth > 0 ? decinfo->depth : 1;
+    size_t carrier = lsb_carrier_bytes(len, depth);
+    if(decinfo->carrier_pos + carrier > decinfo->plan.capacity)
+        return e_failure;
+    size_t end = bmp_phys_end(&decinfo->plan, decinfo->carrier_pos + carrier);
+
+    // Carrier bytes come straight from the mapping, or from one fread of the whole block
+    if(decinfo->in_map)
+    {
+        if(end > decinfo->map_size)
+            return e_failure;
+        if(decinfo->scatter)
+            scatter_decode_bits(decinfo->scatter, &decinfo->plan, decinfo->carrier_pos, decinfo->in_map, len, data, depth);
+        else
+            bmp_decode_bits(&decinfo->plan, decinfo->carrier_pos, decinfo->in_map, 0, len, data, depth, 1);
+        metrics_io(decinfo->metrics, carrier, 0, 0);
+        if(!decinfo->scatter)
+            aio_window_advance(&decinfo->in_win, end);
+    }
+    else
+    {
+        // The block starts at the current file position, which may still be on row padding
+        size_t start = decinfo->in_pos;
+        if(end - start > sizeof(decinfo->image_data))
+            return e_failure;
+        if(read_image(decinfo, end - start) == e_failure)
+            return e_failure;
+        bmp_decode_bits(&decinfo->plan, decinfo->carrier_pos, decinfo->image_data, start, len, data, depth, 1);
+        metrics_io(decinfo->metrics, end - start, 0, 1);
+        decinfo->in_pos = end;
+    }
+    decinfo->carrier_pos += carrier;
+
+    return e_success;
+}
+
+// Function to read the next Reed-Solomon block and repair it
+static Status read_ecc_block(Dec_Info *decinfo)
+{
+    if(read_carrier(RS_BLOCK, (char *)decinfo->ecc_block, decinfo) == e_failure)
+        return e_failure;
+    int fixed = rs_decode_block(&decinfo->rs, decinfo->ecc_block);
+    if(fixed < 0)
+    {
+        if(decinfo->input_fname)
+            fprintf(stderr, "ERROR: %s is damaged beyond what its error correction can repair\n", decinfo->input_fname);
+        return e_failure;
+    }
+    decinfo->ecc_fixed += fixed;
+    decinfo->ecc_pos = 0;
+    decinfo->ecc_len = RS_DATA_BYTES(decinfo->ecc);
+    return e_success;
+}
+
+// Function to decode data from the image, out of repaired blocks once the flags word set ecc
+Status decode_data_from_image(int len, char *data, Dec_Info *decinfo)
+{
+    if(!decinfo->ecc)
+        return read_carrier(len, data, decinfo);
+    if(len < 0)
+        return e_failure;
+
+    // A block is only read when the bytes asked for reach into it
+    for(size_t left = len, n; left > 0; left -= n, data += n)
+    {
+        if(decinfo->ecc_pos == decinfo->ecc_len && read_ecc_block(decinfo) == e_failure)
+            return e_failure;
+        n = decinfo->ecc_len - decinfo->ecc_pos < left ? decinfo->ecc_len - decinfo->ecc_pos : left;
+        memcpy(data, decinfo->ecc_block + decinfo->ecc_pos, n);
+        decinfo->ecc_pos += n;
+    }
+    return e_success;
+}
+
+// Function to move to logical carrier position pos, reading forward when the image is a pipe
+Status decode_seek(Dec_Info *decinfo, size_t pos)
+{
+    if(pos > decinfo->plan.capacity)
+        return e_failure;
+
+    // Reads start at in_pos, which must be the file offset just past carrier byte pos - 1
+    if(!decinfo->in_map)
+    {
+        size_t target = bmp_phys_end(&decinfo->plan, pos);
+        if(!decinfo->png_in && fseek(decinfo->fp_input, target, SEEK_SET) == 0)
+            metrics_io(decinfo->metrics, 0, 0, 1);
+        else if(target < decinfo->in_pos)
+            return e_failure;
+        else
+        {
+            for(size_t n; decinfo->in_pos < target; decinfo->in_pos += n)
+            {
+                n = target - decinfo->in_pos < sizeof(decinfo->image_data) ? target - decinfo->in_pos : sizeof(decinfo->image_data);
+                if(read_image(decinfo, n) == e_failure)
+                    return e_failure;
+                metrics_io(decinfo->metrics, n, 0, 1);
+            }
+        }
+        decinfo->in_pos = target;
+    }
+    decinfo->carrier_pos = pos;
+    return e_success;
+}
+
+// Function to decode a single byte from LSBs of image data
+char decode_byte_from_lsb(char *data, int i)
+{
+    char ch;
+
+    // Extract the 8 bits from the LSBs, without branches
+    lsb_decode_bytes(data, 1, &ch);
+    return ch;
+}
+
+// Function to decode the file extension of the secret file
+Status decode_extension(Dec_Info *decinfo)
+{
+    info(decinfo, "\t\t\t\t\t\t:::::::EXTENSION DECODE STARTED ::::::::\n");
+
+    // The positions of a scattered payload are only known with the key, and need the whole image mapped
+    if((decinfo->flags & FLAG_SCATTER) && decinfo->scatter == NULL)
+    {
+        if(decinfo->input_fname)
+            fprintf(stderr, "ERROR: The hidden data in %s is scattered, decoding it needs --key and a regular file\n",
+                    decinfo->input_fname);
+        return e_failure;
+    }
+    
+    // Decode the length of the extension
+    decinfo->extn_len = decode_size_from_lsb(decinfo);
+    info(decinfo, "file extn size = %d\n", decinfo->extn_len);
+    if(decinfo->extn_len < 0 || decinfo->extn_len >= EXTEN_LEN)
+        return e_failure;
+    
+    // Decode the extension data
+    OperationType ret = decode_data_from_image(decinfo->extn_len, decinfo->extn, decinfo);
+    decinfo->extn[decinfo->extn_len] = '\0';
+    info(decinfo, "file extn = %s\n", decinfo->extn);
+    info(decinfo, "\t\t\t\t\t\t:::::::EXTENSION DECODE COMPLETED ::::::::\n");
+
+    if(ret == e_success)
+        return e_success;
+    else
+        return e_failure;
+}
+
+// Function to extract len bytes at carrier_pos from the mapping, checksummed piece by piece while they are in cache.
+// out_win, when not NULL, releases the output mapping behind the image window
+static void decode_mapped(Dec_Info *decinfo, size_t len, char *out, AioWindow *out_win)
+{
+    int crc = decinfo->flags & FLAG_CRC;
+    size_t piece = crc ? CRC_PIECE : decinfo->in_win.map ? AIO_WINDOW : len;
+
+    for(size_t done = 0, n; done < len; done += n)
+    {
+        n = len - done < piece ? len - done : piece;
+        size_t pos = decinfo->carrier_pos + lsb_carrier_bytes(done, decinfo->depth);
+        if(decinfo->scatter)
+            scatter_decode_bits(decinfo->scatter, &decinfo->plan, pos, decinfo->in_map, n, out + done, decinfo->depth);
+        else
+            bmp_decode_bits(&decinfo->plan, pos, decinfo->in_map, 0, n, out + done, decinfo->depth, decinfo->threads);
+        if(crc)
+            decinfo->crc = crc32c_update(decinfo->crc, out + done, n);
+
+        // Payloads larger than memory stream through both mappings
+        if(!decinfo->scatter)
+            aio_window_advance(&decinfo->in_win, bmp_phys_end(&decinfo->plan, pos + lsb_carrier_bytes(n, decinfo->depth)));
+        if(out_win)
+            aio_window_advance(out_win, done + n);
+    }
+}
+
+// Function to decode the whole payload straight into a mapping of the output file
+Status decode_data_to_mapped_output(Dec_Info *decinfo)
+{
+    size_t len = decinfo->data_len;
+    size_t carrier = lsb_carrier_bytes(len, decinfo->depth);
+    struct stat st;
+
+    // Only worth it when the payload spans several stripes
+    if(!decinfo->in_map || len < 2 * LSB_STRIPE_SIZE || decinfo->carrier_pos + carrier > decinfo->plan.capacity ||
+       bmp_phys_end(&decinfo->plan, decinfo->carrier_pos + carrier) > decinfo->map_size)
+        return e_failure;
+
+    // The file must be new to this decode and writable through a mapping: a redirected stdout may be opened
+    // write only or for append, or already hold data, and is then written through stdio like a pipe
+    int fd = fileno(decinfo->fp_output);
+    int fl = fcntl(fd, F_GETFL);
+    if(decinfo->fp_output == stdout || fl < 0 || (fl & O_ACCMODE) != O_RDWR || (fl & O_APPEND) ||
+       fstat(fd, &st) || !S_ISREG(st.st_mode) || lseek(fd, 0, SEEK_CUR) != 0 || ftell(decinfo->fp_output) != 0)
+        return e_failure;
+
+    // The file is only sized once the mapping exists, a failure leaves it as it was
+    void *out = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(out == MAP_FAILED)
+        return e_failure;
+    if(ftruncate(fd, len))
+    {
+        munmap(out, len);
+        return e_failure; // The block loop rewrites all len bytes from the start
+    }
+
+    AioWindow out_win;
+    aio_window_init(&out_win, out, fd, 1);
+    decode_mapped(decinfo, len, out, &out_win);
+    decinfo->carrier_pos += carrier;
+    metrics_io(decinfo->metrics, carrier, len, 2);
+
+    // Leave the stdio position at the end, as if the data had been written through it
+    Status ret = munmap(out, len) ? e_failure : e_success;
+    fseek(decinfo->fp_output, 0, SEEK_END);
+    return ret;
+}
+
+// Function to decode the whole payload into the caller buffer out_mem
+Status decode_data_to_memory(Dec_Info *decinfo)
+{
+    size_t len = decinfo->data_len;
+    size_t carrier = lsb_carrier_bytes(len, decinfo->depth);
+
+    // The payload size is known now, the caller checks data_len against out_cap on failure
+    if(!decinfo->in_map || len > decinfo->out_cap || decinfo->carrier_pos + carrier > decinfo->plan.capacity ||
+       bmp_phys_end(&decinfo->plan, decinfo->carrier_pos + carrier) > decinfo->map_size)
+        return e_failure;
+
+    decode_mapped(decinfo, len, decinfo->out_mem, NULL);
+    decinfo->carrier_pos += carrier;
+    metrics_io(decinfo->metrics, carrier, len, 0);
+    return e_success;
+}
+
+// Function to write a decoded block at offset to the caller buffer or the output file
+static Status write_output(Dec_Info *decinfo, const char *buf, size_t n, size_t offset)
+{
+    if(decinfo->out_mem)
+    {
+        if(offset + n > decinfo->out_cap)
+            return e_failure;
+        memcpy(decinfo->out_mem + offset, buf, n);
+        return e_success;
+    }
+    if(fwrite(buf, 1, n, decinfo->fp_output) != n)
+        return e_failure;
+    metrics_io(decinfo->metrics, 0, n, 1);
+    return e_success;
+}
+
+// Read a 32-bit value of the compressed stream, most significant byte first
+static uint get_u32(const unsigned char *p)
+{
+    return (uint)p[0] << 24 | (uint)p[1] << 16 | (uint)p[2] << 8 | p[3];
+}
+
+// Function to decode a compressed stream of stream_len bytes (see compress_secret())
+Status decode_compressed_data(Dec_Info *decinfo, long stream_len)
+{
+    // The stream is parsed as it is decoded: its size, then record headers and record bodies
+    enum { e_total, e_record, e_body } state = e_total;
+    unsigned char head[8];
+    unsigned char *buf = head;
+    size_t need = decinfo->flags & FLAG_SIZE64 ? 8 : 4, have = 0;
+    uint raw_len = 0, stored_len = 0;
+    size_t written = 0;
+
+    for(long done = 0; done < stream_len;)
+    {
+        // Blocks of DATA_LEN keep every read on a carrier group boundary
+        int n = stream_len - done < DATA_LEN ? stream_len - done : DATA_LEN;
+        if(decode_data_from_image(n, decinfo->data, decinfo) == e_failure)
+            return e_failure;
+        if(decinfo->flags & FLAG_CRC)
+            decinfo->crc = crc32c_update(decinfo->crc, decinfo->data, n);
+        done += n;
+
+        for(int i = 0; i < n;)
+        {
+            size_t take = need - have < (size_t)(n - i) ? need - have : (size_t)(n - i);
+            memcpy(buf + have, decinfo->data + i, take);
+            have += take;
+            i += take;
+            if(have < need)
+                break;
+
+            if(state == e_total)
+            {
+                // Size of the original secret, lets library callers size their buffer
+                uint64_t size = get_u32(head);
+                if(need == 8)
+                    size = size << 32 | get_u32(head + 4);
+                if(size > (need == 8 ? (uint64_t)LONG_MAX : (uint64_t)SIZE32_MAX))
+                    return e_failure;
+                decinfo->data_len = size;
+                if(decinfo->out_mem && (size_t)decinfo->data_len > decinfo->out_cap)
+                    return e_failure;
+                state = e_record;
+                need = 8;
+            }
+            else if(state == e_record)
+            {
+                raw_len = get_u32(head);
+                stored_len = get_u32(head + 4);
+                if(raw_len == 0 || raw_len > LZ_CHUNK || stored_len == 0 || stored_len > raw_len)
+                    return e_failure;
+                state = e_body;
+                buf = decinfo->lz_in;
+                need = stored_len;
+            }
+            else
+            {
+                // A record as large as its chunk was stored without compression
+                const char *out = (const char *)decinfo->lz_in;
+                if(stored_len < raw_len)
+                {
+                    if(lz_decompress(decinfo->lz_in, stored_len, decinfo->lz_out, LZ_CHUNK) != raw_len)
+                        return e_failure;
+                    out = (const char *)decinfo->lz_out;
+                }
+                if(written + raw_len > (size_t)decinfo->data_len ||
+                   write_output(decinfo, out, raw_len, written) == e_failure)
+                    return e_failure;
+                written += raw_len;
+                state = e_record;
+                buf = head;
+                need = 8;
+            }
+            have = 0;
+        }
+    }
+
+    // The stream must end on a record boundary with every byte of the secret written
+    if(state != e_record || have != 0 || written != (size_t)decinfo->data_len)
+        return e_failure;
+    if(!decinfo->out_mem && fflush(decinfo->fp_output))
+        return e_failure;
+    info(decinfo, "\t\t\t\t\t\t:::::::DATA DECODE COMPLETED ::::::::\n");
+    return e_success;
+}
+
+// Function to report stored and decoded checksums that differ
+static Status checksum_mismatch(const Dec_Info *decinfo)
+{
+    if(decinfo->input_fname)
+        fprintf(stderr, "ERROR: Checksum mismatch, the hidden data in %s is corrupted\n", decinfo->input_fname);
+    return e_failure;
+}
+
+// Function to check the CRC32C stored after the data
+Status decode_checksum(Dec_Info *decinfo)
+{
+    unsigned char bytes[4];
+
+    if(decode_data_from_image(4, (char *)bytes, decinfo) == e_failure)
+        return e_failure;
+    if(get_u32(bytes) != decinfo->crc)
+        return checksum_mismatch(decinfo);
+    info(decinfo, "checksum = 0x%08x verified\n", decinfo->crc);
+    return e_success;
+}
+
+// Function to decode frames of [length][bytes] up to the end frame of length 0
+Status decode_framed_data(Dec_Info *decinfo)
+{
+    unsigned char head[4];
+    size_t need = 4, have = 0;
+    int in_body = 0, in_crc = 0;
+    size_t written = 0;
+    int crc = decinfo->flags & FLAG_CRC;
+
+    for(;;)
+    {
+        // Blocks of DATA_LEN keep every read on a carrier group boundary, the last one stops at the capacity
+        size_t left = (decinfo->plan.capacity - decinfo->carrier_pos) * decinfo->depth / 8;
+        int n = left < DATA_LEN ? (int)left : DATA_LEN;
+        // A protected stream is read up to the end of the current block, there may be no block after the end frame
+        if(decinfo->ecc)
+            n = decinfo->ecc_pos < decinfo->ecc_len ? decinfo->ecc_len - decinfo->ecc_pos : RS_DATA_BYTES(decinfo->ecc);
+        if(n == 0 || decode_data_from_image(n, decinfo->data, decinfo) == e_failure)
+            return e_failure; // The image ended before the end frame
+
+        for(int i = 0; i < n;)
+        {
+            size_t take = need - have < (size_t)(n - i) ? need - have : (size_t)(n - i);
+            if(crc && !in_crc)
+                decinfo->crc = crc32c_update(decinfo->crc, decinfo->data + i, take);
+            if(in_body)
+            {
+                // Frame bodies go straight to the output
+                if(write_output(decinfo, decinfo->data + i, take, written) == e_failure)
+                    return e_failure;
+                written += take;
+            }
+            else
+                memcpy(head + have, decinfo->data + i, take);
+            have += take;
+            i += take;
+            if(have < need)
+                break;
+
+            have = 0;
+            if(in_body)
+            {
+                in_body = 0;
+                need = 4;
+                continue;
+            }
+            if(in_crc && get_u32(head) != decinfo->crc)
+                return checksum_mismatch(decinfo);
+            if(!in_crc && get_u32(head) == 0 && crc)
+            {
+                // The checksum of every frame, the end frame included, follows the end frame
+                in_crc = 1;
+                continue;
+            }
+            if(in_crc || get_u32(head) == 0)
+            {
+                // End of the stream, the bytes after it are untouched carrier
+                decinfo->data_len = written;
+                info(decinfo, "secret data size = %ld\n", decinfo->data_len);
+                if(!decinfo->out_mem && fflush(decinfo->fp_output))
+                    return e_failure;
+                info(decinfo, "\t\t\t\t\t\t:::::::DATA DECODE COMPLETED ::::::::\n");
+                return e_success;
+            }
+            need = get_u32(head);
+            in_body = 1;
+        }
+    }
+}
+
+// Function to decode a payload of data_len bytes through the fastest path that applies
+static Status decode_payload(Dec_Info *decinfo)
+{
+    // Large payloads from a mapped image are decoded in parallel stripes into a mapped output
+    if(decinfo->flags & FLAG_COMPRESSED)
+        return decode_compressed_data(decinfo, decinfo->data_len);
+    // A protected payload is repaired block by block, the fast paths would read the carrier as it is
+    if(decinfo->out_mem && !decinfo->ecc)
+        return decode_data_to_memory(decinfo);
+    if(!decinfo->out_mem && !decinfo->ecc && decode_data_to_mapped_output(decinfo) == e_success)
+    {
+        info(decinfo, "\t\t\t\t\t\t:::::::DATA DECODE COMPLETED ::::::::\n");
+        return e_success;
+    }
+
+    // Otherwise decode the data block by block, flushing every block to the output
+    long done = 0;
+    while(done < decinfo->data_len)
+    {
+        int n = decinfo->data_len - done < DATA_LEN ? decinfo->data_len - done : DATA_LEN;
+
+        if(decode_data_from_image(n, decinfo->data, decinfo) == e_failure)
+            return e_failure;
+        if(decinfo->flags & FLAG_CRC)
+            decinfo->crc = crc32c_update(decinfo->crc, decinfo->data, n);
+        if(write_output(decinfo, decinfo->data, n, done) == e_failure)
+            return e_failure;
+        done += n;
+    }
+
+    // Make sure the last block reached the output file
+    if(!decinfo->out_mem && fflush(decinfo->fp_output))
+        return e_failure;
+    info(decinfo, "\t\t\t\t\t\t:::::::DATA DECODE COMPLETED ::::::::\n");
+    return e_success;
+}
+
+// Function to decode the main data from the image
+Status decode_data(Dec_Info *decinfo)
+{
+    info(decinfo, "\t\t\t\t\t\t:::::::DATA DECODE STARTED ::::::::\n");
+    decinfo->crc = 0;
+
+    // A container holds several files, they are listed with -l and extracted with -x
+    if(decinfo->flags & FLAG_CONTAINER)
+    {
+        Container c;
+        metrics_stage(decinfo->metrics, e_stage_size);
+        if(container_read_index(decinfo, &c) == e_success)
+        {
+            // Update mode scrubs up to here, the end of the CRC table or of the last body
+            decinfo->carrier_pos = c.data_pos + lsb_carrier_bytes(c.data_size, decinfo->depth) +
+                                   (decinfo->flags & FLAG_CRC ? lsb_carrier_bytes(4 * (size_t)c.count, decinfo->depth) : 0);
+            if(decinfo->input_fname)
+                fprintf(stderr, "ERROR: %s holds %d files, list them with -l and extract them with -x\n",
+                        decinfo->input_fname, c.count);
+        }
+        container_free(&c);
+        return e_failure;
+    }
+
+    // A framed payload has no size field, it runs up to its end frame
+    if(decinfo->flags & FLAG_FRAMED)
+    {
+        metrics_stage(decinfo->metrics, e_stage_data);
+        if(decinfo->flags & FLAG_COMPRESSED)
+            return e_failure;
+        return decode_framed_data(decinfo);
+    }
+    
+    // Decode the size of the data
+    metrics_stage(decinfo->metrics, e_stage_size);
+    decinfo->data_len = decode_length_from_lsb(decinfo);
+    info(decinfo, "secret data size = %ld\n", decinfo->data_len);
+    
+    if(decinfo->data_len < 0)
+        return e_failure;
+
+    // The stored checksum follows the data, it is checked once the data is out
+    metrics_stage(decinfo->metrics, e_stage_data);
+    Status ret = decode_payload(decinfo);
+    if(ret == e_success && (decinfo->flags & FLAG_CRC))
+        ret = decode_checksum(decinfo);
+    return ret;
+}
\ No newline at end of file
@@ -1,66 +1,143 @@
-#include<stdio.h>
-#include<stdlib.h>
-
-#ifndef DECODE_H
-#define DECODE_H
-#include<stdlib.h>
-
-#include "types.h"
-
-#define MAG_SIZE 100
-#define EXTEN_LEN 4
-#define DATA_LEN 500
-
-typedef struct _DecodeInfo
-{
-    // The name of the encoded image file (input file)
-    char *input_fname;  // A string to hold the filename of the encoded image
-    FILE *fp_input;     // File pointer to the encoded image for reading
-
-    // Information related to the decoding process
-    int magic_string_len;  // Length of the magic string used for identifying the steganography format
-    char magic_string[MAG_SIZE];  // The magic string used to identify the stego image (e.g., "STEG")
-    
-    int extn_len;        // Length of the file extension of the secret data (e.g., ".txt")
-    char extn[EXTEN_LEN]; // The file extension of the secret data that was hidden in the image
-    
-    int data_len;        // Length of the secret data that was embedded in the image
-    char data[DATA_LEN]; // Buffer to store the decoded secret data (the actual hidden message)
-    
-    // Information about the decoded output
-    char *output_fname;  // The name of the output file where the decoded secret data will be saved
-    FILE *fp_output;     // File pointer for the output file (where the secret data is written)
-} Dec_Info;
-
-
-//to validate command line arguments
-Status read_and_validate(char *argv[],Dec_Info *decinfo);
-
-//decoding function
-Status do_decoding(Dec_Info *decinfo);
-
-//open the required file pointers
-Status open_files_for_decode(Dec_Info *decinfo);
-
-//skip_header and craete pointer for file
-Status skip_header(FILE *fp_input);
-
-//to decode magic string and magic string length
-Status decode_magic_string(Dec_Info *decinfo);
-
-//to decode extension length and extension data
-Status decode_extension(Dec_Info *decinfo);
-
-//to decode data from encoded image to output file
-Status decode_data(Dec_Info *decinfo);
-
-//to decode size(int) from encoded image
-int decode_size_from_lsb(FILE *fp);
-
-//to decode data char by char from encoded image
-Status decode_data_from_image(int len,char *data,FILE *fp_input,FILE *fp_output);
-
-//to decode data(string) from encoded image
-char decode_byte_from_lsb(char *data,int i);
-
+#include<stdio.h>
+#include<stdlib.h>
+
+#ifndef DECODE_H
+#define DECODE_H
+#include<stdlib.h>
+
+#include "types.h"
+#include "metrics.h"
+#include "bmp.h"
+#include "lz.h"
+#include "scatter.h"
+#include "png.h"
+#include "arena.h"
+#include "aio.h"
+#include "rs.h"
+
+#define MAG_SIZE 100
+#define EXTEN_LEN 8
+#define DATA_LEN 12288  // Secret data is decoded and written out in blocks of this size, a multiple of every depth
+
+typedef struct _DecodeInfo
+{
+    // The name of the encoded image file (input file)
+    char *input_fname;  // A string to hold the filename of the encoded image
+    FILE *fp_input;     // File pointer to the encoded image for reading
+
+    // Information related to the decoding process
+    int magic_string_len;  // Length of the magic string used for identifying the steganography format
+    char magic_string[MAG_SIZE];  // The magic string used to identify the stego image (e.g., "STEG")
+    
+    uint flags;          // Header flags word, 0 for images in the original layout
+    int depth;           // Depth of the field being decoded, taken from the flags after the magic string
+    int ecc;             // Reed-Solomon parity bytes per 255 after the flags word, 0 while the fields are read as they are
+    size_t ecc_pos;      // Next byte served out of ecc_block
+    size_t ecc_len;      // Payload bytes of ecc_block, 0 before the first block is read
+    long ecc_fixed;      // Damaged bytes repaired so far
+
+    int extn_len;        // Length of the file extension of the secret data (e.g., ".txt")
+    char extn[EXTEN_LEN]; // The file extension of the secret data that was hidden in the image
+    
+    long data_len;       // Length of the secret data that was embedded in the image
+    uint32_t crc;        // CRC32C of the data decoded so far, checked against the stored one for FLAG_CRC
+    BmpPlan plan;        // Header fields and embeddable runs, parsed by skip_header()
+    size_t carrier_pos;  // Logical position of the next carrier byte in the plan
+    size_t in_pos;       // Image bytes consumed by the stdio backend, which may be a pipe
+    PngReader *png_in;   // Inflates a PNG image row by row, in_pos then counts pixel bytes
+    
+    // Information about the decoded output
+    char *output_fname;  // The name of the output file where the decoded secret data will be saved
+    FILE *fp_output;     // File pointer for the output file (where the secret data is written)
+
+    // Memory-mapped backend, the LSBs are read straight out of the mapping
+    const char *in_map;  // Read-only mapping of the encoded image (NULL for the stdio backend)
+    size_t map_size;     // Size of the mapping
+    AioWindow in_win;    // Releases the pages behind the decoding, set by map_input_file() only
+
+    // Caller buffer the payload is decoded into instead of fp_output (library API)
+    char *out_mem;       // Destination of the payload, NULL to write fp_output
+    size_t out_cap;      // Size of out_mem, decoding fails when the payload does not fit
+
+    // Job options
+    const char *key;     // Key of FLAG_SCATTER images
+    Scatter *scatter;    // Positions for key, set once the flags word is read
+    int quiet;           // Suppress the progress messages
+    int threads;         // Worker threads for large mapped payloads (0 = one per CPU, 1 = sequential)
+    Metrics *metrics;    // Per-stage timings and I/O counters, NULL when not collected
+    Arena *arena;        // Allocations of the job (file names), NULL = heap
+
+    // I/O buffers, last so that job_decode() resets everything before them at once
+    char data[DATA_LEN]; // Reusable block buffer, each decoded block is flushed to the output file
+    char image_data[DATA_LEN * 12]; // File bytes of the block currently being decoded, carrier bytes plus row padding
+    unsigned char lz_in[LZ_BOUND(LZ_CHUNK)]; // Compressed record being collected, for FLAG_COMPRESSED images
+    unsigned char lz_out[LZ_CHUNK];         // Decompressed chunk of the record
+    RsCode rs;           // Code of FLAG_ECC_MASK images, built by decode_header_flags()
+    unsigned char ecc_block[RS_BLOCK]; // Repaired block the protected fields are served from
+} Dec_Info;
+
+
+//to validate command line arguments
+Status read_and_validate(char *argv[],Dec_Info *decinfo);
+
+//decoding function
+Status do_decoding(Dec_Info *decinfo);
+
+//run the stages after open_files_for_decode(), on files or caller buffers
+Status decode_image(Dec_Info *decinfo);
+
+//open the required file pointers
+Status open_files_for_decode(Dec_Info *decinfo);
+
+//map the encoded image, leaves the stdio backend in place on failure
+Status map_input_file(Dec_Info *decinfo);
+
+//unmap the encoded image and close both files
+Status close_files_for_decode(Dec_Info *decinfo);
+
+//parse the bmp header and move to the pixel array
+Status skip_header(Dec_Info *decinfo);
+
+//to decode magic string and magic string length
+Status decode_magic_string(Dec_Info *decinfo);
+
+//to decode the header flags that follow MAGIC_STRING_EXT, voting over the three copies of FLAG_ECC_MASK images
+Status decode_header_flags(Dec_Info *decinfo);
+
+//to decode extension length and extension data
+Status decode_extension(Dec_Info *decinfo);
+
+//to decode data from encoded image to output file
+Status decode_data(Dec_Info *decinfo);
+
+//to decode a large payload in parallel into a mapping of the output file
+Status decode_data_to_mapped_output(Dec_Info *decinfo);
+
+//to decode the whole payload into the caller buffer out_mem
+Status decode_data_to_memory(Dec_Info *decinfo);
+
+//to decode a compressed payload record by record as it streams out of the image
+Status decode_compressed_data(Dec_Info *decinfo, long stream_len);
+
+//to decode a framed payload of unknown length up to its end frame
+Status decode_framed_data(Dec_Info *decinfo);
+
+//to check the CRC32C stored after the data against the decoded data
+Status decode_checksum(Dec_Info *decinfo);
+
+//to move to a logical carrier position, forward only when the image cannot seek
+Status decode_seek(Dec_Info *decinfo, size_t carrier_pos);
+
+//to decode size(int) from encoded image
+int decode_size_from_lsb(Dec_Info *decinfo);
+
+//to decode a size field, 64-bit in FLAG_SIZE64 images
+long decode_length_from_lsb(Dec_Info *decinfo);
+
+//to decode data char by char from encoded image (len must not exceed DATA_LEN), repaired once ecc is set
+Status decode_data_from_image(int len,char *data,Dec_Info *decinfo);
+
+//to decode data(string) from encoded image
+char decode_byte_from_lsb(char *data,int i);
+
 #endif
\ No newline at end of file
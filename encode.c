@@ -1,120 +1,321 @@
+#define _GNU_SOURCE // For copy_file_range()
 #include <stdio.h>
-#include <unistd.h> // For sleep()
+#include <stdlib.h>
+#include <unistd.h>
 #include<string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "encode.h"
+#include "lsb.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "container.h"
 #include "types.h"
 #include "common.h"
 
+/* Embedding depth of the job, 1 when not set */
+static int job_depth(const EncodeInfo *encInfo)
+{
+    return encInfo->depth > 0 ? encInfo->depth : 1;
+}
+
+/* Field depth used by the embedding functions */
+static int field_depth(const EncodeInfo *encInfo)
+{
+    return encInfo->cur_depth > 0 ? encInfo->cur_depth : 1;
+}
+
+/* Whether a size of the job does not fit a 32-bit size field, a compressed stream is never larger than the secret */
+static int size64(const EncodeInfo *encInfo)
+{
+    if (encInfo->container)
+        return encInfo->container->size64;
+    return !encInfo->framed && encInfo->size_secret_file > SIZE32_MAX;
+}
+
+/* Header flags for the job options, 0 keeps the original layout */
+static uint header_flags(const EncodeInfo *encInfo)
+{
+    uint flags = (uint)(job_depth(encInfo) - 1) & FLAG_DEPTH_MASK;
+
+    if (encInfo->packed || encInfo->packed_stream)
+        flags |= FLAG_COMPRESSED;
+    if (encInfo->framed)
+        flags |= FLAG_FRAMED;
+    if (encInfo->checksum)
+        flags |= FLAG_CRC;
+    if (encInfo->container)
+        flags |= FLAG_CONTAINER;
+    if (encInfo->key)
+        flags |= FLAG_SCATTER;
+    if (size64(encInfo))
+        flags |= FLAG_SIZE64;
+    if (encInfo->ecc)
+        flags |= (uint)encInfo->ecc << FLAG_ECC_SHIFT;
+    return flags;
+}
+
+/* Print a progress message unless the job runs quietly */
+static void info(const EncodeInfo *encInfo, const char *msg)
+{
+    if (!encInfo->quiet)
+        printf("INFO : %s\n", msg);
+}
+
 Status do_encoding(EncodeInfo *encInfo)
 {
     // Start of the encoding process
-    printf("INFO : Encoding started!\n");
+    info(encInfo, "Encoding started!");
+    metrics_start(encInfo->metrics, "encode");
 
     // Open necessary files for reading and writing
-    printf("INFO : Open files started!\n");
-    OperationType res = open_files(encInfo);
+    info(encInfo, "Open files started!");
+    if (open_files(encInfo) == e_failure)
+        return e_failure;
+    info(encInfo, "Open files Completed!");
+
+    // Run the embedding stages on the opened files, a rejected secret or carrier leaves no stego image behind
+    if (encode_image(encInfo) == e_failure)
+    {
+        discard_files(encInfo);
+        return e_failure;
+    }
+
+    // Unmap and close everything so the stego image is complete on disk
+    if (close_files(encInfo) == e_failure)
+        return e_failure;
+    metrics_finish(encInfo->metrics);
+
+    // Indicate success
+    info(encInfo, "Encoding Successful!");
+    return e_success;
+}
+
+/* Size of the payload as embedded, after compression */
+static long payload_size(const EncodeInfo *encInfo)
+{
+    return encInfo->packed || encInfo->packed_stream ? encInfo->packed_size : encInfo->size_secret_file;
+}
+
+static Status encode_stages(EncodeInfo *encInfo);
+
+/* Run every stage after open_files(), the secret comes from secret_mem when it is set */
+Status encode_image(EncodeInfo *encInfo)
+{
+    // Take the extension from the secret file name, in-memory and piped secrets bring their own, a container has none
+    if (encInfo->secret_fname && strcmp(encInfo->secret_fname, STDIO_NAME) && !encInfo->container)
+    {
+        const char *base = strrchr(encInfo->secret_fname, '/') ? strrchr(encInfo->secret_fname, '/') + 1 : encInfo->secret_fname;
+        const char *p = strrchr(base, '.') ? strrchr(base, '.') : "";
+        if (strlen(p) >= MAX_FILE_SUFFIX)
+        {
+            fprintf(stderr, "ERROR: The extension %s is longer than %d characters\n", p, MAX_FILE_SUFFIX - 1);
+            return e_failure;
+        }
+        strcpy(encInfo->extn_secret_file, p);
+    }
+
+    // Compress the secret first, capacity depends on the compressed size (callers may have done it already)
+    // A framed secret is never compressed, its size is not known before it has been read, nor is a container
+    if (encInfo->compress && !encInfo->framed && !encInfo->container && encInfo->packed == NULL && !encInfo->packed_stream)
+    {
+        metrics_stage(encInfo->metrics, e_stage_compress);
+        info(encInfo, "Compressing secret file Started!");
+        if (compress_secret(encInfo) == e_failure)
+            return e_failure;
+        info(encInfo, "Compressing secret file Completed!");
+    }
+
+    Status res = encode_stages(encInfo);
+    arena_release(encInfo->arena, encInfo->packed);
+    encInfo->packed = NULL;
+    encInfo->packed_stream = 0;
+    return res;
+}
+
+/* Encode the size, data and checksum stages of a single secret */
+static Status encode_secret(EncodeInfo *encInfo)
+{
+    Status res;
+
+    // Encode the size of the secret file, measured by check_capacity(), framed secrets end with a trailer instead
+    if (!encInfo->framed)
+    {
+        metrics_stage(encInfo->metrics, e_stage_size);
+        info(encInfo, "Encoding secret file size Started!");
+        res = encode_secret_file_size(payload_size(encInfo), encInfo);
+        if (res == e_failure)
+            return e_failure;
+        info(encInfo, "Encoding secret file size Completed!");
+    }
+
+    // Encode the actual content of the secret file
+    metrics_stage(encInfo->metrics, e_stage_data);
+    info(encInfo, "Encoding secret file data Started!");
+    encInfo->crc = 0;
+    res = encode_secret_file_data(encInfo);
     if (res == e_failure)
         return e_failure;
-    printf("INFO : Open files Completed!\n");
-    sleep(1); // Delay for better visibility
+    info(encInfo, "Encoding secret file data Completed!");
+
+    // The checksum of framed data is the last part of the frame stream
+    if (encInfo->checksum && !encInfo->framed)
+        return encode_checksum(encInfo);
+    return e_success;
+}
+
+static Status encode_stages(EncodeInfo *encInfo)
+{
+    Status res;
+
+    // The directory of a container is read with seeks, which a stream of blocks does not allow
+    if (encInfo->ecc && encInfo->container)
+    {
+        fprintf(stderr, "ERROR: --ecc cannot protect several packed files, encode them one at a time\n");
+        return e_failure;
+    }
 
     // Check if the image has enough capacity to hold the secret data
-    printf("INFO : Check Capacity Started!\n");
+    metrics_stage(encInfo->metrics, e_stage_capacity);
+    info(encInfo, "Check Capacity Started!");
     res = check_capacity(encInfo);
     if (res == e_failure)
         return e_failure;
-    printf("INFO : Check Capacity Completed!\n");
-    sleep(1); // Delay for better visibility
+    info(encInfo, "Check Capacity Completed!");
+
+    // Scattered bits land anywhere in the image, which has to be mapped as a whole
+    if (encInfo->key && encInfo->src_map == NULL)
+    {
+        fprintf(stderr, encInfo->png_in ? "ERROR: --key needs a BMP image, PNG images are streamed row by row\n"
+                                        : "ERROR: --key needs the source and stego images to be regular files\n");
+        return e_failure;
+    }
 
     // Copy BMP header from the source to the stego image
-    printf("INFO : Copy bmp header Started!\n");
-    res = copy_bmp_header(encInfo->fptr_src_image, encInfo->fptr_stego_image);
+    metrics_stage(encInfo->metrics, e_stage_header);
+    info(encInfo, "Copy bmp header Started!");
+    res = copy_bmp_header(encInfo);
     if (res == e_failure)
         return e_failure;
-    printf("INFO : Copy bmp header Completed!\n");
-    sleep(1); // Delay for better visibility
+    info(encInfo, "Copy bmp header Completed!");
 
     // Encode the magic string to identify the start of the secret data
-    printf("INFO : Encoding magic string Started!\n");
-    res = encode_magic_string(MAGIC_STRING, encInfo);
+    metrics_stage(encInfo->metrics, e_stage_magic);
+    info(encInfo, "Encoding magic string Started!");
+    encInfo->cur_depth = 1;
+    encInfo->ecc_active = 0;
+    uint flags = header_flags(encInfo);
+    if (flags)
+    {
+        // Options are recorded in a flags word after the extended magic string
+        res = encode_magic_string(MAGIC_STRING_EXT, encInfo);
+        if (res == e_success)
+            res = encode_header_flags(flags, encInfo);
+    }
+    else
+        res = encode_magic_string(MAGIC_STRING, encInfo);
     if (res == e_failure)
         return e_failure;
-    printf("INFO : Encoding magic string Completed!\n");
-    sleep(1); // Delay for better visibility
+    info(encInfo, "Encoding magic string Completed!");
 
-    // Check and extract the extension of the secret file
-    char *p = strstr(encInfo->secret_fname, ".txt");
-    if (p == NULL)
-        return e_failure; // Fail if not a .txt file
-    strcpy(encInfo->extn_secret_file, p);
+    // Everything after the magic string uses the requested depth, and with a key is scattered from here on
+    encInfo->cur_depth = job_depth(encInfo);
+    if (encInfo->key)
+    {
+        scatter_free(encInfo->scatter);
+        encInfo->scatter = scatter_new(encInfo->key, encInfo->carrier_pos, encInfo->plan.capacity);
+        if (encInfo->scatter == NULL)
+            return e_failure;
+    }
+
+    // With ecc it is collected into Reed-Solomon blocks from here on, encode_ecc_flush() embeds the last one
+    if (encInfo->ecc)
+    {
+        if (rs_init(&encInfo->rs, encInfo->ecc))
+            return e_failure;
+        encInfo->ecc_fill = 0;
+        encInfo->ecc_active = 1;
+    }
 
     // Encode the file extension into the image
-    printf("INFO : Encoding secret file extn Started!\n");
+    metrics_stage(encInfo->metrics, e_stage_extension);
+    info(encInfo, "Encoding secret file extn Started!");
     res = encode_secret_file_extn(encInfo->extn_secret_file, encInfo);
     if (res == e_failure)
         return e_failure;
-    printf("INFO : Encoding secret file extn Completed!\n");
-    sleep(1); // Delay for better visibility
+    info(encInfo, "Encoding secret file extn Completed!");
 
-    // Move the file pointer to the end to get the size of the secret file
-    rewind(encInfo->fptr_secret);
-    fseek(encInfo->fptr_secret, 0, SEEK_END);
-    int file_size = ftell(encInfo->fptr_secret);
-
-    // Encode the size of the secret file
-    printf("INFO : Encoding secret file size Started!\n");
-    res = encode_secret_file_size(file_size, encInfo);
-    if (res == e_failure)
-        return e_failure;
-    printf("INFO : Encoding secret file size Completed!\n");
-    sleep(1); // Delay for better visibility
-
-    // Encode the actual content of the secret file
-    printf("INFO : Encoding secret file data Started!\n");
-    res = encode_secret_file_data(encInfo);
+    // A container replaces the size and data stages with its directory and the file bodies
+    if (encInfo->container)
+        res = encode_container(encInfo);
+    else
+        res = encode_secret(encInfo);
+    if (res == e_success && encInfo->ecc_active)
+        res = encode_ecc_flush(encInfo);
+    encInfo->ecc_active = 0;
     if (res == e_failure)
         return e_failure;
-    printf("INFO : Encoding secret file data Completed!\n");
-    sleep(1); // Delay for better visibility
 
     // Copy the remaining image data to the stego image
-    printf("INFO : Copy remaining data Started!\n");
-    res = copy_remaining_img_data(encInfo->fptr_src_image, encInfo->fptr_stego_image);
+    metrics_stage(encInfo->metrics, e_stage_tail);
+    info(encInfo, "Copy remaining data Started!");
+    res = copy_remaining_img_data(encInfo);
     if (res == e_failure)
         return e_failure;
-    printf("INFO : Copy remaining data Completed!\n");
-    sleep(1); // Delay for better visibility
+    info(encInfo, "Copy remaining data Completed!");
 
-    // Indicate success
-    printf("INFO : Encoding Successful!\n");
     return e_success;
 }
 
 
-/* Get the image size from a BMP file */
-uint get_image_size_for_bmp(FILE *fptr_image)
+/* Get the embeddable size of a BMP file, 0 when it is not a supported BMP */
+size_t get_image_size_for_bmp(FILE *fptr_image)
 {
-    uint width, height;
-    // Seek to the position where width is stored (18th byte)
-    fseek(fptr_image, 18, SEEK_SET);
+    unsigned char hdr[BMP_HEADER_SIZE];
+    BmpPlan plan;
 
-    // Read the width (4 bytes)
-    fread(&width, sizeof(int), 1, fptr_image);
-    printf("width = %u\n", width);
+    // Padding bytes at the row ends do not count
+    rewind(fptr_image);
+    if (bmp_read_plan(fptr_image, hdr, &plan) == e_failure)
+        return 0;
+    return plan.capacity;
+}
 
-    // Read the height (4 bytes)
-    fread(&height, sizeof(int), 1, fptr_image);
-    printf("height = %u\n", height);
+/* Open a file, STDIO_NAME stands for stdin when reading and stdout when writing */
+FILE *open_stream(const char *fname, const char *mode)
+{
+    if (strcmp(fname, STDIO_NAME))
+        return fopen(fname, mode);
+    return mode[0] == 'r' ? stdin : stdout;
+}
 
-    // Calculate and return the total image size (width * height * 3 bytes/pixel)
-    return width * height * 3;
+/* Close a file opened by open_stream(), the standard streams stay open for the rest of the process */
+int close_stream(FILE *fp)
+{
+    if (fp == stdin)
+        return 0;
+    if (fp == stdout)
+        return fflush(fp);
+    return fclose(fp);
 }
 
 /* Open the necessary files for encoding */
 Status open_files(EncodeInfo *encInfo)
 {
+    metrics_io(encInfo->metrics, 0, 0, 3);
+
+    // The carrier and the secret cannot both come from stdin
+    if (!strcmp(encInfo->src_image_fname, STDIO_NAME) && !strcmp(encInfo->secret_fname, STDIO_NAME))
+    {
+        fprintf(stderr, "ERROR: The source image and the secret file cannot both be read from stdin\n");
+        return e_failure;
+    }
+
     // Open the source image file in read mode
-    encInfo->fptr_src_image = fopen(encInfo->src_image_fname, "r");
+    encInfo->fptr_src_image = open_stream(encInfo->src_image_fname, "r");
     if (encInfo->fptr_src_image == NULL)
     {
         perror("fopen");
@@ -123,7 +324,7 @@ Status open_files(EncodeInfo *encInfo)
     }
 
     // Open the secret file in read mode
-    encInfo->fptr_secret = fopen(encInfo->secret_fname, "r");
+    encInfo->fptr_secret = open_stream(encInfo->secret_fname, "r");
     if (encInfo->fptr_secret == NULL)
     {
         perror("fopen");
@@ -132,7 +333,7 @@ Status open_files(EncodeInfo *encInfo)
     }
 
     // Open the stego image file in write mode
-    encInfo->fptr_stego_image = fopen(encInfo->stego_image_fname, "w");
+    encInfo->fptr_stego_image = open_stream(encInfo->stego_image_fname, "w+");
     if (encInfo->fptr_stego_image == NULL)
     {
         perror("fopen");
@@ -140,64 +341,253 @@ Status open_files(EncodeInfo *encInfo)
         return e_failure;
     }
 
+    // A secret that is not a regular file (a pipe) has no size up front and is embedded in frames
+    struct stat st;
+    encInfo->framed = fstat(fileno(encInfo->fptr_secret), &st) || !S_ISREG(st.st_mode);
+    encInfo->src_pos = 0;
+
+    // Prefer the memory-mapped backend, stdio keeps working if mapping fails. The async pipeline runs on the stdio
+    // backend, unless a key needs the whole image mapped
+    if (encInfo->aio == e_aio_off || encInfo->key)
+        map_files(encInfo);
+
     // Return success if all files are opened correctly
     return e_success;
 }
 
+/* Map the source image read-only and the stego image read-write */
+Status map_files(EncodeInfo *encInfo)
+{
+    struct stat st;
+    int fd_src = fileno(encInfo->fptr_src_image);
+    int fd_stego = fileno(encInfo->fptr_stego_image);
+
+    encInfo->src_map = NULL;
+    encInfo->stego_map = NULL;
+    encInfo->map_size = 0;
+    encInfo->carrier_pos = 0;
+    encInfo->pad_pos = 0;
+    aio_window_init(&encInfo->src_win, NULL, -1, 0);
+    aio_window_init(&encInfo->stego_win, NULL, -1, 0);
+
+    // Only regular, non-empty files can be mapped, and PNG pixels only exist once inflated
+    if (fstat(fd_src, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || png_sniff(encInfo->fptr_src_image))
+        return e_failure;
+
+    // Preallocate the stego image so it can be mapped at its final size
+    if (ftruncate(fd_stego, st.st_size))
+        return e_failure;
+
+    void *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_src, 0);
+    if (src == MAP_FAILED)
+        return e_failure;
+    void *stego = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_stego, 0);
+    if (stego == MAP_FAILED)
+    {
+        munmap(src, st.st_size);
+        return e_failure;
+    }
+
+    // The carrier is walked front to back exactly once
+    madvise(src, st.st_size, MADV_SEQUENTIAL);
+    madvise(stego, st.st_size, MADV_SEQUENTIAL);
+
+    encInfo->src_map = src;
+    encInfo->stego_map = stego;
+    encInfo->map_size = st.st_size;
+
+    // Images larger than memory stream through both mappings, the pages behind the embedding are released
+    aio_window_init(&encInfo->src_win, src, fd_src, 0);
+    aio_window_init(&encInfo->stego_win, stego, fd_stego, 1);
+    if (encInfo->metrics)
+        encInfo->metrics->backend = "mmap";
+    metrics_io(encInfo->metrics, 0, 0, 3);
+    return e_success;
+}
+
+/* Release the mappings and close the files opened by open_files() */
+Status close_files(EncodeInfo *encInfo)
+{
+    Status ret = e_success;
+
+    if (encInfo->src_map)
+    {
+        munmap((void *)encInfo->src_map, encInfo->map_size);
+        if (munmap(encInfo->stego_map, encInfo->map_size))
+            ret = e_failure;
+        encInfo->src_map = NULL;
+        encInfo->stego_map = NULL;
+    }
+
+    scatter_free(encInfo->scatter);
+    encInfo->scatter = NULL;
+    png_writer_close(encInfo->png_out);
+    png_reader_close(encInfo->png_in);
+    encInfo->png_out = NULL;
+    encInfo->png_in = NULL;
+
+    if (encInfo->fptr_src_image)
+        close_stream(encInfo->fptr_src_image);
+    if (encInfo->fptr_secret)
+        close_stream(encInfo->fptr_secret);
+    if (encInfo->fptr_stego_image && close_stream(encInfo->fptr_stego_image))
+        ret = e_failure;
+    encInfo->fptr_src_image = NULL;
+    encInfo->fptr_secret = NULL;
+    encInfo->fptr_stego_image = NULL;
+    return ret;
+}
+
+/* Close the files of a failed encode and remove the stego image it left half written */
+void discard_files(EncodeInfo *encInfo)
+{
+    struct stat st;
+
+    // Only a regular file is removed, never stdout or a device the output was sent to
+    int regular = encInfo->fptr_stego_image && encInfo->fptr_stego_image != stdout &&
+                  !fstat(fileno(encInfo->fptr_stego_image), &st) && S_ISREG(st.st_mode);
+    close_files(encInfo);
+    if (regular)
+        unlink(encInfo->stego_image_fname);
+}
+
 /* Check if the image has enough capacity to hold the secret data */
 Status check_capacity(EncodeInfo *encInfo)
 {
     //printf("Check Capacity Started!\n");
 
-    // Get the total capacity of the image
-    encInfo->image_capacity = get_image_size_for_bmp(encInfo->fptr_src_image);
-    // Get the size of the secret file
-    encInfo->size_secret_file = get_file_size(encInfo->fptr_secret);
+    // Parse the header once, straight from the mapping when there is one
+    Status ret;
+    if (encInfo->src_map)
+        ret = bmp_parse((const unsigned char *)encInfo->src_map, encInfo->map_size, encInfo->map_size, &encInfo->plan);
+    else if (png_sniff(encInfo->fptr_src_image))
+    {
+        // The chunks in front of the pixel data go straight to the stego image, carrier positions count pixel bytes
+        encInfo->png_in = png_reader_open(encInfo->fptr_src_image, encInfo->fptr_stego_image, encInfo->arena,
+                                          &encInfo->plan);
+        ret = encInfo->png_in ? e_success : e_failure;
+        encInfo->src_pos = 0;
+        if (encInfo->png_in)
+        {
+            if (encInfo->metrics)
+                encInfo->metrics->backend = "png";
+            metrics_io(encInfo->metrics, png_bytes_read(encInfo->png_in), 0, 3);
+        }
+    }
+    else
+    {
+        // Forward only, copy_bmp_header() writes the header bytes kept here
+        ret = bmp_read_plan(encInfo->fptr_src_image, encInfo->bmp_header, &encInfo->plan);
+        encInfo->src_pos = BMP_HEADER_SIZE;
+        metrics_io(encInfo->metrics, BMP_HEADER_SIZE, 0, 3);
+    }
+    if (ret == e_failure)
+    {
+        if (encInfo->src_image_fname)
+            fprintf(stderr, "ERROR: Only uncompressed 24bpp and 32bpp BMP images and 8-bit non-interlaced "
+                            "grayscale or truecolor PNG images are supported\n");
+        return e_failure;
+    }
+    encInfo->image_capacity = encInfo->plan.capacity;
+    encInfo->bits_per_pixel = encInfo->plan.bits_per_pixel;
+    encInfo->carrier_pos = 0;
+    if (!encInfo->quiet)
+        printf("INFO : Image capacity = %zu bytes\n", encInfo->image_capacity);
+    // Get the size of the secret file, an in-memory secret has it set already and a framed one has none
+    if (encInfo->framed || encInfo->container)
+        encInfo->size_secret_file = 0;
+    else if (encInfo->secret_mem == NULL)
+        encInfo->size_secret_file = get_file_size(encInfo->fptr_secret);
    // printf("secret file size -> %ld\n", encInfo->size_secret_file);
+    if ((encInfo->packed || encInfo->packed_stream) && !encInfo->quiet)
+        printf("INFO : Secret compressed from %ld to %ld bytes\n", encInfo->size_secret_file, encInfo->packed_size);
 
     // Calculate the required space for the encoded data
-    int len = strlen(MAGIC_STRING);
-    int len_ext = 4; // For ".txt"
-    int temp = 54 + (8 * (len + sizeof(int) + len_ext + sizeof(int) + encInfo->size_secret_file));
-   // printf("Temp = %d\n", temp);
+    int depth = job_depth(encInfo);
+    if (depth > LSB_MAX_DEPTH)
+        return e_failure;
+    int len = strlen(header_flags(encInfo) ? MAGIC_STRING_EXT : MAGIC_STRING);
+    int len_ext = strlen(encInfo->extn_secret_file);
+    // A framed secret needs at least its end frame here, running out of room is found while embedding
+    size_t temp = 8 * (sizeof(int) + len) + (header_flags(encInfo) ? 8 * sizeof(int) : 0);
+    if (encInfo->ecc)
+    {
+        // Two more copies of the flags word, then whole blocks holding every field after it
+        size_t stream = sizeof(int) + len_ext + (size64(encInfo) ? 8 : 4) + payload_size(encInfo) +
+                        (encInfo->checksum ? sizeof(int) : 0);
+        size_t room = RS_DATA_BYTES(encInfo->ecc);
+        temp += 2 * 8 * sizeof(int) + (stream + room - 1) / room * lsb_carrier_bytes(RS_BLOCK, depth);
+    }
+    else
+    {
+        temp += lsb_carrier_bytes(sizeof(int), depth) + lsb_carrier_bytes(len_ext, depth);
+        if (encInfo->container)
+            temp += container_carrier_bytes(encInfo->container, depth, encInfo->checksum);
+        else
+            temp += lsb_carrier_bytes(size64(encInfo) ? 8 : 4, depth) + lsb_carrier_bytes(payload_size(encInfo), depth) +
+                    (encInfo->checksum ? lsb_carrier_bytes(sizeof(int), depth) : 0);
+    }
 
-    // Check if the image capacity is sufficient
-    if (encInfo->image_capacity > temp)
+    // Check if the pixel bytes outside the row padding can hold all of it
+    if (encInfo->image_capacity >= temp)
         return e_success;
     else
         return e_failure;
 }
 
 /* Get the size of a file */
-uint get_file_size(FILE *fptr)
+long get_file_size(FILE *fptr)
 {
     fseek(fptr, 0, SEEK_END);
-    uint size = ftell(fptr); // Get the file size
+    long size = ftell(fptr); // Get the file size
     return size;
 }
 
 /* Copy the BMP header from the source image to the stego image */
-Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image)
+Status copy_bmp_header(EncodeInfo *encInfo)
 {
-   // printf("Header copying started!\n");
-    char s[54]; // Buffer to store the header
+    // Everything up to the pixel array: file header, info header of any version, bit masks, palette
+    size_t header = encInfo->plan.data_offset;
 
-    // Move to the beginning of the source image and read 54 bytes (header)
-    fseek(fptr_src_image, 0, SEEK_SET);
-    fread(s, 54, 1, fptr_src_image);
-
-    // Check for read failure
-    if (s == NULL)
-        return e_failure;
+    // With the mapped backend the header is a plain memory copy, a scattered payload needs the whole image copied first
+    if (encInfo->src_map)
+    {
+        if (encInfo->key)
+            header = encInfo->map_size;
+        if (encInfo->map_size < header)
+            return e_failure;
+        if (encInfo->stego_map != encInfo->src_map)
+            memcpy(encInfo->stego_map, encInfo->src_map, header);
+        metrics_io(encInfo->metrics, header, header, 0);
+        return e_success;
+    }
 
-    // Write the header to the stego image
-    fwrite(s, 54, 1, fptr_dest_image);
+    // The reader echoed the PNG chunks already, the pixel data is deflated anew
+    if (encInfo->png_in)
+    {
+        encInfo->png_out = png_writer_open(encInfo->fptr_stego_image, encInfo->png_in, encInfo->arena);
+        return encInfo->png_out ? e_success : e_failure;
+    }
 
-    // Confirm if the header is correctly written
-    if (ftell(fptr_dest_image) == 54)
-        return e_success;
-    else
+    // check_capacity() already read the fixed part, write it and copy the rest through the scratch buffer
+    if (encInfo->src_pos != BMP_HEADER_SIZE ||
+        fwrite(encInfo->bmp_header, 1, BMP_HEADER_SIZE, encInfo->fptr_stego_image) != BMP_HEADER_SIZE)
         return e_failure;
+    metrics_io(encInfo->metrics, 0, BMP_HEADER_SIZE, 1);
+    for (size_t done = BMP_HEADER_SIZE; done < header;)
+    {
+        size_t n = header - done < MAX_IMAGE_BUF_SIZE ? header - done : MAX_IMAGE_BUF_SIZE;
+        if (fread(encInfo->image_data, 1, n, encInfo->fptr_src_image) != n)
+            return e_failure;
+
+        // Write the header to the stego image
+        if (fwrite(encInfo->image_data, 1, n, encInfo->fptr_stego_image) != n)
+            return e_failure;
+        metrics_io(encInfo->metrics, n, n, 2);
+        done += n;
+    }
+    encInfo->src_pos = header;
+    return e_success;
 }
 
 /* Encode the magic string into the image */
@@ -208,88 +598,179 @@ Status encode_magic_string(const char *magic_string, EncodeInfo *encInfo)
    // printf("len -> %d\n", len);
 
     // Encode the length of the magic string
-    OperationType ret = encode_size_to_lsb(len, encInfo->fptr_src_image, encInfo->fptr_stego_image);
-   // printf("%ld %ld\n", ftell(encInfo->fptr_src_image), ftell(encInfo->fptr_stego_image));
+    OperationType ret = encode_size_to_lsb(len, encInfo);
     if (ret == e_failure)
         return e_failure;
 
     // Encode the actual magic string data
-    ret = encode_data_to_image(magic_string, len, encInfo->fptr_src_image, encInfo->fptr_stego_image);
+    ret = encode_data_to_image(magic_string, len, encInfo);
     if (ret == e_failure)
         return e_failure;
 
     return e_success;
 }
 
-/* Encode data into the image */
-Status encode_data_to_image(const char *data, long int len, FILE *fptr_src_image, FILE *fptr_stego_image)
+/* Read the next n source bytes into the scratch buffer, the pixel bytes of the next rows for a PNG */
+static Status read_src(EncodeInfo *encInfo, size_t n)
 {
-   // printf("Encoding data to image started!\n");
-    char image_buffer[8];
-    int i;
+    if (encInfo->png_in)
+        return png_read(encInfo->png_in, (unsigned char *)encInfo->image_data, n);
+    return fread(encInfo->image_data, 1, n, encInfo->fptr_src_image) == n ? e_success : e_failure;
+}
 
-  //  printf("Encoding byte to lsb started!\n");
-//printf("secret data in data to image -> %s\n", data);
-   // printf("len = %ld\n", len);
+/* Write n bytes of the scratch buffer to the stego image */
+static Status write_stego(EncodeInfo *encInfo, size_t n)
+{
+    if (encInfo->png_out)
+        return png_write(encInfo->png_out, (const unsigned char *)encInfo->image_data, n);
+    return fwrite(encInfo->image_data, 1, n, encInfo->fptr_stego_image) == n ? e_success : e_failure;
+}
 
-    // Loop through each byte of the data and encode it
-    for (i = 0; i < len; i++)
+/* Embed data in the next carrier bytes */
+static Status embed_carrier(const char *data, long int len, EncodeInfo *encInfo)
+{
+    long int done = 0;
+    int depth = field_depth(encInfo);
+
+    if (len < 0)
+        return e_failure;
+
+    size_t carrier = lsb_carrier_bytes(len, depth);
+    if (encInfo->carrier_pos + carrier > encInfo->plan.capacity)
+        return e_failure;
+
+    // Mapped backend, embed straight into the stego mapping, large data in parallel stripes
+    if (encInfo->src_map)
     {
-       // printf("i = %d\n", i);
-        fread(image_buffer, 8, 1, fptr_src_image);
-        OperationType ret = encode_byte_to_lsb(data[i], image_buffer);
-        if (ret == e_success)
-            fwrite(image_buffer, 8, 1, fptr_stego_image);
-        else
+        if (bmp_phys_end(&encInfo->plan, encInfo->carrier_pos + carrier) > encInfo->map_size)
             return e_failure;
+        if (encInfo->scatter)
+        {
+            scatter_encode_bits(encInfo->scatter, &encInfo->plan, encInfo->carrier_pos, data, len,
+                                encInfo->stego_map, depth);
+            encInfo->carrier_pos += carrier;
+            metrics_io(encInfo->metrics, carrier, carrier, 0);
+            return e_success;
+        }
+
+        // One window at a time, the rows behind it are complete once their padding is copied
+        size_t window = encInfo->stego_win.map ? AIO_WINDOW : (size_t)len;
+        for (size_t n; done < len; done += n)
+        {
+            n = (size_t)(len - done) < window ? (size_t)(len - done) : window;
+            bmp_encode_bits(&encInfo->plan, encInfo->carrier_pos, data + done, n, encInfo->src_map,
+                            encInfo->stego_map, 0, depth, encInfo->threads);
+            encInfo->carrier_pos += lsb_carrier_bytes(n, depth);
+            if (encInfo->stego_win.map)
+            {
+                size_t end = bmp_phys_end(&encInfo->plan, encInfo->carrier_pos);
+                bmp_copy_padding(&encInfo->plan, encInfo->pad_pos, encInfo->carrier_pos, encInfo->src_map,
+                                 encInfo->stego_map);
+                encInfo->pad_pos = encInfo->carrier_pos;
+                aio_window_advance(&encInfo->src_win, end);
+                aio_window_advance(&encInfo->stego_win, end);
+            }
+        }
+        metrics_io(encInfo->metrics, carrier, carrier, 0);
+        return e_success;
     }
 
-   // printf("Encoding byte to lsb completed!\n");
-   // printf("Encoding data to image completed!\n");
+    // Encode the data in blocks that fit the carrier scratch buffer
+    while (done < len)
+    {
+        long int n = len - done;
+        if (n > MAX_SECRET_BUF_SIZE)
+            n = MAX_SECRET_BUF_SIZE;
+        carrier = lsb_carrier_bytes(n, depth);
 
-    // Confirm that all data has been encoded
-    if (i == len)
-        return e_success;
-    else
-        return e_failure;
+        // The block starts at the current file position, so padding left by the previous one is copied too
+        size_t start = encInfo->src_pos;
+        size_t extent = bmp_phys_end(&encInfo->plan, encInfo->carrier_pos + carrier) - start;
+        if (extent > MAX_IMAGE_BUF_SIZE)
+            return e_failure;
+
+        // Read the file bytes of the whole block in one call
+        if (read_src(encInfo, extent) == e_failure)
+            return e_failure;
+
+        // Hide the block in the LSBs of its carrier bytes, the padding is left as it is
+        bmp_encode_bits(&encInfo->plan, encInfo->carrier_pos, data + done, n, encInfo->image_data,
+                        encInfo->image_data, start, depth, 1);
+
+        if (write_stego(encInfo, extent) == e_failure)
+            return e_failure;
+        metrics_io(encInfo->metrics, extent, extent, 2);
+        encInfo->src_pos += extent;
+        encInfo->carrier_pos += carrier;
+        done += n;
+    }
+
+    return e_success;
 }
 
-/* Encode an integer (size) to the LSB of 32 bytes */
-Status encode_size_to_lsb(int data, FILE *fptr_src_image, FILE *fptr_stego_image)
+/* Add the parity rows to the full block in ecc_block and embed it */
+static Status embed_ecc_block(EncodeInfo *encInfo)
 {
-   // printf("Encoding size to lsb started!\n");
-    char image_buffer[32];
+    rs_encode_block(&encInfo->rs, encInfo->ecc_block);
+    encInfo->ecc_fill = 0;
+    return embed_carrier((const char *)encInfo->ecc_block, RS_BLOCK, encInfo);
+}
 
-    // Read 32 bytes from the source image
-    fread(image_buffer, 32, 1, fptr_src_image);
+/* Encode data into the image, collected into Reed-Solomon blocks while ecc_active is set */
+Status encode_data_to_image(const char *data, long int len, EncodeInfo *encInfo)
+{
+    if (!encInfo->ecc_active)
+        return embed_carrier(data, len, encInfo);
+    if (len < 0)
+        return e_failure;
 
-    // Encode each bit of the integer into the LSBs of the buffer
-    for (int i = 31; i >= 0; i--)
+    size_t room = RS_DATA_BYTES(encInfo->ecc);
+    for (size_t left = len, n; left > 0; left -= n, data += n)
     {
-        if (data & (1 << i))
-            image_buffer[31 - i] |= 0x01; // Set LSB to 1
-        else
-            image_buffer[31 - i] &= 0xFE; // Set LSB to 0
+        n = room - encInfo->ecc_fill < left ? room - encInfo->ecc_fill : left;
+        memcpy(encInfo->ecc_block + encInfo->ecc_fill, data, n);
+        encInfo->ecc_fill += n;
+        if (encInfo->ecc_fill == room && embed_ecc_block(encInfo) == e_failure)
+            return e_failure;
     }
+    return e_success;
+}
 
-    // Write the modified buffer to the stego image
-    fwrite(image_buffer, 32, 1, fptr_stego_image);
-   // printf("Encoding size to lsb completed!\n");
+/* Embed the last block, the payload rows after the data are zeros */
+Status encode_ecc_flush(EncodeInfo *encInfo)
+{
+    if (encInfo->ecc_fill == 0)
+        return e_success;
+    memset(encInfo->ecc_block + encInfo->ecc_fill, 0, RS_DATA_BYTES(encInfo->ecc) - encInfo->ecc_fill);
+    return embed_ecc_block(encInfo);
+}
+
+/* Encode an integer (size) to the LSB of 32 bytes (fewer at depth > 1) */
+Status encode_size_to_lsb(int data, EncodeInfo *encInfo)
+{
+    // Most significant byte first, so bit 31 lands in the first carrier byte
+    char bytes[4] = {(char)(data >> 24), (char)(data >> 16), (char)(data >> 8), (char)data};
+
+    return encode_data_to_image(bytes, 4, encInfo);
+}
 
+/* Encode the header flags word, always at depth 1 like the magic string */
+Status encode_header_flags(uint flags, EncodeInfo *encInfo)
+{
+    // The decoder of a protected image takes a bitwise majority vote of three copies
+    int copies = flags & FLAG_ECC_MASK ? 3 : 1;
+
+    for (int i = 0; i < copies; i++)
+        if (encode_size_to_lsb((int)flags, encInfo) == e_failure)
+            return e_failure;
     return e_success;
 }
 
 /* Encode a single byte of data to the LSBs of an 8-byte buffer */
 Status encode_byte_to_lsb(char data, char *image_buffer)
 {
-    // Encode each bit of the byte into the LSBs of the buffer
-    for (int i = 7; i >= 0; i--)
-    {
-        if (data & (1 << i))
-            image_buffer[7 - i] |= 0x01; // Set LSB to 1
-        else
-            image_buffer[7 - i] &= 0xFE; // Set LSB to 0
-    }
+    // Encode the 8 bits of the byte into the LSBs of the buffer, without branches
+    lsb_encode_bytes(&data, 1, image_buffer, image_buffer);
 
     return e_success;
 }
@@ -301,12 +782,12 @@ Status encode_secret_file_extn(const char *file_extn, EncodeInfo *encInfo)
     int len = strlen(file_extn);
 
     // Encode the length of the file extension
-    OperationType res = encode_size_to_lsb(len, encInfo->fptr_src_image, encInfo->fptr_stego_image);
+    OperationType res = encode_size_to_lsb(len, encInfo);
     if (res == e_failure)
         return e_failure;
 
     // Encode the actual file extension
-    res = encode_data_to_image(file_extn, len, encInfo->fptr_src_image, encInfo->fptr_stego_image);
+    res = encode_data_to_image(file_extn, len, encInfo);
    // printf("Encoding file extension completed!\n");
 
     if (res == e_failure)
@@ -319,45 +800,557 @@ Status encode_secret_file_extn(const char *file_extn, EncodeInfo *encInfo)
 Status encode_secret_file_size(long file_size, EncodeInfo *encInfo)
 {
    // printf("Encoding secret file size\n");
-    int res = encode_size_to_lsb(file_size, encInfo->fptr_src_image, encInfo->fptr_stego_image);
+    int res;
+    // A 64-bit size is stored as two 32-bit halves, high one first
+    if (size64(encInfo))
+        res = encode_size_to_lsb((int)(file_size >> 32), encInfo) || encode_size_to_lsb((int)file_size, encInfo);
+    else
+        res = encode_size_to_lsb(file_size, encInfo);
     if (res)
         return e_failure;
     else
         return e_success;
 }
 
+/* Append n bytes to the block collected in secret_data, embedding the block whenever it is full */
+static Status frame_put(const char *p, size_t n, size_t *fill, EncodeInfo *encInfo)
+{
+    while (n > 0)
+    {
+        size_t k = MAX_SECRET_BUF_SIZE - *fill < n ? MAX_SECRET_BUF_SIZE - *fill : n;
+        memcpy(encInfo->secret_data + *fill, p, k);
+        if (encInfo->checksum)
+            encInfo->crc = crc32c_update(encInfo->crc, p, k);
+        *fill += k;
+        p += k;
+        n -= k;
+
+        // Only full blocks are embedded before the end, so every block starts on a carrier group boundary
+        if (*fill == MAX_SECRET_BUF_SIZE)
+        {
+            if (encode_data_to_image(encInfo->secret_data, *fill, encInfo) == e_failure)
+                return e_failure;
+            *fill = 0;
+        }
+    }
+    return e_success;
+}
+
+/* Encode the secret as frames of [length][bytes], one per read, followed by an end frame of length 0 */
+static Status encode_framed_data(EncodeInfo *encInfo)
+{
+    char chunk[MAX_SECRET_BUF_SIZE];
+    size_t fill = 0, n;
+    Status ret = e_success;
+
+    do
+    {
+        n = fread(chunk, 1, sizeof(chunk), encInfo->fptr_secret);
+        char len[4] = {(char)(n >> 24), (char)(n >> 16), (char)(n >> 8), (char)n};
+        metrics_io(encInfo->metrics, n, 0, 1);
+        ret = frame_put(len, 4, &fill, encInfo);
+        if (ret == e_success)
+            ret = frame_put(chunk, n, &fill, encInfo);
+        encInfo->size_secret_file += n;
+    } while (ret == e_success && n > 0);
+
+    // The checksum covers every frame, the end frame included
+    if (ret == e_success && encInfo->checksum)
+    {
+        uint32_t crc = encInfo->crc;
+        char bytes[4] = {(char)(crc >> 24), (char)(crc >> 16), (char)(crc >> 8), (char)crc};
+        ret = frame_put(bytes, 4, &fill, encInfo);
+    }
+
+    // Embed the last, partial block
+    if (ret == e_success && fill > 0)
+        ret = encode_data_to_image(encInfo->secret_data, fill, encInfo);
+    if (ret == e_failure && encInfo->carrier_pos + lsb_carrier_bytes(MAX_SECRET_BUF_SIZE, job_depth(encInfo)) > encInfo->plan.capacity)
+        fprintf(stderr, "ERROR: The secret stream does not fit in the image\n");
+    if (ferror(encInfo->fptr_secret))
+        return e_failure;
+    return ret;
+}
+
+/* Payload of the async pipeline, block i embeds bytes [i * chunk, (i + 1) * chunk) of data */
+typedef struct
+{
+    EncodeInfo *encInfo;
+    const char *data;
+    size_t len;
+    size_t chunk;           // Payload bytes per block, a multiple of the depth
+    size_t carrier_pos;     // Logical position of block 0
+    const uint64_t *bounds;
+} AsyncEmbed;
+
+static Status embed_block(char *buf, size_t block, size_t len, void *arg)
+{
+    AsyncEmbed *a = arg;
+    EncodeInfo *encInfo = a->encInfo;
+    int depth = field_depth(encInfo);
+    size_t off = block * a->chunk;
+    size_t n = a->len - off < a->chunk ? a->len - off : a->chunk;
+
+    (void)len;
+    if (encInfo->checksum)
+        encInfo->crc = crc32c_update(encInfo->crc, a->data + off, n);
+    bmp_encode_bits(&encInfo->plan, a->carrier_pos + lsb_carrier_bytes(off, depth), a->data + off, n, buf, buf,
+                    a->bounds[block], depth, encInfo->threads);
+    return e_success;
+}
+
+/* Embed len bytes with the async pipeline: carrier blocks are read ahead and written behind while one is embedded */
+static Status encode_data_async(const char *data, long len, EncodeInfo *encInfo)
+{
+    int depth = field_depth(encInfo);
+    size_t chunk = (size_t)AIO_BLOCK_CARRIER / 8 * depth;
+    size_t nblocks = (len + chunk - 1) / chunk;
+    size_t carrier = lsb_carrier_bytes(len, depth);
+
+    if (encInfo->carrier_pos + carrier > encInfo->plan.capacity || fflush(encInfo->fptr_stego_image))
+        return e_failure;
+
+    // Block i spans the file bytes of its carrier bytes, plus the padding left in front of it
+    uint64_t *bounds = arena_alloc(encInfo->arena, (nblocks + 1) * sizeof(uint64_t));
+    if (bounds == NULL)
+        return e_failure;
+    bounds[0] = encInfo->src_pos;
+    for (size_t i = 1; i <= nblocks; i++)
+    {
+        size_t end = i * chunk < (size_t)len ? i * chunk : (size_t)len;
+        bounds[i] = bmp_phys_end(&encInfo->plan, encInfo->carrier_pos + lsb_carrier_bytes(end, depth));
+    }
+
+    AsyncEmbed a = {encInfo, data, len, chunk, encInfo->carrier_pos, bounds};
+    AioJob job = {0};
+    job.fd_in = fileno(encInfo->fptr_src_image);
+    job.fd_out = fileno(encInfo->fptr_stego_image);
+    job.nblocks = nblocks;
+    job.bounds = bounds;
+    job.mode = encInfo->aio;
+    job.fn = embed_block;
+    job.arg = &a;
+    Status ret = aio_run(&job);
+
+    if (encInfo->metrics)
+        encInfo->metrics->backend = job.backend;
+    metrics_io(encInfo->metrics, bounds[nblocks] - bounds[0], bounds[nblocks] - bounds[0], job.io_calls);
+
+    // Both streams continue after the last block, the tail is copied through them
+    encInfo->src_pos = bounds[nblocks];
+    encInfo->carrier_pos += carrier;
+    if (ret == e_success && (fseek(encInfo->fptr_src_image, encInfo->src_pos, SEEK_SET) ||
+                             fseek(encInfo->fptr_stego_image, encInfo->src_pos, SEEK_SET)))
+        ret = e_failure;
+    arena_release(encInfo->arena, bounds);
+    return ret;
+}
+
+/* Whether the data stage can run on the async pipeline, it needs positioned I/O on both images and raw data */
+static int use_async(const EncodeInfo *encInfo)
+{
+    struct stat st;
+
+    if (encInfo->aio == e_aio_off || encInfo->src_map || encInfo->png_in || encInfo->ecc_active)
+        return 0;
+    if (fstat(fileno(encInfo->fptr_src_image), &st) || !S_ISREG(st.st_mode))
+        return 0;
+    return !fstat(fileno(encInfo->fptr_stego_image), &st) && S_ISREG(st.st_mode);
+}
+
+/* Embed a part of the secret, the checksum reads every piece right before it is embedded */
+static Status embed_payload(const char *data, long len, int async, EncodeInfo *encInfo)
+{
+    if (async)
+        return encode_data_async(data, len, encInfo);
+    if (!encInfo->checksum)
+        return encode_data_to_image(data, len, encInfo);
+
+    for (long done = 0, n; done < len; done += n)
+    {
+        n = len - done < CRC_PIECE ? len - done : CRC_PIECE;
+        encInfo->crc = crc32c_update(encInfo->crc, data + done, n);
+        if (encode_data_to_image(data + done, n, encInfo) == e_failure)
+            return e_failure;
+    }
+    return e_success;
+}
+
+/* Encode the CRC32C of the data stage, most significant byte first like the other fields */
+Status encode_checksum(EncodeInfo *encInfo)
+{
+    return encode_size_to_lsb((int)encInfo->crc, encInfo);
+}
+
+/* Store a 32-bit value of the compressed stream, most significant byte first */
+static void put_u32(char *p, uint32_t v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+/* Size of the secret at the start of a compressed stream, 64-bit like the size field for FLAG_SIZE64 */
+static size_t put_stream_size(char *p, long size)
+{
+    if (size <= SIZE32_MAX)
+    {
+        put_u32(p, size);
+        return 4;
+    }
+    put_u32(p, (uint32_t)(size >> 32));
+    put_u32(p + 4, (uint32_t)size);
+    return 8;
+}
+
+/* Compress a chunk of n bytes into a record at rec (room for 8 + n bytes), returns the size of the record */
+static size_t pack_record(const unsigned char *in, size_t n, char *rec)
+{
+    // Store the chunk as it is when it does not compress
+    size_t k = lz_compress(in, n, (unsigned char *)rec + 8, n);
+    if (k == 0 || k >= n)
+    {
+        memcpy(rec + 8, in, n);
+        k = n;
+    }
+    put_u32(rec, n);
+    put_u32(rec + 4, k);
+    return 8 + k;
+}
+
+/* Next n bytes of the secret, read into buf unless the secret is in memory, NULL when the file ends early */
+static const unsigned char *secret_chunk(EncodeInfo *encInfo, long done, size_t n, unsigned char *buf)
+{
+    if (encInfo->secret_mem)
+        return (const unsigned char *)encInfo->secret_mem + done;
+    if (fread(buf, 1, n, encInfo->fptr_secret) != n)
+        return NULL;
+    metrics_io(encInfo->metrics, n, 0, 1);
+    return buf;
+}
+
+/* Compress the secret a second time and embed the stream measured by compress_secret() record by record */
+static Status encode_packed_stream(EncodeInfo *encInfo)
+{
+    long size = encInfo->size_secret_file;
+    unsigned char *chunk = arena_alloc(encInfo->arena, LZ_CHUNK);
+    char *rec = arena_alloc(encInfo->arena, 8 + LZ_CHUNK);
+    size_t fill = 0;
+    Status ret = chunk && rec ? e_success : e_failure;
+
+    if (ret == e_success && encInfo->secret_mem == NULL && fseek(encInfo->fptr_secret, 0, SEEK_SET))
+        ret = e_failure;
+    char head[8];
+    long pos = put_stream_size(head, size);
+    if (ret == e_success)
+        ret = frame_put(head, pos, &fill, encInfo);
+    for (long done = 0, n; ret == e_success && done < size; done += n)
+    {
+        n = size - done < LZ_CHUNK ? size - done : LZ_CHUNK;
+        const unsigned char *in = secret_chunk(encInfo, done, n, chunk);
+        if (in == NULL)
+        {
+            ret = e_failure;
+            break;
+        }
+        size_t k = pack_record(in, n, rec);
+        ret = frame_put(rec, k, &fill, encInfo);
+        pos += k;
+    }
+
+    // Embed the last, partial block, the stream must be the one whose size was stored
+    if (ret == e_success && fill > 0)
+        ret = encode_data_to_image(encInfo->secret_data, fill, encInfo);
+    arena_release(encInfo->arena, rec);
+    arena_release(encInfo->arena, chunk);
+    return ret == e_success && pos == encInfo->packed_size ? e_success : e_failure;
+}
+
 /* Encode the actual data of the secret file */
 Status encode_secret_file_data(EncodeInfo *encInfo)
 {
-   // printf("Encoding secret data started\n");
+    long int total = 0;
+    size_t n;
+    int async = use_async(encInfo);
+
+    // A compressed secret is already in memory, as a whole, unless it was too large to be held
+    if (encInfo->packed)
+        return embed_payload(encInfo->packed, encInfo->packed_size, async, encInfo);
+    if (encInfo->packed_stream)
+        return encode_packed_stream(encInfo);
+
+    // An in-memory secret is embedded in one pass like a mapped one
+    if (encInfo->secret_mem)
+        return embed_payload(encInfo->secret_mem, encInfo->size_secret_file, async, encInfo);
+
+    // A secret of unknown size is read to its end and embedded in frames
+    if (encInfo->framed)
+        return encode_framed_data(encInfo);
+
     fseek(encInfo->fptr_secret, 0, SEEK_SET); // Move to the start of the secret file
 
-    // Read the secret data into memory
-   // printf("len of the file -> %ld\n", encInfo->size_secret_file);
-    int l = encInfo->size_secret_file;
-    fread(encInfo->secret_data, encInfo->size_secret_file, 1, encInfo->fptr_secret);
-   // printf("data -> %s\n", encInfo->secret_data);
-    encInfo->size_secret_file = l;
-   // printf("len of the file -> %ld\n", encInfo->size_secret_file);
+    // With the mapped backend, map the secret as well and embed it in one parallel pass.
+    // The async pipeline maps it too, the kernel reads it ahead like the carrier
+    if ((encInfo->src_map || async) && encInfo->size_secret_file > 0)
+    {
+        void *secret = mmap(NULL, encInfo->size_secret_file, PROT_READ, MAP_PRIVATE, fileno(encInfo->fptr_secret), 0);
+        if (secret != MAP_FAILED)
+        {
+            metrics_io(encInfo->metrics, encInfo->size_secret_file, 0, 1);
+            madvise(secret, encInfo->size_secret_file, MADV_SEQUENTIAL);
 
-    // Encode the secret data to the image
-    OperationType res = encode_data_to_image(encInfo->secret_data, encInfo->size_secret_file, encInfo->fptr_src_image, encInfo->fptr_stego_image);
-    if (res == e_failure)
+            // A secret larger than memory is released window by window behind the embedding
+            AioWindow win;
+            Status ret = e_success;
+            aio_window_init(&win, secret, -1, 0);
+            for (long done = 0, n; ret == e_success && done < encInfo->size_secret_file; done += n)
+            {
+                n = encInfo->size_secret_file - done < AIO_WINDOW ? encInfo->size_secret_file - done : AIO_WINDOW;
+                ret = embed_payload((const char *)secret + done, n, async, encInfo);
+                aio_window_advance(&win, done + n);
+            }
+            munmap(secret, encInfo->size_secret_file);
+            return ret;
+        }
+    }
+
+    // Stream the secret file chunk by chunk, so memory use does not depend on its size
+    while ((n = fread(encInfo->secret_data, 1, MAX_SECRET_BUF_SIZE, encInfo->fptr_secret)) > 0)
+    {
+        // Never encode more than the size already stored in the image
+        if (total + (long int)n > encInfo->size_secret_file)
+            return e_failure;
+
+        metrics_io(encInfo->metrics, n, 0, 1);
+        if (embed_payload(encInfo->secret_data, n, 0, encInfo) == e_failure)
+            return e_failure;
+        total += n;
+    }
+
+    // The file must not have shrunk since its size was encoded
+    if (ferror(encInfo->fptr_secret) || total != encInfo->size_secret_file)
         return e_failure;
-    else
+    return e_success;
+}
+
+/* Size of the compressed stream of a secret too large to hold it, sets packed_stream when the stream pays off */
+static Status measure_stream(EncodeInfo *encInfo, long size)
+{
+    unsigned char *chunk = arena_alloc(encInfo->arena, LZ_CHUNK);
+    char *rec = arena_alloc(encInfo->arena, 8 + LZ_CHUNK);
+    Status ret = chunk && rec ? e_success : e_failure;
+    char head[8];
+    long pos = put_stream_size(head, size);
+
+    if (ret == e_success && encInfo->secret_mem == NULL && fseek(encInfo->fptr_secret, 0, SEEK_SET))
+        ret = e_failure;
+    for (long done = 0, n; ret == e_success && done < size && pos < size; done += n)
+    {
+        n = size - done < LZ_CHUNK ? size - done : LZ_CHUNK;
+        const unsigned char *in = secret_chunk(encInfo, done, n, chunk);
+        if (in == NULL)
+            ret = e_failure;
+        else
+            pos += pack_record(in, n, rec);
+    }
+    arena_release(encInfo->arena, rec);
+    arena_release(encInfo->arena, chunk);
+
+    if (ret == e_success && pos < size)
+    {
+        encInfo->packed_stream = 1;
+        encInfo->packed_size = pos;
+    }
+    return ret;
+}
+
+/*
+ * Compress the secret into encInfo->packed: its size, then one record per
+ * LZ_CHUNK bytes of the secret holding the chunk size, the stored size and
+ * the lz_compress() block. A chunk that does not shrink is stored as it is
+ * (stored size equal to the chunk size). packed stays NULL when the whole
+ * stream would not be smaller than the secret, which is then embedded raw.
+ */
+Status compress_secret(EncodeInfo *encInfo)
+{
+    long size = encInfo->secret_mem ? encInfo->size_secret_file : (long)get_file_size(encInfo->fptr_secret);
+    unsigned char *chunk = NULL;
+    Status ret = e_success;
+    long pos = 4;
+
+    encInfo->packed = NULL;
+    encInfo->packed_stream = 0;
+    if (size <= pos + 8)
         return e_success;
+
+    // A stream too large to be held is only measured here, encode_packed_stream() produces it again
+    if (size > MAX_PACKED_SIZE)
+        return measure_stream(encInfo, size);
+
+    // The stream is only kept when smaller than the secret, so size bytes are always enough
+    char *out = arena_alloc(encInfo->arena, size);
+    if (out == NULL)
+        return e_failure;
+    if (encInfo->secret_mem == NULL)
+    {
+        chunk = arena_alloc(encInfo->arena, LZ_CHUNK);
+        if (chunk == NULL || fseek(encInfo->fptr_secret, 0, SEEK_SET))
+            ret = e_failure;
+    }
+    put_u32(out, size);
+
+    // pos reaching size means the stream no longer pays off
+    for (long done = 0, n; ret == e_success && done < size && pos < size; done += n)
+    {
+        n = size - done < LZ_CHUNK ? size - done : LZ_CHUNK;
+        const unsigned char *in = (const unsigned char *)encInfo->secret_mem + done;
+        if (chunk)
+        {
+            if (fread(chunk, 1, n, encInfo->fptr_secret) != (size_t)n)
+            {
+                ret = e_failure;
+                break;
+            }
+            metrics_io(encInfo->metrics, n, 0, 1);
+            in = chunk;
+        }
+        if (pos + 8 >= size)
+        {
+            pos = size;
+            break;
+        }
+
+        // Store the chunk as it is when it does not compress
+        size_t k = lz_compress(in, n, (unsigned char *)out + pos + 8, size - pos - 8);
+        if (k == 0 || k >= (size_t)n)
+        {
+            if (pos + 8 + n >= size)
+            {
+                pos = size;
+                break;
+            }
+            memcpy(out + pos + 8, in, n);
+            k = n;
+        }
+        put_u32(out + pos, n);
+        put_u32(out + pos + 4, k);
+        pos += 8 + k;
+    }
+    arena_release(encInfo->arena, chunk);
+
+    if (ret == e_success && pos < size)
+    {
+        encInfo->packed = out;
+        encInfo->packed_size = pos;
+    }
+    else
+        arena_release(encInfo->arena, out);
+    return ret;
 }
 
 /* Copy the remaining image data after encoding */
-Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest)
+Status copy_remaining_img_data(EncodeInfo *encInfo)
 {
-    char ch;
+    FILE *fptr_src = encInfo->fptr_src_image;
+    FILE *fptr_dest = encInfo->fptr_stego_image;
+
+    // Mapped backend, the stego mapping already has the final size
+    if (encInfo->src_map)
+    {
+        size_t pos = bmp_phys_end(&encInfo->plan, encInfo->carrier_pos);
+        size_t tail = encInfo->map_size - pos;
+        // With a key copy_bmp_header() copied the whole image already
+        if (encInfo->stego_map != encInfo->src_map && !encInfo->key)
+        {
+            // The padding of the rows already embedded was skipped by the kernels
+            bmp_copy_padding(&encInfo->plan, encInfo->pad_pos, encInfo->carrier_pos, encInfo->src_map,
+                             encInfo->stego_map);
+            for (size_t done = 0, n; done < tail; done += n)
+            {
+                n = tail - done < AIO_WINDOW ? tail - done : AIO_WINDOW;
+                memcpy(encInfo->stego_map + pos + done, encInfo->src_map + pos + done, n);
+                aio_window_advance(&encInfo->src_win, pos + done + n);
+                aio_window_advance(&encInfo->stego_win, pos + done + n);
+            }
+            metrics_io(encInfo->metrics, tail, tail, 0);
+        }
+        return e_success;
+    }
+
+    // The rows left pass through the PNG reader and writer, then both end their streams
+    if (encInfo->png_in)
+    {
+        for (size_t left = encInfo->plan.capacity - encInfo->carrier_pos, n; left; left -= n)
+        {
+            n = left < MAX_IMAGE_BUF_SIZE ? left : MAX_IMAGE_BUF_SIZE;
+            if (read_src(encInfo, n) == e_failure || write_stego(encInfo, n) == e_failure)
+                return e_failure;
+            metrics_io(encInfo->metrics, n, n, 2);
+        }
+        encInfo->carrier_pos = encInfo->plan.capacity;
+        if (png_writer_finish(encInfo->png_out) == e_failure || png_reader_finish(encInfo->png_in) == e_failure)
+        {
+            if (encInfo->src_image_fname)
+                fprintf(stderr, "ERROR: %s is a damaged PNG image\n", encInfo->src_image_fname);
+            return e_failure;
+        }
+        return e_success;
+    }
+
+    // Flush buffered stego bytes so the descriptors reflect the stdio positions
+    if (fflush(fptr_dest))
+        return e_failure;
+    long in_pos = ftell(fptr_src);
+    long out_pos = ftell(fptr_dest);
+
+#ifdef __linux__
+    if (in_pos >= 0 && out_pos >= 0)
+    {
+        int fd_in = fileno(fptr_src);
+        int fd_out = fileno(fptr_dest);
+        off_t off_in = in_pos, off_out = out_pos;
+        ssize_t n;
+
+        // Let the kernel copy the untouched tail, the bytes never enter user space
+        while ((n = copy_file_range(fd_in, &off_in, fd_out, &off_out, 1 << 30, 0)) > 0)
+            metrics_io(encInfo->metrics, n, n, 1);
 
-    // Copy byte by byte until the end of the source image
-    while (fread(&ch, 1, 1, fptr_src))
-        fwrite(&ch, 1, 1, fptr_dest);
+        // Fall back to sendfile() when the filesystems cannot do copy_file_range()
+        if (n < 0 && off_in == in_pos && lseek(fd_out, off_out, SEEK_SET) == off_out)
+        {
+            while ((n = sendfile(fd_out, fd_in, &off_in, 1 << 30)) > 0)
+                metrics_io(encInfo->metrics, n, n, 1);
+            off_out = lseek(fd_out, 0, SEEK_CUR);
+        }
 
-   // printf("Encoding process completed!\n");
+        if (n == 0)
+        {
+            // Resync both streams with the descriptors the kernel advanced
+            fseek(fptr_src, off_in, SEEK_SET);
+            fseek(fptr_dest, off_out, SEEK_SET);
+            return e_success;
+        }
+
+        // Nothing usable was copied, restore the positions for the buffered copy
+        if (off_in != in_pos)
+            return e_failure;
+        fseek(fptr_src, in_pos, SEEK_SET);
+        fseek(fptr_dest, out_pos, SEEK_SET);
+    }
+#endif
+
+    // Portable fallback, copy through a large buffer
+    char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fptr_src)) > 0)
+    {
+        if (fwrite(buffer, 1, n, fptr_dest) != n)
+            return e_failure;
+        metrics_io(encInfo->metrics, n, n, 2);
+    }
+
+    if (ferror(fptr_src))
+        return e_failure;
     return e_success;
 }
-
@@ -2,6 +2,13 @@
 #define ENCODE_H
 
 #include "types.h" // Contains user defined types
+#include "metrics.h"
+#include "bmp.h"
+#include "aio.h"
+#include "scatter.h"
+#include "arena.h"
+#include "png.h"
+#include "rs.h"
 
 /* 
  * Structure to store information required for
@@ -10,29 +17,75 @@
  * also stored
  */
 
-#define MAX_SECRET_BUF_SIZE 100
-#define MAX_IMAGE_BUF_SIZE (MAX_SECRET_BUF_SIZE * 8)
-#define MAX_FILE_SUFFIX 4
+#define MAX_SECRET_BUF_SIZE 12288   // Secret file is streamed in chunks of this size, a multiple of every depth
+#define MAX_IMAGE_BUF_SIZE (MAX_SECRET_BUF_SIZE * 12) // Carrier bytes of one chunk plus the row padding between them
+#define MAX_FILE_SUFFIX 8   // Room for the extension and its terminating NUL
+#define MAX_PACKED_SIZE (64L << 20) // Larger secrets are compressed twice, to measure the stream and while embedding it
+
+struct _Container;          // Files packed by do_pack(), see container.h
 
 typedef struct _EncodeInfo
 {
     /* Source Image info */
     char *src_image_fname;      // Filename of the source image (the image into which data will be hidden)
     FILE *fptr_src_image;       // File pointer to the source image, used to open and read the image
-    uint image_capacity;        // The total size of the image in bytes (capacity for hiding data)
-    uint bits_per_pixel;        // The number of bits used to represent each pixel in the image (e.g., 24-bit for RGB)
-    char image_data[MAX_IMAGE_BUF_SIZE]; // Buffer to store the image data for encoding (e.g., pixel values)
+    size_t image_capacity;      // Embeddable bytes of the image, the pixel bytes outside the row padding
+    uint bits_per_pixel;        // The number of bits used to represent each pixel in the image (24 or 32)
+    BmpPlan plan;               // Header fields and embeddable runs, parsed by check_capacity()
+    unsigned char bmp_header[BMP_HEADER_SIZE]; // Header bytes read by check_capacity() on the stdio backend
+    size_t carrier_pos;         // Logical position of the next carrier byte in the plan
+    size_t src_pos;             // Source image bytes consumed by the stdio backend, which may be a pipe
 
     /* Secret File Info */
     char *secret_fname;         // Filename of the secret data file (the file that will be hidden inside the image)
     FILE *fptr_secret;          // File pointer to the secret file, used to open and read the file to be hidden
     char extn_secret_file[MAX_FILE_SUFFIX]; // Extension of the secret file (e.g., ".txt", ".jpg")
-    char secret_data[MAX_SECRET_BUF_SIZE]; // Buffer to store the secret data to be hidden inside the image
+    const char *secret_mem;     // In-memory secret of size_secret_file bytes, used instead of fptr_secret when set
     long size_secret_file;      // Size of the secret file (in bytes), used to determine how much data will be hidden
+    char *packed;               // Compressed secret stream (heap), NULL when the secret is embedded raw
+    long packed_size;           // Size of the compressed stream
+    int packed_stream;          // Too large for packed, the stream is compressed again while it is embedded
+    int framed;                 // Size unknown up front (a pipe), the secret is embedded in frames
+    int checksum;               // Store a CRC32C of the embedded data after it (FLAG_CRC)
+    uint32_t crc;               // CRC32C of the data embedded so far
+    struct _Container *container; // Several files with a directory instead of one secret (FLAG_CONTAINER)
 
     /* Stego Image Info */
     char *stego_image_fname;    // Filename of the resulting stego image (image that will contain the hidden data)
     FILE *fptr_stego_image;     // File pointer to the stego image, used to open and write the resulting image after encoding
+
+    /* PNG carriers, streamed a row at a time on the stdio backend */
+    PngReader *png_in;          // Inflates the source image, NULL for a BMP
+    PngWriter *png_out;         // Deflates the stego image, opened by copy_bmp_header()
+
+    /* Memory-mapped backend, used instead of stdio when both images can be mapped */
+    const char *src_map;        // Read-only mapping of the source image (NULL for the stdio backend)
+    char *stego_map;            // Writable mapping of the stego image, preallocated to the source size
+    size_t map_size;            // Size of the source image and of both mappings
+    AioWindow src_win;          // Releases the source pages behind the embedding, set by map_files() only
+    AioWindow stego_win;        // Writes back and releases the stego pages behind the embedding
+    size_t pad_pos;             // Carrier position up to which the row padding was copied to stego_map
+
+    /* Job options */
+    int quiet;                  // Suppress the progress messages
+    int compress;               // Compress the secret before embedding it, kept only when it shrinks
+    int depth;                  // Carrier LSBs used per carrier byte, 1..LSB_MAX_DEPTH (0 = 1)
+    int cur_depth;              // Depth of the field being written, magic string and flags always use 1
+    int threads;                // Worker threads for large mapped payloads (0 = one per CPU, 1 = sequential)
+    AioMode aio;                // Pipeline the data stage with aio_run() instead of mapping the images
+    const char *key;            // Scatter everything after the flags word with this key (FLAG_SCATTER), NULL = in order
+    Scatter *scatter;           // Positions for key, set once the flags word is written, freed by close_files()
+    int ecc;                    // Reed-Solomon parity bytes per 255 protecting everything after the flags word, 0 = none
+    int ecc_active;             // Set once the flags words are written, encode_data_to_image() then fills ecc_block
+    size_t ecc_fill;            // Payload bytes collected in ecc_block
+    Metrics *metrics;           // Per-stage timings and I/O counters, NULL when not collected
+    Arena *arena;               // Allocations of the job (file names, compressed secret), NULL = heap
+
+    /* I/O buffers, last so that job_encode() resets everything before them at once */
+    char image_data[MAX_IMAGE_BUF_SIZE]; // Scratch buffer holding the file bytes of one chunk while it is encoded
+    char secret_data[MAX_SECRET_BUF_SIZE]; // Chunk buffer, the secret file is read and encoded one chunk at a time
+    RsCode rs;                  // Code for ecc, built by rs_init() when the flags words are written
+    unsigned char ecc_block[RS_BLOCK]; // Block being collected, its parity rows are added when it is full
 } EncodeInfo;
 
 
@@ -48,43 +101,73 @@ Status read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo);
 /* Perform the encoding */
 Status do_encoding(EncodeInfo *encInfo);
 
+/* Run the stages after open_files(), on files or caller buffers */
+Status encode_image(EncodeInfo *encInfo);
+
+/* Open fname, or return stdin/stdout when it is STDIO_NAME */
+FILE *open_stream(const char *fname, const char *mode);
+
+/* Close a file from open_stream(), stdin and stdout are only flushed */
+int close_stream(FILE *fp);
+
 /* Get File pointers for i/p and o/p files */
 Status open_files(EncodeInfo *encInfo);
 
+/* Map source and stego image, leaves the stdio backend in place on failure */
+Status map_files(EncodeInfo *encInfo);
+
+/* Unmap the images and close all files */
+Status close_files(EncodeInfo *encInfo);
+
+/* Close the files of a failed encode and remove the stego image it left half written */
+void discard_files(EncodeInfo *encInfo);
+
 /* check capacity */
 Status check_capacity(EncodeInfo *encInfo);
 
 /* Get image size */
-uint get_image_size_for_bmp(FILE *fptr_image);
+size_t get_image_size_for_bmp(FILE *fptr_image);
 
 /* Get file size */
-uint get_file_size(FILE *fptr);
+long get_file_size(FILE *fptr);
 
 /* Copy bmp image header */
-Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image);
+Status copy_bmp_header(EncodeInfo *encInfo);
 
 /* Store Magic String */
 Status encode_magic_string(const char *magic_string, EncodeInfo *encInfo);
 
+/* Store the header flags word after MAGIC_STRING_EXT, three times when it has FLAG_ECC_MASK bits */
+Status encode_header_flags(uint flags, EncodeInfo *encInfo);
+
 /* Encode secret file extenstion */
 Status encode_secret_file_extn(const char *file_extn, EncodeInfo *encInfo);
 
-/* Encode secret file size */
+/* Encode secret file size, 64-bit when the job needs FLAG_SIZE64 */
 Status encode_secret_file_size(long file_size, EncodeInfo *encInfo);
 
 /* Encode secret file data*/
 Status encode_secret_file_data(EncodeInfo *encInfo);
 
-/* Encode function, which does the real encoding */
-Status encode_data_to_image(const char *data,long int size, FILE *fptr_src_image, FILE *fptr_stego_image);
+/* Encode the CRC32C of the data after it */
+Status encode_checksum(EncodeInfo *encInfo);
+
+/* Encode function, which does the real encoding, in Reed-Solomon blocks once ecc_active is set */
+Status encode_data_to_image(const char *data, long int size, EncodeInfo *encInfo);
+
+/* Embed the last, partial Reed-Solomon block padded with zeros */
+Status encode_ecc_flush(EncodeInfo *encInfo);
 
 /* Encode a byte into LSB of image data array */
 Status encode_byte_to_lsb(char data, char *image_buffer);
 
-Status encode_size_to_lsb(int data, FILE *fptr_src_image,FILE *fptr_dest_image);
 /* Encode a size into LSB of image data array */
+Status encode_size_to_lsb(int data, EncodeInfo *encInfo);
+
+/* Compress the secret into packed, or measure the stream for packed_stream, leaves both unset when compression does not help */
+Status compress_secret(EncodeInfo *encInfo);
 
 /* Copy remaining image bytes from src to stego image after encoding */
-Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest);
+Status copy_remaining_img_data(EncodeInfo *encInfo);
 
 #endif
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "inspect.h"
+#include "bmp.h"
+#include "png.h"
+#include "common.h"
+#include "metrics.h"
+#include "pool.h"
+
+/* Logical carrier bytes in front of the payload at most: magic and flags (three copies with error correction) at
+   depth 1, then extension, size and compressed size */
+#define INSPECT_FIELDS (8 * (4 + sizeof(MAGIC_STRING_EXT) + 3 * 4) + 8 * (4 + EXTEN_LEN + 8 + 8))
+
+/* Decode the hidden fields out of the header region in buf */
+static void inspect_fields(Dec_Info *decinfo, const unsigned char *buf, size_t n, const BmpPlan *plan, InspectResult *res)
+{
+    // The decoder stages run on the buffer as if it were a mapping of the image
+    decinfo->in_map = (const char *)buf;
+    decinfo->map_size = n;
+    decinfo->plan = *plan;
+    decinfo->carrier_pos = 0;
+    decinfo->fp_input = NULL;
+    decinfo->input_fname = NULL;
+    decinfo->quiet = 1;
+    decinfo->metrics = NULL;
+
+    if (decode_magic_string(decinfo) == e_failure)
+        return;
+    res->is_stego = 1;
+    res->flags = decinfo->flags;
+    res->depth = decinfo->depth;
+    res->size = res->raw_size = -1;
+
+    // Without the key nothing after the flags word can be found, and with error correction it is in a block of
+    // tens of KB that is not worth reading for a scan
+    if (res->flags & (FLAG_SCATTER | FLAG_ECC_MASK))
+        return;
+    if (decode_extension(decinfo) == e_failure)
+        return;
+    strcpy(res->extn, decinfo->extn);
+
+    // A framed payload has no size field, its length is only known after reading all of it
+    if (res->flags & FLAG_FRAMED)
+        return;
+
+    // A container has the size of its index there, the index starts with the number of files
+    if (res->flags & FLAG_CONTAINER)
+    {
+        if (decode_size_from_lsb(decinfo) >= 4)
+            res->size = res->raw_size = decode_size_from_lsb(decinfo);
+        return;
+    }
+    res->size = res->raw_size = decode_length_from_lsb(decinfo);
+
+    // A compressed stream starts with the size of the hidden file, as wide as the size field
+    if (res->size >= 4 && (res->flags & FLAG_COMPRESSED))
+        res->raw_size = decode_length_from_lsb(decinfo);
+}
+
+/* The fields of a PNG only exist once inflated, the rows holding them are inflated into buf */
+static void inspect_png(int fd, Dec_Info *decinfo, unsigned char *buf, InspectResult *res)
+{
+    int dup_fd = dup(fd);
+    FILE *fp = dup_fd >= 0 ? fdopen(dup_fd, "rb") : NULL;
+    PngReader *r = NULL;
+    BmpPlan plan;
+
+    if (fp == NULL)
+    {
+        if (dup_fd >= 0)
+            close(dup_fd);
+        return;
+    }
+    r = png_reader_open(fp, NULL, NULL, &plan);
+    if (r)
+    {
+        size_t fields = plan.capacity < INSPECT_FIELDS ? plan.capacity : INSPECT_FIELDS;
+        if (png_read(r, buf, fields) == e_success)
+            inspect_fields(decinfo, buf, fields, &plan, res);
+        res->bytes_read = png_bytes_read(r);
+    }
+    png_reader_close(r);
+    fclose(fp);
+}
+
+Status inspect_image(const char *fname, Dec_Info *decinfo, unsigned char *buf, InspectResult *res)
+{
+    struct stat st;
+    BmpPlan plan;
+    Status ret = e_failure;
+
+    memset(res, 0, sizeof(*res));
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return e_failure;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        // One positioned read normally covers the BMP header and every hidden field
+        ssize_t n = pread(fd, buf, INSPECT_READ_SIZE, 0);
+        if (n >= 0)
+        {
+            res->bytes_read = n;
+            ret = e_success;
+        }
+
+        // Files that are no supported BMP or PNG simply carry nothing
+        if (n >= 8 && !memcmp(buf, PNG_SIGNATURE, 8))
+            inspect_png(fd, decinfo, buf, res);
+        else if (n > 0 && bmp_parse(buf, n, st.st_size, &plan) == e_success)
+        {
+            size_t fields = plan.capacity < INSPECT_FIELDS ? plan.capacity : INSPECT_FIELDS;
+            size_t end = bmp_phys_end(&plan, fields);
+
+            // A large palette or narrow padded rows push the fields further out
+            if (end > (size_t)n && end <= INSPECT_MAX_READ)
+            {
+                ssize_t m = pread(fd, buf + n, end - n, n);
+                if (m > 0)
+                {
+                    n += m;
+                    res->bytes_read += m;
+                }
+            }
+            inspect_fields(decinfo, buf, n, &plan, res);
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+/* Print the result of one image */
+static void print_result(const char *fname, const InspectResult *res)
+{
+    if (!res->is_stego)
+        printf("INFO : %s : no hidden data\n", fname);
+    else if (res->flags & FLAG_SCATTER)
+        printf("INFO : %s : hidden data scattered with a key (depth %d)\n", fname, res->depth);
+    else if (res->flags & FLAG_ECC_MASK)
+        printf("INFO : %s : hidden data protected by Reed-Solomon, %d parity bytes per 255 (depth %d)\n", fname,
+               (res->flags & FLAG_ECC_MASK) >> FLAG_ECC_SHIFT, res->depth);
+    else if (res->flags & FLAG_FRAMED)
+        printf("INFO : %s : hidden %s%sstream of unknown length (depth %d)\n", fname, res->extn, res->extn[0] ? " " : "",
+               res->depth);
+    else if (res->size < 0)
+        printf("INFO : %s : magic string found, hidden header is truncated\n", fname);
+    else if (res->flags & FLAG_CONTAINER)
+        printf("INFO : %s : hidden container of %ld files (depth %d)\n", fname, res->size, res->depth);
+    else if (res->raw_size != res->size)
+        printf("INFO : %s : hidden %s file of %ld bytes, compressed to %ld bytes (depth %d)\n", fname, res->extn,
+               res->raw_size, res->size, res->depth);
+    else
+        printf("INFO : %s : hidden %s file of %ld bytes (depth %d)\n", fname, res->extn, res->size, res->depth);
+}
+
+Status do_inspect(char *fnames[])
+{
+    Dec_Info *decinfo = calloc(1, sizeof(Dec_Info));
+    unsigned char *buf = malloc(INSPECT_MAX_READ);
+    Status ret = e_success;
+
+    if (decinfo == NULL || buf == NULL)
+        ret = e_failure;
+    for (int i = 0; ret == e_success && fnames[i]; i++)
+    {
+        InspectResult res;
+        if (inspect_image(fnames[i], decinfo, buf, &res) == e_failure)
+        {
+            perror("open");
+            fprintf(stderr, "ERROR: Unable to read file %s\n", fnames[i]);
+            ret = e_failure;
+            continue;
+        }
+        print_result(fnames[i], &res);
+    }
+    free(decinfo);
+    free(buf);
+    return ret;
+}
+
+typedef struct
+{
+    char *path;
+    int is_dir;
+} ScanEntry;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ScanEntry queue[SCAN_QUEUE_SIZE]; // Ring buffer of paths waiting for a worker
+    size_t head;
+    size_t count;
+    int busy;               // Workers handling an entry, they may still queue more
+} Scan;
+
+typedef struct
+{
+    Scan *scan;
+    Dec_Info *decinfo;      // Scratch context of the worker
+    unsigned char *buf;     // Header region read buffer of the worker
+    uint64_t files;         // Images inspected
+    uint64_t stego;         // Images carrying hidden data
+    uint64_t errors;        // Files or directories that could not be read
+    uint64_t bytes;         // Bytes read from images
+} ScanWorker;
+
+static void scan_entry(ScanWorker *w, char *path, int is_dir);
+
+/* Queue an entry for any worker, or handle it right away when the queue is full */
+static void offer(ScanWorker *w, char *path, int is_dir)
+{
+    Scan *scan = w->scan;
+
+    pthread_mutex_lock(&scan->lock);
+    if (scan->count < SCAN_QUEUE_SIZE)
+    {
+        ScanEntry *e = &scan->queue[(scan->head + scan->count++) % SCAN_QUEUE_SIZE];
+        e->path = path;
+        e->is_dir = is_dir;
+        pthread_cond_signal(&scan->cond);
+        pthread_mutex_unlock(&scan->lock);
+        return;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    scan_entry(w, path, is_dir);
+}
+
+/* Only files named *.bmp or *.png are inspected */
+static int is_image_name(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && (!strcasecmp(name + len - 4, ".bmp") || !strcasecmp(name + len - 4, ".png"));
+}
+
+/* List one directory, queueing subdirectories and images */
+static void scan_dir(ScanWorker *w, const char *path)
+{
+    DIR *dir = opendir(path);
+    struct dirent *d;
+
+    if (dir == NULL)
+    {
+        w->errors++;
+        return;
+    }
+    while ((d = readdir(dir)) != NULL)
+    {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+
+        int is_dir = d->d_type == DT_DIR;
+        int is_reg = d->d_type == DT_REG;
+        if (!is_dir && !is_reg && d->d_type != DT_UNKNOWN)
+            continue;
+        if (!is_dir && !is_image_name(d->d_name) && d->d_type != DT_UNKNOWN)
+            continue;
+
+        size_t len = strlen(path) + strlen(d->d_name) + 2;
+        char *child = malloc(len);
+        if (child == NULL)
+        {
+            w->errors++;
+            continue;
+        }
+        snprintf(child, len, "%s/%s", path, d->d_name);
+
+        // Some filesystems do not report the type, symbolic links are never followed
+        if (d->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (lstat(child, &st) || (!S_ISDIR(st.st_mode) && !(S_ISREG(st.st_mode) && is_image_name(d->d_name))))
+            {
+                free(child);
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        offer(w, child, is_dir);
+    }
+    closedir(dir);
+}
+
+/* Handle one entry and release its path */
+static void scan_entry(ScanWorker *w, char *path, int is_dir)
+{
+    InspectResult res;
+
+    if (is_dir)
+        scan_dir(w, path);
+    else if (inspect_image(path, w->decinfo, w->buf, &res) == e_failure)
+        w->errors++;
+    else
+    {
+        w->files++;
+        w->bytes += res.bytes_read;
+        if (res.is_stego)
+        {
+            w->stego++;
+            print_result(path, &res);
+        }
+    }
+    free(path);
+}
+
+static void *scan_worker(void *arg)
+{
+    ScanWorker *w = arg;
+    Scan *scan = w->scan;
+
+    for (;;)
+    {
+        // Wait while the queue is empty but other workers may still fill it
+        pthread_mutex_lock(&scan->lock);
+        while (scan->count == 0 && scan->busy > 0)
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        if (scan->count == 0)
+        {
+            pthread_mutex_unlock(&scan->lock);
+            return NULL;
+        }
+        ScanEntry e = scan->queue[scan->head];
+        scan->head = (scan->head + 1) % SCAN_QUEUE_SIZE;
+        scan->count--;
+        scan->busy++;
+        pthread_mutex_unlock(&scan->lock);
+
+        scan_entry(w, e.path, e.is_dir);
+
+        // The last busy worker finding the queue empty releases everyone
+        pthread_mutex_lock(&scan->lock);
+        if (--scan->busy == 0 && scan->count == 0)
+            pthread_cond_broadcast(&scan->cond);
+        pthread_mutex_unlock(&scan->lock);
+    }
+}
+
+Status do_scan(const char *root, int nthreads)
+{
+    Scan *scan = calloc(1, sizeof(Scan));
+    Status ret = e_success;
+
+    if (nthreads <= 0)
+        nthreads = pool_cpu_count();
+    ScanWorker *workers = calloc(nthreads, sizeof(ScanWorker));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (scan == NULL || workers == NULL || threads == NULL)
+    {
+        free(scan);
+        free(workers);
+        free(threads);
+        return e_failure;
+    }
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->cond, NULL);
+
+    // Each worker keeps its own decoder context and read buffer for all of its images
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].scan = scan;
+        workers[i].decinfo = calloc(1, sizeof(Dec_Info));
+        workers[i].buf = malloc(INSPECT_MAX_READ);
+        if (workers[i].decinfo == NULL || workers[i].buf == NULL)
+            ret = e_failure;
+    }
+
+    uint64_t start = metrics_now_ns();
+    char *path = strdup(root);
+    if (ret == e_success && path)
+    {
+        scan->queue[0].path = path;
+        scan->queue[0].is_dir = 1;
+        scan->count = 1;
+
+        // The calling thread is worker 0
+        int started = 1;
+        for (int i = 1; i < nthreads; i++, started++)
+            if (pthread_create(&threads[i], NULL, scan_worker, &workers[i]))
+                break;
+        scan_worker(&workers[0]);
+        for (int i = 1; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+    else
+    {
+        free(path);
+        ret = e_failure;
+    }
+    uint64_t wall = metrics_now_ns() - start;
+
+    // Totals of all workers
+    uint64_t files = 0, stego = 0, errors = 0, bytes = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        files += workers[i].files;
+        stego += workers[i].stego;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        free(workers[i].decinfo);
+        free(workers[i].buf);
+    }
+    printf("INFO : %llu images scanned in %.3f s on %d threads, %llu carry hidden data, %llu unreadable, %llu bytes read\n",
+           (unsigned long long)files, wall / 1e9, nthreads, (unsigned long long)stego, (unsigned long long)errors,
+           (unsigned long long)bytes);
+
+    pthread_mutex_destroy(&scan->lock);
+    pthread_cond_destroy(&scan->cond);
+    free(scan);
+    free(workers);
+    free(threads);
+    return ret;
+}
@@ -0,0 +1,43 @@
+#ifndef INSPECT_H
+#define INSPECT_H
+
+#include <stdint.h>
+#include "types.h"
+#include "decode.h"
+
+/*
+ * Inspect mode: read only the header region of an image (the BMP header
+ * and the hidden fields in front of the payload) with one positioned read
+ * and report what it carries. A PNG is read up to the first rows instead,
+ * which hold the fields once inflated. No output file is ever created.
+ *
+ * Scan mode runs the same check over whole directory trees. Directories
+ * are walked in parallel, and the queue of paths waiting for a worker is
+ * bounded: a worker that finds it full handles the entry itself.
+ */
+
+#define INSPECT_READ_SIZE 4096  // One read covers the header region of common BMPs
+#define INSPECT_MAX_READ 65536  // Largest header region read, for big palettes or narrow padded rows
+#define SCAN_QUEUE_SIZE 4096    // Paths waiting for a worker
+
+typedef struct _InspectResult
+{
+    int is_stego;           // Carries one of the two magic strings
+    uint flags;             // Header flags word, 0 for images in the original layout
+    int depth;              // Embedding depth
+    char extn[EXTEN_LEN];   // Extension of the hidden file
+    long size;              // Embedded payload size
+    long raw_size;          // Size of the hidden file, larger than size when compressed
+    uint64_t bytes_read;    // Bytes read from the image
+} InspectResult;
+
+/* Inspect one image with decinfo as scratch context and buf (INSPECT_MAX_READ bytes) for the read */
+Status inspect_image(const char *fname, Dec_Info *decinfo, unsigned char *buf, InspectResult *res);
+
+/* Inspect the images named on the command line and print a line for each */
+Status do_inspect(char *fnames[]);
+
+/* Inspect every .bmp and .png under root on nthreads workers (0 = one per CPU), printing the stego ones */
+Status do_scan(const char *root, int nthreads);
+
+#endif
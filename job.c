@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "job.h"
+
+Job *job_new(void)
+{
+    // Zeroed once, the I/O buffers are never cleared again
+    return calloc(1, sizeof(Job));
+}
+
+void job_free(Job *job)
+{
+    if (job)
+        arena_free(&job->arena);
+    free(job);
+}
+
+void job_reset(Job *job)
+{
+    arena_reset(&job->arena);
+}
+
+EncodeInfo *job_encode(Job *job)
+{
+    EncodeInfo *encInfo = &job->enc;
+
+    // Only the fields in front of the I/O buffers
+    memset(encInfo, 0, offsetof(EncodeInfo, image_data));
+    encInfo->arena = &job->arena;
+    return encInfo;
+}
+
+Dec_Info *job_decode(Job *job)
+{
+    Dec_Info *decinfo = &job->dec;
+
+    memset(decinfo, 0, offsetof(Dec_Info, data));
+    decinfo->arena = &job->arena;
+    return decinfo;
+}
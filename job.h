@@ -0,0 +1,42 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include "encode.h"
+#include "decode.h"
+#include "arena.h"
+
+/*
+ * Reusable job context for callers that run many jobs in one process
+ * (batch workers, daemon workers, libsteg contexts). It owns the encoder
+ * and decoder state with their I/O buffers and one arena for everything a
+ * job allocates. Starting a job resets the arena, handing out the encoder or
+ * decoder clears the job fields but not the I/O buffers, which are always
+ * written before they are read, so a warm context costs neither a heap
+ * allocation nor a pass over its buffers. In-memory jobs run on one thread
+ * (libsteg contexts, inline daemon jobs) then allocate nothing at all; file
+ * jobs still get their FILE streams from libc and parallel ones start their
+ * threads per job.
+ */
+
+typedef struct _Job
+{
+    EncodeInfo enc;
+    Dec_Info dec;
+    Arena arena;
+} Job;
+
+/* New context, NULL when out of memory */
+Job *job_new(void);
+
+void job_free(Job *job);
+
+/* Start a new job, releases everything the previous one allocated from the arena */
+void job_reset(Job *job);
+
+/* Cleared encoder state that allocates from the arena, the arena is left alone so a job can retry */
+EncodeInfo *job_encode(Job *job);
+
+/* Cleared decoder state, same as job_encode() */
+Dec_Info *job_decode(Job *job);
+
+#endif
@@ -0,0 +1,414 @@
+#include <stdint.h>
+#include <string.h>
+#include "lsb.h"
+#include "pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LSB_X86 1
+#include <immintrin.h>
+#endif
+
+#define LSB_ONES 0x0101010101010101ULL
+
+/* spread_lut[b] holds the 8 LSBs that encode byte b, in carrier byte order */
+static uint64_t spread_lut[256];
+
+/* rev_lut[b] is b with its bits reversed, used after a movemask */
+static unsigned char rev_lut[256];
+
+/* Portable kernels, one table lookup per data byte */
+static void encode_scalar(const char *data, size_t n, const char *src, char *dst)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t x;
+        memcpy(&x, src + 8 * i, 8);
+        x = (x & ~LSB_ONES) | spread_lut[(unsigned char)data[i]];
+        memcpy(dst + 8 * i, &x, 8);
+    }
+}
+
+static void decode_scalar(const char *src, size_t n, char *data)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        // One multiply gathers the 8 LSBs into the top byte, first carrier byte as bit 7
+        uint64_t x;
+        memcpy(&x, src + 8 * i, 8);
+        data[i] = (char)(((x & LSB_ONES) * 0x8040201008040201ULL) >> 56);
+#else
+        unsigned char ch = 0;
+        for (int j = 0; j < 8; j++)
+            ch = (unsigned char)((ch << 1) | (src[8 * i + j] & 0x01));
+        data[i] = (char)ch;
+#endif
+    }
+}
+
+#ifdef LSB_X86
+/* SSE2, 2 data bytes per 16 carrier bytes */
+__attribute__((target("sse2")))
+static void encode_sse2(const char *data, size_t n, const char *src, char *dst)
+{
+    const __m128i bits = _mm_set_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                      0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80);
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        // Replicate data[i] over the low 8 lanes and data[i + 1] over the high 8 lanes
+        __m128i v = _mm_cvtsi32_si128((unsigned char)data[i] | ((unsigned char)data[i + 1] << 8));
+        v = _mm_unpacklo_epi8(v, v);
+        v = _mm_unpacklo_epi16(v, v);
+        v = _mm_unpacklo_epi32(v, v);
+        v = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, bits), bits), one);
+
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 8 * i));
+        c = _mm_or_si128(_mm_andnot_si128(one, c), v);
+        _mm_storeu_si128((__m128i *)(dst + 8 * i), c);
+    }
+    encode_scalar(data + i, n - i, src + 8 * i, dst + 8 * i);
+}
+
+__attribute__((target("sse2")))
+static void decode_sse2(const char *src, size_t n, char *data)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        // Move every LSB into the sign bit and collect the 16 sign bits
+        __m128i c = _mm_slli_epi64(_mm_loadu_si128((const __m128i *)(src + 8 * i)), 7);
+        unsigned m = (unsigned)_mm_movemask_epi8(c);
+        data[i] = (char)rev_lut[m & 0xFF];
+        data[i + 1] = (char)rev_lut[m >> 8];
+    }
+    decode_scalar(src + 8 * i, n - i, data + i);
+}
+
+/* BMI2, pdep/pext move the 8 bits of a data byte in a single instruction */
+__attribute__((target("bmi2")))
+static void encode_bmi2(const char *data, size_t n, const char *src, char *dst)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t x;
+        memcpy(&x, src + 8 * i, 8);
+        x = (x & ~LSB_ONES) | __builtin_bswap64(_pdep_u64((unsigned char)data[i], LSB_ONES));
+        memcpy(dst + 8 * i, &x, 8);
+    }
+}
+
+__attribute__((target("bmi2")))
+static void decode_bmi2(const char *src, size_t n, char *data)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t x;
+        memcpy(&x, src + 8 * i, 8);
+        data[i] = (char)_pext_u64(__builtin_bswap64(x), LSB_ONES);
+    }
+}
+
+/* AVX2, 4 data bytes per 32 carrier bytes, two blocks per iteration */
+__attribute__((target("avx2")))
+static inline __m256i spread_avx2(const char *data)
+{
+    const __m256i sel = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                         2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+    uint32_t d;
+
+    memcpy(&d, data, 4);
+    __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32((int)d), sel);
+    v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), bits);
+    return _mm256_and_si256(v, _mm256_set1_epi8(1));
+}
+
+__attribute__((target("avx2")))
+static void encode_avx2(const char *data, size_t n, const char *src, char *dst)
+{
+    const __m256i keep = _mm256_set1_epi8((char)0xFE);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i c0 = _mm256_loadu_si256((const __m256i *)(src + 8 * i));
+        __m256i c1 = _mm256_loadu_si256((const __m256i *)(src + 8 * i + 32));
+        c0 = _mm256_or_si256(_mm256_and_si256(c0, keep), spread_avx2(data + i));
+        c1 = _mm256_or_si256(_mm256_and_si256(c1, keep), spread_avx2(data + i + 4));
+        _mm256_storeu_si256((__m256i *)(dst + 8 * i), c0);
+        _mm256_storeu_si256((__m256i *)(dst + 8 * i + 32), c1);
+    }
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + 8 * i));
+        c = _mm256_or_si256(_mm256_and_si256(c, keep), spread_avx2(data + i));
+        _mm256_storeu_si256((__m256i *)(dst + 8 * i), c);
+    }
+    encode_scalar(data + i, n - i, src + 8 * i, dst + 8 * i);
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2(const char *src, size_t n, char *data)
+{
+    // Reverse each group of 8 bytes so movemask yields the first carrier byte as bit 7
+    const __m256i rev = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                         7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i c0 = _mm256_loadu_si256((const __m256i *)(src + 8 * i));
+        __m256i c1 = _mm256_loadu_si256((const __m256i *)(src + 8 * i + 32));
+        uint32_t m0 = (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi64(_mm256_shuffle_epi8(c0, rev), 7));
+        uint32_t m1 = (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi64(_mm256_shuffle_epi8(c1, rev), 7));
+        memcpy(data + i, &m0, 4);
+        memcpy(data + i + 4, &m1, 4);
+    }
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + 8 * i));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi64(_mm256_shuffle_epi8(c, rev), 7));
+        memcpy(data + i, &m, 4);
+    }
+    decode_scalar(src + 8 * i, n - i, data + i);
+}
+#endif
+
+typedef struct
+{
+    const char *name;
+    void (*encode)(const char *data, size_t n, const char *src, char *dst);
+    void (*decode)(const char *src, size_t n, char *data);
+} LsbKernel;
+
+static const LsbKernel kernels[] = {
+#ifdef LSB_X86
+    {"avx2", encode_avx2, decode_avx2},
+    {"sse2", encode_sse2, decode_sse2},
+    {"bmi2", encode_bmi2, decode_bmi2},
+#endif
+    {"scalar", encode_scalar, decode_scalar},
+};
+
+static const LsbKernel *active = &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+
+/* Build the tables and pick the fastest kernel the CPU supports, before main() runs */
+__attribute__((constructor))
+static void lsb_init(void)
+{
+    for (int b = 0; b < 256; b++)
+    {
+        unsigned char spread[8];
+        unsigned char r = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            spread[j] = (b >> (7 - j)) & 0x01;
+            r |= ((b >> j) & 0x01) << (7 - j);
+        }
+        memcpy(&spread_lut[b], spread, 8);
+        rev_lut[b] = r;
+    }
+
+#ifdef LSB_X86
+    __builtin_cpu_init();
+    // Ranked by measured throughput: pdep/pext move one byte per instruction, and are microcoded on AMD before
+    // Zen 3, so bmi2 trails sse2 everywhere and is only used when selected by name
+    if (__builtin_cpu_supports("avx2"))
+        active = &kernels[0];
+    else if (__builtin_cpu_supports("sse2"))
+        active = &kernels[1];
+#endif
+}
+
+void lsb_encode_bytes(const char *data, size_t n, const char *src, char *dst)
+{
+    active->encode(data, n, src, dst);
+}
+
+void lsb_decode_bytes(const char *src, size_t n, char *data)
+{
+    active->decode(src, n, data);
+}
+
+/*
+ * Depth 2-4 kernels. At depth k every group of k data bytes fills exactly
+ * 8 carrier bytes with k bits each, most significant bits first. The body
+ * is written once and instantiated per depth with a constant k, so each
+ * kernel gets its own fully unrolled inner loop without depth branches.
+ */
+static inline __attribute__((always_inline))
+void encode_depth_k(const char *data, size_t n, const char *src, char *dst, const int k)
+{
+    const unsigned mask = (1u << k) - 1;
+    const uint64_t low = mask * LSB_ONES;
+    size_t groups = n / k;
+
+    for (size_t i = 0; i < groups; i++)
+    {
+        uint64_t v = 0, x, spread;
+        unsigned char c[8];
+
+        for (int b = 0; b < k; b++)
+            v = v << 8 | (unsigned char)data[k * i + b];
+        for (int j = 0; j < 8; j++)
+            c[j] = (unsigned char)((v >> (8 * k - k * (j + 1))) & mask);
+        memcpy(&spread, c, 8);
+        memcpy(&x, src + 8 * i, 8);
+        x = (x & ~low) | spread;
+        memcpy(dst + 8 * i, &x, 8);
+    }
+
+    // Last partial group, zero bits pad the final carrier byte
+    size_t rem = n - groups * k;
+    if (rem)
+    {
+        uint64_t v = 0;
+        size_t m = lsb_carrier_bytes(rem, k);
+        src += 8 * groups;
+        dst += 8 * groups;
+        for (int b = 0; b < k; b++)
+            v = v << 8 | ((size_t)b < rem ? (unsigned char)data[k * groups + b] : 0);
+        for (size_t j = 0; j < m; j++)
+            dst[j] = (char)((src[j] & ~mask) | ((v >> (8 * k - k * (j + 1))) & mask));
+    }
+}
+
+static inline __attribute__((always_inline))
+void decode_depth_k(const char *src, size_t n, char *data, const int k)
+{
+    const unsigned mask = (1u << k) - 1;
+    size_t groups = n / k;
+
+    for (size_t i = 0; i < groups; i++)
+    {
+        uint64_t v = 0;
+        unsigned char c[8];
+
+        memcpy(c, src + 8 * i, 8);
+        for (int j = 0; j < 8; j++)
+            v = v << k | (c[j] & mask);
+        for (int b = 0; b < k; b++)
+            data[k * i + b] = (char)(v >> (8 * (k - 1 - b)));
+    }
+
+    size_t rem = n - groups * k;
+    if (rem)
+    {
+        uint64_t v = 0;
+        size_t m = lsb_carrier_bytes(rem, k);
+        src += 8 * groups;
+        for (int j = 0; j < 8; j++)
+            v = v << k | ((size_t)j < m ? (src[j] & mask) : 0);
+        for (size_t b = 0; b < rem; b++)
+            data[k * groups + b] = (char)(v >> (8 * (k - 1 - b)));
+    }
+}
+
+static void encode_depth1(const char *data, size_t n, const char *src, char *dst) { active->encode(data, n, src, dst); }
+static void encode_depth2(const char *data, size_t n, const char *src, char *dst) { encode_depth_k(data, n, src, dst, 2); }
+static void encode_depth3(const char *data, size_t n, const char *src, char *dst) { encode_depth_k(data, n, src, dst, 3); }
+static void encode_depth4(const char *data, size_t n, const char *src, char *dst) { encode_depth_k(data, n, src, dst, 4); }
+
+static void decode_depth1(const char *src, size_t n, char *data) { active->decode(src, n, data); }
+static void decode_depth2(const char *src, size_t n, char *data) { decode_depth_k(src, n, data, 2); }
+static void decode_depth3(const char *src, size_t n, char *data) { decode_depth_k(src, n, data, 3); }
+static void decode_depth4(const char *src, size_t n, char *data) { decode_depth_k(src, n, data, 4); }
+
+/* Indexed by depth, depth 1 goes through the CPU dispatched kernel set */
+static void (*const encode_depth[LSB_MAX_DEPTH + 1])(const char *, size_t, const char *, char *) = {
+    NULL, encode_depth1, encode_depth2, encode_depth3, encode_depth4
+};
+static void (*const decode_depth[LSB_MAX_DEPTH + 1])(const char *, size_t, char *) = {
+    NULL, decode_depth1, decode_depth2, decode_depth3, decode_depth4
+};
+
+size_t lsb_carrier_bytes(size_t n, int depth)
+{
+    return (8 * n + depth - 1) / depth;
+}
+
+void lsb_encode_bits(const char *data, size_t n, const char *src, char *dst, int depth)
+{
+    encode_depth[depth](data, n, src, dst);
+}
+
+void lsb_decode_bits(const char *src, size_t n, char *data, int depth)
+{
+    decode_depth[depth](src, n, data);
+}
+
+/* One stripe job, every stripe maps to its own disjoint carrier range */
+typedef struct
+{
+    const char *data;
+    const char *src;
+    char *dst;
+    size_t n;
+    int depth;
+} LsbStripes;
+
+static void encode_stripe(size_t job, int worker, void *arg)
+{
+    LsbStripes *s = arg;
+    size_t off = job * LSB_STRIPE_SIZE;
+    size_t n = s->n - off < LSB_STRIPE_SIZE ? s->n - off : LSB_STRIPE_SIZE;
+    size_t coff = lsb_carrier_bytes(off, s->depth);
+    (void)worker;
+    encode_depth[s->depth](s->data + off, n, s->src + coff, s->dst + coff);
+}
+
+static void decode_stripe(size_t job, int worker, void *arg)
+{
+    LsbStripes *s = arg;
+    size_t off = job * LSB_STRIPE_SIZE;
+    size_t n = s->n - off < LSB_STRIPE_SIZE ? s->n - off : LSB_STRIPE_SIZE;
+    size_t coff = lsb_carrier_bytes(off, s->depth);
+    (void)worker;
+    decode_depth[s->depth](s->src + coff, n, (char *)s->data + off);
+}
+
+void lsb_encode_bits_mt(const char *data, size_t n, const char *src, char *dst, int depth, int threads)
+{
+    LsbStripes s = {data, src, dst, n, depth};
+    size_t stripes = (n + LSB_STRIPE_SIZE - 1) / LSB_STRIPE_SIZE;
+
+    // Small buffers, or a pool that cannot start, run on the calling thread
+    if (threads == 1 || stripes < 2 || pool_run(stripes, threads, encode_stripe, &s))
+        encode_depth[depth](data, n, src, dst);
+}
+
+void lsb_decode_bits_mt(const char *src, size_t n, char *data, int depth, int threads)
+{
+    LsbStripes s = {data, src, NULL, n, depth};
+    size_t stripes = (n + LSB_STRIPE_SIZE - 1) / LSB_STRIPE_SIZE;
+
+    if (threads == 1 || stripes < 2 || pool_run(stripes, threads, decode_stripe, &s))
+        decode_depth[depth](src, n, data);
+}
+
+const char *lsb_kernel_name(void)
+{
+    return active->name;
+}
+
+int lsb_select_kernel(const char *name)
+{
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (strcmp(kernels[i].name, name))
+            continue;
+#ifdef LSB_X86
+        // Never select a kernel the CPU cannot run
+        if ((!strcmp(name, "avx2") && !__builtin_cpu_supports("avx2")) ||
+            (!strcmp(name, "bmi2") && !__builtin_cpu_supports("bmi2")))
+            return -1;
+#endif
+        active = &kernels[i];
+        return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,50 @@
+#ifndef LSB_H
+#define LSB_H
+
+#include <stddef.h>
+
+/*
+ * Bulk LSB kernels shared by the encoder and the decoder.
+ * Every payload byte is spread over 8 carrier bytes, most significant
+ * bit first, exactly like encode_byte_to_lsb()/decode_byte_from_lsb().
+ * The fastest implementation for the running CPU (AVX2, SSE2 or the
+ * portable table driven one) is picked once at startup, the slower BMI2
+ * one only runs when selected by name.
+ */
+
+/* Hide n data bytes in 8 * n carrier bytes, src and dst may be the same buffer */
+void lsb_encode_bytes(const char *data, size_t n, const char *src, char *dst);
+
+/* Extract n data bytes from 8 * n carrier bytes */
+void lsb_decode_bytes(const char *src, size_t n, char *data);
+
+/* Embedding depth, carrier LSBs used per carrier byte */
+#define LSB_MAX_DEPTH 4
+
+/* Carrier bytes that hold n data bytes at the given depth */
+size_t lsb_carrier_bytes(size_t n, int depth);
+
+/*
+ * Same as lsb_encode_bytes()/lsb_decode_bytes() at depth 1..LSB_MAX_DEPTH.
+ * Every k data bytes fill 8 carrier bytes with k bits each, a trailing
+ * partial group is padded with zero bits up to the next carrier byte.
+ */
+void lsb_encode_bits(const char *data, size_t n, const char *src, char *dst, int depth);
+void lsb_decode_bits(const char *src, size_t n, char *data, int depth);
+
+/* Payload bytes per stripe when a large buffer is split across threads, a multiple of every depth */
+#define LSB_STRIPE_SIZE (3 << 18)
+
+/* Same as lsb_encode_bits(), split in stripes over up to threads workers (0 = one per CPU) */
+void lsb_encode_bits_mt(const char *data, size_t n, const char *src, char *dst, int depth, int threads);
+
+/* Same as lsb_decode_bits(), split in stripes over up to threads workers (0 = one per CPU) */
+void lsb_decode_bits_mt(const char *src, size_t n, char *data, int depth, int threads);
+
+/* Name of the kernel set selected for this CPU, e.g. "avx2" */
+const char *lsb_kernel_name(void);
+
+/* Force a kernel set by name ("scalar", "sse2", "bmi2", "avx2"), 0 on success */
+int lsb_select_kernel(const char *name);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 13
+#define LZ_LAST_LITERALS 5      // The tail of a block is never searched, so 4-byte reads stay inside it
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Append a length continuation (the part above 15) to op, NULL when it does not fit */
+static unsigned char *put_length(unsigned char *op, const unsigned char *oend, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Append one sequence, a match length of 0 ends the block with literals only */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend, const unsigned char *lit,
+                                   size_t nlit, size_t offset, size_t mlen)
+{
+    if (op >= oend)
+        return NULL;
+    unsigned char *token = op++;
+    *token = (unsigned char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15)))
+        return NULL;
+    if ((size_t)(oend - op) < nlit)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (unsigned char)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && !(op = put_length(op, oend, mlen - 15)))
+        return NULL;
+    return op;
+}
+
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    if (n > LZ_MIN_MATCH + LZ_LAST_LITERALS)
+    {
+        const unsigned char *limit = end - LZ_LAST_LITERALS - LZ_MIN_MATCH;
+        ip++;
+        while (ip < limit)
+        {
+            // Greedy match on the last position with the same 4-byte hash
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const unsigned char *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq)
+            {
+                // Skip faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            // Extend the match forwards, then backwards over the pending literals
+            const unsigned char *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+            while (m < end - LZ_LAST_LITERALS && *m == *r)
+                m++, r++;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+                ip--, ref--;
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+            if (op == NULL)
+                return 0;
+            ip = anchor = m;
+            if (ip < limit)
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    // Whatever is left goes out as literals
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < iend)
+    {
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        unsigned char b;
+
+        // Literals
+        if (len == 15)
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        // Match
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+        len = token & 15;
+        if (len == 15)
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        len += LZ_MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+
+        // Overlapping matches repeat the last offset bytes, so copy them in order
+        const unsigned char *m = op - offset;
+        if (offset >= len)
+            memcpy(op, m, len);
+        else
+            for (size_t i = 0; i < len; i++)
+                op[i] = m[i];
+        op += len;
+    }
+    return (long)(op - dst);
+}
@@ -0,0 +1,28 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/*
+ * Small LZ77 block codec for payload compression, byte oriented like LZ4.
+ * A block is a list of sequences:
+ *
+ *   token        high nibble literal count, low nibble match length - 4
+ *                (15 means more length bytes follow, each adding up to 255)
+ *   literals     copied as they are
+ *   offset       2 bytes little endian, distance back to the match
+ *
+ * The last sequence of a block has literals only. Blocks are independent,
+ * a match never reaches before the start of its block.
+ */
+
+#define LZ_CHUNK 65536                          // Largest block, payloads are compressed in chunks of this size
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)      // Worst case compressed size of n bytes
+
+/* Compress n bytes of src into dst, returns the compressed size or 0 when it does not fit in cap */
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap);
+
+/* Decompress a block of n bytes, returns the decompressed size or -1 when the block is corrupt or exceeds cap */
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap);
+
+#endif
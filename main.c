@@ -21,13 +21,121 @@ the secret data in the Least Significant Bit (LSB) of the innocent source image.
 #include <unistd.h>
 #include "encode.h"
 #include "decode.h"
+#include "batch.h"
+#include "inspect.h"
+#include "update.h"
+#include "container.h"
+#include "daemon.h"
+#include "lsb.h"
 #include "types.h"
+#include "common.h"
 #include <string.h>
+#include <limits.h>
+
+// Options accepted anywhere on the command line, removed before the positional arguments are read
+typedef struct _Options
+{
+    int quiet;                  // -q / --quiet : no progress messages
+    int threads;                // --threads=N : workers for one large payload (0 = one per CPU)
+    int depth;                  // --depth=N : carrier LSBs used per carrier byte when encoding
+    int compress;               // --compress : compress the secret before embedding it
+    AioMode aio;                // --aio[=threads] : pipeline the carrier I/O of the encoder
+    int checksum;               // --crc : store a CRC32C of the payload, checked by the decoder
+    int ecc;                    // --ecc[=N] : protect the hidden data with N Reed-Solomon parity bytes per 255
+    const char *key;            // --key=KEY : scatter the payload over the image, needed again to decode it
+    int report;                 // --metrics=json|csv : print per-stage metrics to stderr
+    ReportFormat report_format;
+} Options;
+
+// Function to read the number of an option into *value, 0 when it is a whole number between min and max
+static int option_number(const char *text, int min, int max, int *value)
+{
+    char *end;
+    long n = strtol(text, &end, 10);
+
+    if (end == text || *end || n < min || n > max)
+        return -1;
+    *value = (int)n;
+    return 0;
+}
+
+// Function to strip the options out of argv, returns the new argc or -1 on a bad option
+static int parse_options(int argc, char *argv[], Options *opt)
+{
+    int n = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quiet"))
+            opt->quiet = 1;
+        else if (!strcmp(argv[i], "--metrics") || !strcmp(argv[i], "--metrics=json")) {
+            opt->report = 1;
+            opt->report_format = e_report_json;
+        } else if (!strcmp(argv[i], "--metrics=csv")) {
+            opt->report = 1;
+            opt->report_format = e_report_csv;
+        } else if (!strcmp(argv[i], "--compress"))
+            opt->compress = 1;
+        else if (!strcmp(argv[i], "--crc"))
+            opt->checksum = 1;
+        else if (!strcmp(argv[i], "--ecc"))
+            opt->ecc = RS_DEFAULT_PARITY;
+        else if (!strncmp(argv[i], "--ecc=", 6)) {
+            if (option_number(argv[i] + 6, RS_MIN_PARITY, RS_MAX_PARITY, &opt->ecc)) {
+                printf("ERROR: --ecc must be between %d and %d\n", RS_MIN_PARITY, RS_MAX_PARITY);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--aio"))
+            opt->aio = e_aio_auto;
+        else if (!strcmp(argv[i], "--aio=threads"))
+            opt->aio = e_aio_threads;
+        else if (!strncmp(argv[i], "--key=", 6) && argv[i][6])
+            opt->key = argv[i] + 6;
+        else if (!strncmp(argv[i], "--threads=", 10)) {
+            if (option_number(argv[i] + 10, 0, INT_MAX, &opt->threads)) {
+                printf("ERROR: --threads must be 0 (one per CPU) or more\n");
+                return -1;
+            }
+        }
+        else if (!strncmp(argv[i], "--depth=", 8)) {
+            if (option_number(argv[i] + 8, 1, LSB_MAX_DEPTH, &opt->depth)) {
+                printf("ERROR: --depth must be between 1 and %d\n", LSB_MAX_DEPTH);
+                return -1;
+            }
+        }
+        else if (!strncmp(argv[i], "--", 2)) {
+            printf("ERROR: Unknown option %s\n", argv[i]);
+            return -1;
+        } else
+            argv[n++] = argv[i];
+    }
+    argv[n] = NULL;
+    return n;
+}
 
 // Main function to handle encoding and decoding based on command line arguments
 int main(int argc, char *argv[]) {
-    EncodeInfo encInfo; // Structure to store encoding information
-    Dec_Info decinfo; // Structure to store decoding information
+    EncodeInfo encInfo = {0}; // Structure to store encoding information
+    Dec_Info decinfo = {0}; // Structure to store decoding information
+    Options opt = {0}; // Options given on the command line
+    Arena arena = {0}; // File names of the job
+    Metrics metrics; // Per-stage metrics, only collected when a report is requested
+
+    argc = parse_options(argc, argv, &opt);
+    if (argc < 2) {
+        printf("Check arguments, unsupported operation type\n");
+        return 1;
+    }
+    encInfo.quiet = decinfo.quiet = opt.quiet;
+    encInfo.threads = decinfo.threads = opt.threads;
+    encInfo.depth = opt.depth;
+    encInfo.compress = opt.compress;
+    encInfo.aio = opt.aio;
+    encInfo.checksum = opt.checksum;
+    encInfo.ecc = opt.ecc;
+    encInfo.key = decinfo.key = opt.key;
+    encInfo.metrics = decinfo.metrics = opt.report ? &metrics : NULL;
+    encInfo.arena = decinfo.arena = &arena;
 
     // Check operation type (either encoding or decoding)
     OperationType res = check_operation_type(argc,argv);
@@ -35,16 +143,26 @@ int main(int argc, char *argv[]) {
     if (res == e_encode) {
         // Check if there are enough arguments for encoding
         if (argc >= 4) {
+            // The stego image goes to stdout, keep the progress messages out of it
+            if (argv[4] && !strcmp(argv[4], STDIO_NAME))
+                encInfo.quiet = opt.quiet = 1;
             res = read_and_validate_encode_args(argv, &encInfo);
             if (res == e_success) {
                 // Proceed with encoding process
                 res = do_encoding(&encInfo);
-                if (res == e_success)
-                    printf(":::::::ENCODING SUCCESSFUL::::::!\n");
-                else
-                    printf(":::::::ENCODING FAILED::::::!\n");
+                if (res == e_success) {
+                    if (!opt.quiet)
+                        printf(":::::::ENCODING SUCCESSFUL::::::!\n");
+                    if (opt.report)
+                        metrics_report(&metrics, opt.report_format, stderr);
+                } else
+                    fprintf(stderr, ":::::::ENCODING FAILED::::::!\n");
             } else
-                printf("\t\t\t\t\t\t:::::::VALIDATION FAILED :::::::\n");
+                fprintf(stderr, "\t\t\t\t\t\t:::::::VALIDATION FAILED :::::::\n");
+            arena_free(&arena);
+            // The stego image may have gone to stdout, only the status tells a pipeline it is unusable
+            if (res != e_success)
+                return 1;
         } else
             printf("Please give proper arguments for encoding\n");
     }
@@ -52,21 +170,112 @@ int main(int argc, char *argv[]) {
     else if (res == e_decode) {
         // Check if there are enough arguments for decoding
         if (argc >= 3) {
+            // The secret goes to stdout, keep the progress messages out of it
+            if (argv[3] && !strcmp(argv[3], STDIO_NAME))
+                decinfo.quiet = opt.quiet = 1;
             res = read_and_validate(argv, &decinfo);
             if (res == e_success) {
                 // Proceed with decoding process
                 res = do_decoding(&decinfo);
-                if (res == e_success)
-                    printf(":::::::DECODING SUCCESSFUL::::::!\n");
-                else
-                    printf(":::::::DECODING FAILED::::::!\n");
+                if (res == e_success) {
+                    if (!opt.quiet)
+                        printf(":::::::DECODING SUCCESSFUL::::::!\n");
+                    if (opt.report)
+                        metrics_report(&metrics, opt.report_format, stderr);
+                } else
+                    fprintf(stderr, ":::::::DECODING FAILED::::::!\n");
             }
+            arena_free(&arena);
+            // A checksum mismatch is found after the data went out, on stdout the status is all a pipeline sees
+            if (res != e_success)
+                return 1;
         } else
             printf("Please give proper arguments for decoding\n");
     }
+    // If operation is an in-place update of a stego image
+    else if (res == e_update) {
+        // Validated like an encoding whose source and stego image are the same file
+        char *args[] = {argv[0], argv[1], argv[2], argv[3], argv[2], NULL};
+        res = read_and_validate_encode_args(args, &encInfo);
+        if (res == e_success) {
+            res = do_update(&encInfo);
+            if (res == e_success) {
+                if (!opt.quiet)
+                    printf(":::::::UPDATE SUCCESSFUL::::::!\n");
+                if (opt.report)
+                    metrics_report(&metrics, opt.report_format, stderr);
+            } else
+                printf(":::::::UPDATE FAILED::::::!\n");
+        } else
+            printf("\t\t\t\t\t\t:::::::VALIDATION FAILED :::::::\n");
+        arena_free(&arena);
+        if (res != e_success)
+            return 1;
+    }
+    // If operation is packing several files into one carrier
+    else if (res == e_pack) {
+        // The stego image goes to stdout, keep the progress messages out of it
+        if (!strcmp(argv[3], STDIO_NAME))
+            encInfo.quiet = opt.quiet = 1;
+        // Validated like an encoding of the first file, the others are checked while packing
+        char *args[] = {argv[0], argv[1], argv[2], argv[4], argv[3], NULL};
+        res = read_and_validate_encode_args(args, &encInfo);
+        if (res == e_success) {
+            res = do_pack(&encInfo, argv + 4);
+            if (res == e_success) {
+                if (!opt.quiet)
+                    printf(":::::::PACKING SUCCESSFUL::::::!\n");
+                if (opt.report)
+                    metrics_report(&metrics, opt.report_format, stderr);
+            } else
+                fprintf(stderr, ":::::::PACKING FAILED::::::!\n");
+        } else
+            fprintf(stderr, "\t\t\t\t\t\t:::::::VALIDATION FAILED :::::::\n");
+        arena_free(&arena);
+        if (res != e_success)
+            return 1;
+    }
+    // If operation is listing or extracting the files of a container image
+    else if (res == e_list || res == e_extract) {
+        if (do_unpack(argv[2], argv + 3, res == e_extract, opt.quiet, opt.key, opt.report ? &metrics : NULL) != e_success)
+            return 1;
+        if (opt.report)
+            metrics_report(&metrics, opt.report_format, stderr);
+    }
+    // If operation is a batch of jobs from a manifest
+    else if (res == e_batch) {
+        int threads = 0; // Checked by check_operation_type()
+        if (argv[3])
+            option_number(argv[3], 0, INT_MAX, &threads);
+        res = do_batch(argv[2], threads);
+        if (res != e_success)
+            return 1;
+    }
+    // If operation is serving jobs over a Unix socket
+    else if (res == e_serve) {
+        int threads = 0; // Checked by check_operation_type()
+        if (argv[3])
+            option_number(argv[3], 0, INT_MAX, &threads);
+        if (do_daemon(argv[2], threads) != e_success)
+            return 1;
+    }
+    // If operation is a header-only look at images
+    else if (res == e_inspect) {
+        if (do_inspect(argv + 2) != e_success)
+            return 1;
+    }
+    // If operation is a scan of a directory tree
+    else if (res == e_scan) {
+        int threads = 0; // Checked by check_operation_type()
+        if (argv[3])
+            option_number(argv[3], 0, INT_MAX, &threads);
+        if (do_scan(argv[2], threads) != e_success)
+            return 1;
+    }
     // If the operation type is unsupported
     else {
         printf("Check arguments, unsupported operation type\n");
+        return 1;
     }
 }
 
@@ -91,62 +300,121 @@ OperationType check_operation_type(int argc,char *argv[])
         }
         return e_decode;
     }
+    else if (!strcmp(argv[1], "-u")) // Check if the argument asks to update a stego image in place
+    {
+        if(argc < 4)
+        {
+            printf("INFO : For Update mode Please pass the stego image and the new secret like ./a.out -u stego_image_file secret_data_file\n");
+            return e_unsupported;
+        }
+        return e_update;
+    }
+    else if (!strcmp(argv[1], "-c")) // Check if the argument asks to pack several files into one carrier
+    {
+        if(argc < 5)
+        {
+            printf("INFO : For Pack mode Please pass the carrier, the stego image and the files like ./a.out -c source_image_file stego_image_file file...\n");
+            return e_unsupported;
+        }
+        return e_pack;
+    }
+    else if (!strcmp(argv[1], "-l") || !strcmp(argv[1], "-x")) // Check if the argument asks to list or extract a container
+    {
+        if(argc < 3)
+        {
+            printf("INFO : For List and Extract mode Please pass the stego image like ./a.out -l stego_image_file or ./a.out -x stego_image_file [file...]\n");
+            return e_unsupported;
+        }
+        return argv[1][1] == 'l' ? e_list : e_extract;
+    }
+    else if (!strcmp(argv[1], "-b")) // Check if the argument asks for a batch manifest
+    {
+        int threads;
+        if(argc < 3 || (argv[3] && option_number(argv[3], 0, INT_MAX, &threads)))
+        {
+            printf("INFO : For Batch mode Please pass the manifest like ./a.out -b manifest_file [threads]\n");
+            return e_unsupported;
+        }
+        return e_batch;
+    }
+    else if (!strcmp(argv[1], "-i")) // Check if the argument asks to inspect images
+    {
+        if(argc < 3)
+        {
+            printf("INFO : For Inspect mode Please pass the images like ./a.out -i stego_image_file...\n");
+            return e_unsupported;
+        }
+        return e_inspect;
+    }
+    else if (!strcmp(argv[1], "-s")) // Check if the argument asks to scan a directory tree
+    {
+        int threads;
+        if(argc < 3 || (argv[3] && option_number(argv[3], 0, INT_MAX, &threads)))
+        {
+            printf("INFO : For Scan mode Please pass the directory like ./a.out -s directory [threads]\n");
+            return e_unsupported;
+        }
+        return e_scan;
+    }
+    else if (!strcmp(argv[1], "-S")) // Check if the argument asks to serve jobs over a Unix socket
+    {
+        int threads;
+        if(argc < 3 || (argv[3] && option_number(argv[3], 0, INT_MAX, &threads)))
+        {
+            printf("INFO : For Daemon mode Please pass the socket path like ./a.out -S socket_path [threads]\n");
+            return e_unsupported;
+        }
+        return e_serve;
+    }
     else
         return e_unsupported; // Return unsupported if neither
 }
 
 // Function to read and validate the arguments for encoding
 Status read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo) {
-    printf("\t\t\t\t\t\t:::::::VALIDATION STARTED :::::::\n");
+    if (!encInfo->quiet)
+        printf("\t\t\t\t\t\t:::::::VALIDATION STARTED :::::::\n");
 
-    // Allocate memory for file names
-    encInfo->src_image_fname = malloc(256 * sizeof(char));
-    encInfo->secret_fname = malloc(256 * sizeof(char));
-    encInfo->stego_image_fname = malloc(256 * sizeof(char));
-
-    // Check for successful memory allocation
-    if (encInfo->src_image_fname == NULL || encInfo->secret_fname == NULL || encInfo->stego_image_fname == NULL) {
-        printf("Memory allocation failed\n");
+    // Validate source image file extension, STDIO_NAME reads it from stdin
+    int png = strstr(argv[2], ".png") != NULL;
+    if (!png && strstr(argv[2], ".bmp") == NULL && strcmp(argv[2], STDIO_NAME)) {
+        printf("ERROR: Source image must have a .bmp or .png extension\n");
         return e_failure;
     }
 
-    // Validate source image file extension
-    char *p = strstr(argv[2], ".bmp");
-    if (p == NULL) {
-        printf("ERROR: Source image must have a .bmp extension\n");
-        return e_failure;
-    }
-    strcpy(encInfo->src_image_fname, argv[2]);
+    // Any type of secret file is accepted, its extension is recorded in the image. The stego image defaults to
+    // "output.bmp" ("output.png" for a PNG) when the fourth argument is not passed. The names are copied at their
+    // own length
+    encInfo->src_image_fname = arena_strdup(encInfo->arena, argv[2]);
+    encInfo->secret_fname = arena_strdup(encInfo->arena, argv[3]);
+    encInfo->stego_image_fname = arena_strdup(encInfo->arena, argv[4] ? argv[4] : png ? "output.png" : "output.bmp");
 
-    // Validate secret file extension
-    p = strstr(argv[3], ".txt");
-    if (p == NULL) {
-        printf("ERROR: Secret data file must have a .txt extension\n");
+    // Check for successful memory allocation
+    if (encInfo->src_image_fname == NULL || encInfo->secret_fname == NULL || encInfo->stego_image_fname == NULL) {
+        printf("Memory allocation failed\n");
         return e_failure;
     }
-    strcpy(encInfo->secret_fname, argv[3]);
-
-    // Check if the fourth argument is NULL (if not passed)
-    if (argv[4] == NULL) {
-        // Use the default "output.bmp" for stego image
-        strcpy(encInfo->stego_image_fname, "output.bmp");
-    } else {
-        // Otherwise, use the provided argument
-        strcpy(encInfo->stego_image_fname, argv[4]);
-    }
 
-    printf("\t\t\t\t\t\t:::::::VALIDATION COMPLETED :::::::\n");
+    if (!encInfo->quiet)
+        printf("\t\t\t\t\t\t:::::::VALIDATION COMPLETED :::::::\n");
     return e_success;
 }
 
 
 // Function to read and validate the arguments for decoding
 Status read_and_validate(char *argv[], Dec_Info *decinfo) {
-    printf("\t\t\t\t\t\t:::::::VALIDATION STARTED :::::::\n");
+    if (!decinfo->quiet)
+        printf("\t\t\t\t\t\t:::::::VALIDATION STARTED :::::::\n");
+
+    // Validate input file extension, STDIO_NAME reads it from stdin
+    if (strstr(argv[2], ".bmp") == NULL && strstr(argv[2], ".png") == NULL && strcmp(argv[2], STDIO_NAME)) {
+        printf("ERROR: Input file must have a .bmp or .png extension\n");
+        return e_failure;
+    }
 
-    // Allocate memory for input and output file names
-    decinfo->input_fname = malloc(256 * sizeof(char));
-    decinfo->output_fname = malloc(256 * sizeof(char));
+    // Set output file name or use the default "secret_output.txt" when the third argument is not passed
+    decinfo->input_fname = arena_strdup(decinfo->arena, argv[2]);
+    decinfo->output_fname = arena_strdup(decinfo->arena, argv[3] ? argv[3] : "secret_output.txt");
 
     // Check for successful memory allocation
     if (decinfo->input_fname == NULL || decinfo->output_fname == NULL) {
@@ -154,24 +422,8 @@ Status read_and_validate(char *argv[], Dec_Info *decinfo) {
         return e_failure;
     }
 
-    // Validate input file extension
-    char *p = strstr(argv[2], ".bmp");
-    if (p == NULL) {
-        printf("ERROR: Input file must have a .bmp extension\n");
-        return e_failure;
-    }
-    strcpy(decinfo->input_fname, argv[2]);
-
-    // Set output file name or use default
-    if (argv[3] == NULL) {
-        // If the third argument (output file) is not passed, use default "secret_output.txt"
-        strcpy(decinfo->output_fname, "secret_output.txt");
-    } else {
-        // Otherwise, use the provided file name for the output
-        strcpy(decinfo->output_fname, argv[3]);
-    }
-
-    printf("\t\t\t\t\t\t:::::::VALIDATION COMPLETED :::::::\n");
+    if (!decinfo->quiet)
+        printf("\t\t\t\t\t\t:::::::VALIDATION COMPLETED :::::::\n");
     return e_success;
 }
 
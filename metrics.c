@@ -0,0 +1,78 @@
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+#include "lsb.h"
+
+static const char *stage_names[e_stage_count] = {
+    "open", "compress", "capacity", "header", "magic", "extension", "size", "data", "tail"
+};
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_start(Metrics *m, const char *operation)
+{
+    if (!m)
+        return;
+    memset(m->stage, 0, sizeof(m->stage));
+    m->operation = operation;
+    m->backend = "stdio";
+    m->current = e_stage_open;
+    m->stage_start = metrics_now_ns();
+}
+
+void metrics_stage(Metrics *m, Stage s)
+{
+    if (!m)
+        return;
+    uint64_t now = metrics_now_ns();
+    m->stage[m->current].ns += now - m->stage_start;
+    m->current = s;
+    m->stage_start = now;
+}
+
+void metrics_finish(Metrics *m)
+{
+    metrics_stage(m, m ? m->current : e_stage_open);
+}
+
+const char *metrics_stage_name(Stage s)
+{
+    return s < e_stage_count ? stage_names[s] : "unknown";
+}
+
+void metrics_report(const Metrics *m, ReportFormat format, FILE *fp)
+{
+    uint64_t total = 0;
+
+    if (!m)
+        return;
+    for (int s = 0; s < e_stage_count; s++)
+        total += m->stage[s].ns;
+
+    if (format == e_report_csv)
+    {
+        fprintf(fp, "operation,backend,kernel,stage,ns,bytes_read,bytes_written,io_calls\n");
+        for (int s = 0; s < e_stage_count; s++)
+            fprintf(fp, "%s,%s,%s,%s,%llu,%llu,%llu,%llu\n", m->operation, m->backend, lsb_kernel_name(),
+                    stage_names[s], (unsigned long long)m->stage[s].ns,
+                    (unsigned long long)m->stage[s].bytes_read, (unsigned long long)m->stage[s].bytes_written,
+                    (unsigned long long)m->stage[s].io_calls);
+        fprintf(fp, "%s,%s,%s,total,%llu,,,\n", m->operation, m->backend, lsb_kernel_name(),
+                (unsigned long long)total);
+        return;
+    }
+
+    fprintf(fp, "{\"operation\":\"%s\",\"backend\":\"%s\",\"kernel\":\"%s\",\"total_ns\":%llu,\"stages\":[",
+            m->operation, m->backend, lsb_kernel_name(), (unsigned long long)total);
+    for (int s = 0; s < e_stage_count; s++)
+        fprintf(fp, "%s{\"stage\":\"%s\",\"ns\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,\"io_calls\":%llu}",
+                s ? "," : "", stage_names[s], (unsigned long long)m->stage[s].ns,
+                (unsigned long long)m->stage[s].bytes_read, (unsigned long long)m->stage[s].bytes_written,
+                (unsigned long long)m->stage[s].io_calls);
+    fprintf(fp, "]}\n");
+}
@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Per-stage instrumentation for encode/decode jobs.
+ * A job carries a Metrics pointer, NULL means metrics are off and every
+ * hook below returns after a single pointer test.
+ */
+
+typedef enum
+{
+    e_stage_open,
+    e_stage_compress,
+    e_stage_capacity,
+    e_stage_header,
+    e_stage_magic,
+    e_stage_extension,
+    e_stage_size,
+    e_stage_data,
+    e_stage_tail,
+    e_stage_count
+} Stage;
+
+typedef enum
+{
+    e_report_json,
+    e_report_csv
+} ReportFormat;
+
+typedef struct _StageMetrics
+{
+    uint64_t ns;            // Monotonic time spent in the stage
+    uint64_t bytes_read;    // Bytes read from files or mappings
+    uint64_t bytes_written; // Bytes written to files or mappings
+    uint64_t io_calls;      // stdio/syscall I/O requests issued (mapped access counts none)
+} StageMetrics;
+
+typedef struct _Metrics
+{
+    const char *operation;  // "encode" or "decode"
+    const char *backend;    // "mmap", "stdio", "png" or "update", set once files are open
+    Stage current;          // Stage the running time and I/O is charged to
+    uint64_t stage_start;   // Timestamp the current stage was entered
+    StageMetrics stage[e_stage_count];
+} Metrics;
+
+/* Monotonic clock in nanoseconds */
+uint64_t metrics_now_ns(void);
+
+/* Reset the counters and start timing the first stage */
+void metrics_start(Metrics *m, const char *operation);
+
+/* Close the running stage and charge everything from now on to stage s */
+void metrics_stage(Metrics *m, Stage s);
+
+/* Close the running stage at the end of the job */
+void metrics_finish(Metrics *m);
+
+/* Charge I/O to the running stage */
+static inline void metrics_io(Metrics *m, uint64_t bytes_read, uint64_t bytes_written, uint64_t calls)
+{
+    if (!m)
+        return;
+    m->stage[m->current].bytes_read += bytes_read;
+    m->stage[m->current].bytes_written += bytes_written;
+    m->stage[m->current].io_calls += calls;
+}
+
+/* Name of a stage as used in the reports */
+const char *metrics_stage_name(Stage s);
+
+/* Write a machine readable report */
+void metrics_report(const Metrics *m, ReportFormat format, FILE *fp);
+
+#endif
@@ -0,0 +1,1258 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "png.h"
+
+#define PNG_CRC_POLY 0xEDB88320U    // Reversed IEEE polynomial of the chunk CRCs
+#define PNG_IN_SIZE 65536           // IDAT bytes read at a time
+#define PNG_MAX_DIM 0x7FFFFFFFU     // Largest width and height the PNG spec allows
+
+#define WSIZE 32768                 // Deflate window
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_BITS 15                 // Longest Huffman code
+#define FAST_BITS 10                // Codes up to this long decode with one table lookup
+
+#define HASH_BITS 15
+#define MAX_CHAIN 8                 // Match candidates tried per position, about zlib level 2
+#define NICE_MATCH 128              // A match this long ends the search
+#define BLOCK_SYMBOLS 16384         // Literals and matches per deflate block
+
+/* Length and distance codes (RFC 1951 3.2.5) */
+static const uint16_t len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                      3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                       257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                       8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                       7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+/* Order of the code length code lengths in a dynamic block header */
+static const uint8_t clen_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static uint32_t crc_table[256];
+static uint8_t len_code[MAX_MATCH + 1];     // Length to its code - 257
+static uint8_t dist_code[512];              // Distance - 1 to its code, see dist_to_code()
+
+__attribute__((constructor))
+static void png_init(void)
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (PNG_CRC_POLY & -(crc & 1));
+        crc_table[b] = crc;
+    }
+    for (int code = 0; code < 29; code++)
+        for (int len = len_base[code]; len < (code < 28 ? len_base[code + 1] : MAX_MATCH + 1); len++)
+            len_code[len] = code;
+    // Distances up to 256 one by one, longer ones in steps of 128
+    for (int code = 0; code < 30; code++)
+        for (int d = dist_base[code] - 1; d < (code < 29 ? dist_base[code + 1] - 1 : WSIZE); d++)
+            dist_code[d < 256 ? d : 256 + (d >> 7)] = code;
+}
+
+static uint32_t crc_update(uint32_t crc, const unsigned char *p, size_t n)
+{
+    crc = ~crc;
+    while (n--)
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t adler_update(uint32_t adler, const unsigned char *p, size_t n)
+{
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+
+    while (n)
+    {
+        // Largest run whose sums cannot overflow before the reduction
+        size_t k = n < 5552 ? n : 5552;
+        n -= k;
+        while (k--)
+        {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned reverse_bits(unsigned code, int len)
+{
+    unsigned r = 0;
+    while (len--)
+    {
+        r = r << 1 | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+static int dist_to_code(unsigned d)
+{
+    return dist_code[d <= 256 ? d - 1 : 256 + ((d - 1) >> 7)];
+}
+
+/* Paeth predictor, the distances of a + b - c to a, b and c written out so the choice compiles to conditional moves */
+static inline int paeth(int a, int b, int c)
+{
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+    int ab = pa <= pb ? a : b;
+    return (pa <= pb ? pa : pb) <= pc ? ab : c;
+}
+
+int png_sniff(FILE *fp)
+{
+    int c = fgetc(fp);
+    if (c == EOF)
+        return 0;
+    ungetc(c, fp);
+    return c == (unsigned char)PNG_SIGNATURE[0];
+}
+
+/* ---------------------------------------------------------------- reader */
+
+typedef struct
+{
+    uint16_t fast[1 << FAST_BITS];  // Symbol << 4 | length of the codes up to FAST_BITS, 0 for longer ones
+    uint16_t count[MAX_BITS + 1];   // Codes per length
+    uint16_t symbol[288];           // Symbols in canonical order
+} Huffman;
+
+enum { BLOCK_HEADER, BLOCK_STORED, BLOCK_HUFFMAN };
+
+struct _PngReader
+{
+    FILE *fp;
+    FILE *echo;
+    Arena *arena;
+    uint32_t width;
+    uint32_t height;
+    int channels;           // Bytes per pixel, the distance the filters look back
+    size_t rowbytes;        // Carrier bytes per row
+    unsigned char *raw;     // Row as inflated, filter type first
+    unsigned char *cur;     // Unfiltered current row
+    unsigned char *prev;    // Unfiltered previous row, zeros above the first one
+    size_t row_pos;         // Bytes of cur handed out
+    uint32_t rows;          // Rows inflated
+    uint64_t bytes_read;
+
+    /* IDAT chunks */
+    uint32_t chunk_left;    // Data bytes of the current IDAT chunk not read yet
+    uint32_t crc;           // CRC of the current chunk so far
+    int idat_done;          // The chunk after the last IDAT was reached, its header is in next
+    unsigned char next[8];
+    size_t in_pos;
+    size_t in_len;
+    size_t overrun;         // Zero bytes made up past the end of the IDAT data
+    int broken;             // An IDAT chunk failed its CRC or was cut short
+
+    /* Inflate state, resumable at any output byte */
+    uint64_t bitbuf;
+    int bitcnt;
+    int block;
+    int final;
+    uint32_t stored_left;
+    uint32_t copy_len;      // Bytes of a match not copied yet
+    uint32_t copy_dist;
+    size_t wpos;            // Bytes inflated, the window holds the last WSIZE of them
+    uint32_t adler;
+    Huffman lit;
+    Huffman dist;
+    unsigned char window[WSIZE];
+    unsigned char in[PNG_IN_SIZE];
+};
+
+static Status read_exact(PngReader *r, void *buf, size_t n)
+{
+    if (fread(buf, 1, n, r->fp) != n)
+        return e_failure;
+    r->bytes_read += n;
+    return e_success;
+}
+
+static Status echo(PngReader *r, const void *buf, size_t n)
+{
+    if (r->echo && fwrite(buf, 1, n, r->echo) != n)
+        return e_failure;
+    return e_success;
+}
+
+/* Check the CRC of the chunk just read, echoing it when the chunk was */
+static Status end_chunk(PngReader *r, int echoed)
+{
+    unsigned char crc[4];
+
+    if (read_exact(r, crc, 4) != e_success || get_be32(crc) != r->crc)
+        return e_failure;
+    return echoed ? echo(r, crc, 4) : e_success;
+}
+
+/* Copy the data and CRC of a chunk whose header was read and echoed */
+static Status echo_chunk(PngReader *r, uint32_t len)
+{
+    while (len)
+    {
+        size_t n = len < PNG_IN_SIZE ? len : PNG_IN_SIZE;
+        if (read_exact(r, r->in, n) != e_success || echo(r, r->in, n) != e_success)
+            return e_failure;
+        r->crc = crc_update(r->crc, r->in, n);
+        len -= n;
+    }
+    return end_chunk(r, 1);
+}
+
+/* Refill the input buffer from the IDAT chunks, 0 once they end */
+static size_t refill(PngReader *r)
+{
+    while (r->chunk_left == 0)
+    {
+        if (r->idat_done)
+            return 0;
+        if (end_chunk(r, 0) != e_success || read_exact(r, r->next, 8) != e_success)
+        {
+            r->idat_done = r->broken = 1;
+            return 0;
+        }
+        if (memcmp(r->next + 4, "IDAT", 4) != 0)
+        {
+            r->idat_done = 1;
+            return 0;
+        }
+        r->chunk_left = get_be32(r->next);
+        r->crc = crc_update(0, r->next + 4, 4);
+    }
+
+    size_t n = r->chunk_left < PNG_IN_SIZE ? r->chunk_left : PNG_IN_SIZE;
+    if (read_exact(r, r->in, n) != e_success)
+    {
+        r->chunk_left = 0;
+        r->idat_done = r->broken = 1;
+        return 0;
+    }
+    r->crc = crc_update(r->crc, r->in, n);
+    r->chunk_left -= n;
+    r->in_pos = 0;
+    r->in_len = n;
+    return n;
+}
+
+/* At least n bits in bitbuf, zeros past the end of the data are caught by stream_error() */
+static void need_bits(PngReader *r, int n)
+{
+    while (r->bitcnt < n)
+    {
+        unsigned c = 0;
+        if (r->in_pos < r->in_len || refill(r))
+            c = r->in[r->in_pos++];
+        else
+            r->overrun++;
+        r->bitbuf |= (uint64_t)c << r->bitcnt;
+        r->bitcnt += 8;
+    }
+}
+
+static unsigned get_bits(PngReader *r, int n)
+{
+    unsigned v;
+
+    if (n == 0)
+        return 0;
+    need_bits(r, n);
+    v = r->bitbuf & ((1U << n) - 1);
+    r->bitbuf >>= n;
+    r->bitcnt -= n;
+    return v;
+}
+
+/* Whether the IDAT data is damaged or the bits used so far ran past its end */
+static int stream_error(const PngReader *r)
+{
+    return r->broken || r->overrun * 8 > (size_t)r->bitcnt;
+}
+
+/* Canonical code from the code lengths, fails when they are over-subscribed */
+static Status build_huffman(Huffman *h, const uint8_t *lens, int n)
+{
+    uint16_t offs[MAX_BITS + 2];
+    unsigned next_code[MAX_BITS + 1];
+    int left = 1;
+
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int s = 0; s < n; s++)
+        h->count[lens[s]]++;
+    h->count[0] = 0;
+    for (int len = 1; len <= MAX_BITS; len++)
+    {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return e_failure;
+    }
+
+    offs[1] = 0;
+    next_code[1] = 0;
+    for (int len = 1; len <= MAX_BITS; len++)
+    {
+        offs[len + 1] = offs[len] + h->count[len];
+        if (len < MAX_BITS)
+            next_code[len + 1] = (next_code[len] + h->count[len]) << 1;
+    }
+    for (int s = 0; s < n; s++)
+    {
+        int len = lens[s];
+        if (len == 0)
+            continue;
+        h->symbol[offs[len]++] = s;
+        unsigned code = next_code[len]++;
+        if (len <= FAST_BITS)
+            for (unsigned i = reverse_bits(code, len); i < (1U << FAST_BITS); i += 1U << len)
+                h->fast[i] = s << 4 | len;
+    }
+    return e_success;
+}
+
+/* Next symbol of h, -1 for a code h does not have */
+static int decode_symbol(PngReader *r, const Huffman *h)
+{
+    int code = 0, first = 0, index = 0;
+
+    need_bits(r, MAX_BITS);
+    unsigned e = h->fast[r->bitbuf & ((1U << FAST_BITS) - 1)];
+    if (e)
+    {
+        r->bitbuf >>= e & 15;
+        r->bitcnt -= e & 15;
+        return e >> 4;
+    }
+
+    // Bit by bit through the canonical code
+    for (int len = 1; len <= MAX_BITS; len++)
+    {
+        code |= (r->bitbuf >> (len - 1)) & 1;
+        int count = h->count[len];
+        if (code - count < first)
+        {
+            r->bitbuf >>= len;
+            r->bitcnt -= len;
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static Status read_dynamic_tables(PngReader *r)
+{
+    uint8_t lens[286 + 30];
+    uint8_t clens[19] = {0};
+    int hlit = get_bits(r, 5) + 257;
+    int hdist = get_bits(r, 5) + 1;
+    int hclen = get_bits(r, 4) + 4;
+
+    if (hlit > 286 || hdist > 30)
+        return e_failure;
+    for (int i = 0; i < hclen; i++)
+        clens[clen_order[i]] = get_bits(r, 3);
+    // The code length code lives in lit until the real tables replace it
+    if (build_huffman(&r->lit, clens, 19) != e_success)
+        return e_failure;
+
+    for (int i = 0; i < hlit + hdist;)
+    {
+        int sym = decode_symbol(r, &r->lit);
+        int repeat, value = 0;
+
+        if (sym < 0)
+            return e_failure;
+        if (sym < 16)
+        {
+            lens[i++] = sym;
+            continue;
+        }
+        if (sym == 16)
+        {
+            if (i == 0)
+                return e_failure;
+            value = lens[i - 1];
+            repeat = 3 + get_bits(r, 2);
+        }
+        else if (sym == 17)
+            repeat = 3 + get_bits(r, 3);
+        else
+            repeat = 11 + get_bits(r, 7);
+        if (i + repeat > hlit + hdist)
+            return e_failure;
+        while (repeat--)
+            lens[i++] = value;
+    }
+    if (lens[256] == 0)
+        return e_failure;
+    if (build_huffman(&r->lit, lens, hlit) != e_success || build_huffman(&r->dist, lens + hlit, hdist) != e_success)
+        return e_failure;
+    return e_success;
+}
+
+static Status read_block_header(PngReader *r)
+{
+    r->final = get_bits(r, 1);
+    switch (get_bits(r, 2))
+    {
+        case 0:
+        {
+            // Stored, byte aligned
+            get_bits(r, r->bitcnt & 7);
+            unsigned len = get_bits(r, 16);
+            unsigned nlen = get_bits(r, 16);
+            if (len != (~nlen & 0xFFFF))
+                return e_failure;
+            r->stored_left = len;
+            r->block = BLOCK_STORED;
+            return e_success;
+        }
+        case 1:
+        {
+            uint8_t lens[288 + 30];
+            memset(lens, 8, 144);
+            memset(lens + 144, 9, 112);
+            memset(lens + 256, 7, 24);
+            memset(lens + 280, 8, 8);
+            memset(lens + 288, 5, 30);
+            build_huffman(&r->lit, lens, 288);
+            build_huffman(&r->dist, lens + 288, 30);
+            r->block = BLOCK_HUFFMAN;
+            return e_success;
+        }
+        case 2:
+            r->block = BLOCK_HUFFMAN;
+            return read_dynamic_tables(r);
+        default:
+            return e_failure;
+    }
+}
+
+static inline void put_byte(PngReader *r, unsigned char *out, size_t *done, unsigned char b)
+{
+    r->window[r->wpos++ & (WSIZE - 1)] = b;
+    out[(*done)++] = b;
+}
+
+/* Inflate exactly n bytes, stopping anywhere inside a block or a match */
+static Status inflate_bytes(PngReader *r, unsigned char *out, size_t n)
+{
+    size_t done = 0;
+
+    while (done < n)
+    {
+        if (r->copy_len)
+        {
+            uint32_t k = r->copy_len;
+            if (k > n - done)
+                k = n - done;
+            r->copy_len -= k;
+            while (k--)
+                put_byte(r, out, &done, r->window[(r->wpos - r->copy_dist) & (WSIZE - 1)]);
+            continue;
+        }
+
+        if (r->block == BLOCK_HEADER)
+        {
+            // The last block ended before the image did
+            if (r->final || read_block_header(r) != e_success || stream_error(r))
+                return e_failure;
+            continue;
+        }
+
+        if (r->block == BLOCK_STORED)
+        {
+            if (r->stored_left == 0)
+            {
+                r->block = BLOCK_HEADER;
+                continue;
+            }
+            r->stored_left--;
+            put_byte(r, out, &done, get_bits(r, 8));
+            continue;
+        }
+
+        int sym = decode_symbol(r, &r->lit);
+        if (sym < 0)
+            return e_failure;
+        if (sym < 256)
+        {
+            put_byte(r, out, &done, sym);
+            continue;
+        }
+        if (sym == 256)
+        {
+            r->block = BLOCK_HEADER;
+            continue;
+        }
+        sym -= 257;
+        if (sym >= 29)
+            return e_failure;
+        r->copy_len = len_base[sym] + get_bits(r, len_extra[sym]);
+        int dsym = decode_symbol(r, &r->dist);
+        if (dsym < 0 || dsym >= 30)
+            return e_failure;
+        r->copy_dist = dist_base[dsym] + get_bits(r, dist_extra[dsym]);
+        if (r->copy_dist > r->wpos)
+            return e_failure;
+    }
+    return stream_error(r) ? e_failure : e_success;
+}
+
+static Status unfilter_row(PngReader *r)
+{
+    const unsigned char *raw = r->raw + 1, *prev = r->prev;
+    unsigned char *cur = r->cur;
+    size_t n = r->rowbytes, bpp = r->channels;
+
+    switch (r->raw[0])
+    {
+        case 0:
+            memcpy(cur, raw, n);
+            break;
+        case 1:
+            memcpy(cur, raw, bpp);
+            for (size_t i = bpp; i < n; i++)
+                cur[i] = raw[i] + cur[i - bpp];
+            break;
+        case 2:
+            for (size_t i = 0; i < n; i++)
+                cur[i] = raw[i] + prev[i];
+            break;
+        case 3:
+            for (size_t i = 0; i < bpp; i++)
+                cur[i] = raw[i] + (prev[i] >> 1);
+            for (size_t i = bpp; i < n; i++)
+                cur[i] = raw[i] + ((cur[i - bpp] + prev[i]) >> 1);
+            break;
+        case 4:
+            for (size_t i = 0; i < bpp; i++)
+                cur[i] = raw[i] + prev[i];
+            for (size_t i = bpp; i < n; i++)
+                cur[i] = raw[i] + paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+            break;
+        default:
+            return e_failure;
+    }
+    return e_success;
+}
+
+static Status next_row(PngReader *r)
+{
+    unsigned char *t;
+
+    if (r->rows == r->height || inflate_bytes(r, r->raw, r->rowbytes + 1) != e_success)
+        return e_failure;
+    r->adler = adler_update(r->adler, r->raw, r->rowbytes + 1);
+
+    t = r->prev;
+    r->prev = r->cur;
+    r->cur = t;
+    if (unfilter_row(r) != e_success)
+        return e_failure;
+    r->rows++;
+    r->row_pos = 0;
+    return e_success;
+}
+
+Status png_read(PngReader *r, unsigned char *buf, size_t n)
+{
+    while (n)
+    {
+        if (r->row_pos == r->rowbytes && next_row(r) != e_success)
+            return e_failure;
+        size_t k = r->rowbytes - r->row_pos;
+        if (k > n)
+            k = n;
+        memcpy(buf, r->cur + r->row_pos, k);
+        r->row_pos += k;
+        buf += k;
+        n -= k;
+    }
+    return e_success;
+}
+
+static Status parse_ihdr(PngReader *r, const unsigned char *d)
+{
+    static const int channels[7] = {1, 0, 3, 0, 2, 0, 4};
+
+    r->width = get_be32(d);
+    r->height = get_be32(d + 4);
+    // Bit depth 8 of a gray or truecolor type, compression, filter method 0 and no interlacing
+    if (r->width == 0 || r->height == 0 || r->width > PNG_MAX_DIM || r->height > PNG_MAX_DIM ||
+        d[8] != 8 || d[9] > 6 || channels[d[9]] == 0 || d[10] || d[11] || d[12])
+        return e_failure;
+    r->channels = channels[d[9]];
+    r->rowbytes = (size_t)r->width * r->channels;
+    return e_success;
+}
+
+PngReader *png_reader_open(FILE *fp, FILE *echo_fp, Arena *arena, BmpPlan *plan)
+{
+    PngReader *r = arena_alloc(arena, sizeof(PngReader));
+    unsigned char hdr[8], ihdr[13];
+    int have_ihdr = 0;
+
+    if (r == NULL)
+        return NULL;
+    memset(r, 0, offsetof(PngReader, window));
+    r->fp = fp;
+    r->echo = echo_fp;
+    r->arena = arena;
+    r->adler = 1;
+
+    if (read_exact(r, hdr, 8) != e_success || memcmp(hdr, PNG_SIGNATURE, 8) != 0 || echo(r, hdr, 8) != e_success)
+        goto fail;
+
+    // Every chunk up to the first IDAT, IHDR first
+    for (;;)
+    {
+        if (read_exact(r, hdr, 8) != e_success)
+            goto fail;
+        uint32_t len = get_be32(hdr);
+        if (len > PNG_MAX_DIM || (memcmp(hdr + 4, "IHDR", 4) == 0) == have_ihdr)
+            goto fail;
+        r->crc = crc_update(0, hdr + 4, 4);
+
+        if (memcmp(hdr + 4, "IDAT", 4) == 0)
+        {
+            r->chunk_left = len;
+            break;
+        }
+        if (memcmp(hdr + 4, "IEND", 4) == 0 || echo(r, hdr, 8) != e_success)
+            goto fail;
+        if (!have_ihdr)
+        {
+            if (len != 13 || read_exact(r, ihdr, 13) != e_success || parse_ihdr(r, ihdr) != e_success ||
+                echo(r, ihdr, 13) != e_success)
+                goto fail;
+            r->crc = crc_update(r->crc, ihdr, 13);
+            if (end_chunk(r, 1) != e_success)
+                goto fail;
+            have_ihdr = 1;
+        }
+        else if (echo_chunk(r, len) != e_success)
+            goto fail;
+    }
+
+    // Three rows: the inflated one and the unfiltered current and previous ones
+    r->raw = arena_alloc(arena, 3 * (r->rowbytes + 1));
+    if (r->raw == NULL)
+        goto fail;
+    r->cur = r->raw + r->rowbytes + 1;
+    r->prev = r->cur + r->rowbytes + 1;
+    memset(r->cur, 0, 2 * (r->rowbytes + 1));
+    r->row_pos = r->rowbytes;
+
+    // zlib header: deflate, a window of at most 32K and no preset dictionary
+    unsigned cmf = get_bits(r, 8), flg = get_bits(r, 8);
+    if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || (flg & 0x20) || (cmf << 8 | flg) % 31 || stream_error(r))
+        goto fail;
+
+    bmp_plan_flat(plan, r->rowbytes * r->height);
+    return r;
+
+fail:
+    png_reader_close(r);
+    return NULL;
+}
+
+Status png_reader_finish(PngReader *r)
+{
+    unsigned char adler[4];
+
+    if (r->rows != r->height || r->row_pos != r->rowbytes)
+        return e_failure;
+
+    // Nothing but block ends, and empty blocks as flushing encoders write them, may follow the last row
+    while (!(r->final && r->block == BLOCK_HEADER))
+    {
+        if (r->copy_len)
+            return e_failure;
+        if (r->block == BLOCK_HEADER)
+        {
+            if (read_block_header(r) != e_success)
+                return e_failure;
+            continue;
+        }
+        if (r->block == BLOCK_STORED ? r->stored_left != 0 : decode_symbol(r, &r->lit) != 256)
+            return e_failure;
+        r->block = BLOCK_HEADER;
+    }
+    get_bits(r, r->bitcnt & 7);
+    for (int i = 0; i < 4; i++)
+        adler[i] = get_bits(r, 8);
+    if (stream_error(r) || get_be32(adler) != r->adler)
+        return e_failure;
+
+    // Skip whatever IDAT data is left, then echo the chunks after it through IEND
+    while (refill(r))
+        ;
+    for (;;)
+    {
+        if (r->broken || memcmp(r->next + 4, "IDAT", 4) == 0 || echo(r, r->next, 8) != e_success)
+            return e_failure;
+        r->crc = crc_update(0, r->next + 4, 4);
+        if (echo_chunk(r, get_be32(r->next)) != e_success)
+            return e_failure;
+        if (memcmp(r->next + 4, "IEND", 4) == 0)
+            return e_success;
+        if (read_exact(r, r->next, 8) != e_success)
+            return e_failure;
+    }
+}
+
+uint64_t png_bytes_read(const PngReader *r)
+{
+    return r->bytes_read;
+}
+
+void png_reader_close(PngReader *r)
+{
+    if (r == NULL)
+        return;
+    arena_release(r->arena, r->raw);
+    arena_release(r->arena, r);
+}
+
+/* ---------------------------------------------------------------- writer */
+
+struct _PngWriter
+{
+    FILE *fp;
+    Arena *arena;
+    uint32_t height;
+    int channels;
+    size_t rowbytes;
+    unsigned char *rowbuf;  // The rows below in one allocation
+    unsigned char *cur;     // Row being filled
+    unsigned char *prev;    // Previous row, zeros above the first one
+    unsigned char *cand;    // The row under each of the five filters, filter type first
+    size_t row_pos;
+    uint32_t rows;
+    uint32_t adler;
+
+    /* Greedy LZ77 over a window of two WSIZE halves, the older half is dropped when the newer one fills up */
+    size_t strstart;        // Next window position to encode
+    size_t end;             // Window bytes filled
+    int32_t head[1 << HASH_BITS];   // Latest window position of each hash, -1 for none
+    int32_t chain[WSIZE];   // Position before the one at the same index with the same hash
+
+    /* Symbols of the current block */
+    size_t nsym;
+    uint32_t lit_freq[286];
+    uint32_t dist_freq[30];
+    uint16_t sym_len[BLOCK_SYMBOLS];    // Literal byte, or 256 + match length
+    uint16_t sym_dist[BLOCK_SYMBOLS];   // Match distance, 0 for literals
+
+    /* Bit output and the IDAT chunk being filled */
+    uint64_t bitbuf;
+    int bitcnt;
+    int error;              // Writing an IDAT chunk failed
+    size_t out_len;
+    unsigned char out[8 + PNG_IDAT_SIZE + 4];
+    unsigned char win[2 * WSIZE];
+};
+
+static Status write_idat(PngWriter *w)
+{
+    unsigned char *chunk = w->out;
+    size_t len = w->out_len;
+
+    if (len == 0)
+        return e_success;
+    put_be32(chunk, len);
+    memcpy(chunk + 4, "IDAT", 4);
+    put_be32(chunk + 8 + len, crc_update(0, chunk + 4, 4 + len));
+    w->out_len = 0;
+    return fwrite(chunk, 1, 12 + len, w->fp) == 12 + len ? e_success : e_failure;
+}
+
+static void put_bits(PngWriter *w, unsigned value, int n)
+{
+    w->bitbuf |= (uint64_t)value << w->bitcnt;
+    w->bitcnt += n;
+    while (w->bitcnt >= 8)
+    {
+        w->out[8 + w->out_len++] = w->bitbuf;
+        w->bitbuf >>= 8;
+        w->bitcnt -= 8;
+        if (w->out_len == PNG_IDAT_SIZE && write_idat(w) != e_success)
+            w->error = 1;
+    }
+}
+
+/*
+ * Code lengths of at most limit bits for the symbols of freq, by Huffman's
+ * algorithm over two queues. Too long codes are rare enough that scaling
+ * the frequencies down and building again is all the limiting needed.
+ */
+static void build_lengths(const uint32_t *freq, int n, int limit, uint8_t *lens)
+{
+    uint32_t f[286], w[2 * 286];
+    uint16_t order[286], depth[2 * 286];
+    int16_t parent[2 * 286];
+    int count = 0;
+
+    memcpy(f, freq, n * sizeof(*f));
+    memset(lens, 0, n);
+    for (int s = 0; s < n; s++)
+        if (f[s])
+            order[count++] = s;
+    if (count == 1)
+    {
+        lens[order[0]] = 1;
+        return;
+    }
+
+    for (;;)
+    {
+        // Leaves by frequency
+        for (int i = 1; i < count; i++)
+        {
+            uint16_t s = order[i];
+            int j = i;
+            for (; j > 0 && f[order[j - 1]] > f[s]; j--)
+                order[j] = order[j - 1];
+            order[j] = s;
+        }
+        for (int i = 0; i < count; i++)
+            w[i] = f[order[i]];
+
+        // Internal nodes are made in order of weight, so the two smallest are at the heads of the queues
+        int leaf = 0, node = count, next = count;
+        while (next < 2 * count - 1)
+        {
+            int a = (leaf < count && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+            int b = (leaf < count && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+            w[next] = w[a] + w[b];
+            parent[a] = parent[b] = next++;
+        }
+
+        int max = 0;
+        depth[2 * count - 2] = 0;
+        for (int i = 2 * count - 3; i >= 0; i--)
+            depth[i] = depth[parent[i]] + 1;
+        for (int i = 0; i < count; i++)
+        {
+            lens[order[i]] = depth[i];
+            if (depth[i] > max)
+                max = depth[i];
+        }
+        if (max <= limit)
+            return;
+        for (int i = 0; i < count; i++)
+            f[order[i]] = (f[order[i]] + 1) >> 1;
+    }
+}
+
+static void build_codes(const uint8_t *lens, int n, uint16_t *codes)
+{
+    unsigned count[MAX_BITS + 1] = {0}, next_code[MAX_BITS + 1];
+
+    for (int s = 0; s < n; s++)
+        count[lens[s]]++;
+    count[0] = 0;
+    next_code[1] = 0;
+    for (int len = 1; len < MAX_BITS; len++)
+        next_code[len + 1] = (next_code[len] + count[len]) << 1;
+    for (int s = 0; s < n; s++)
+        if (lens[s])
+            codes[s] = reverse_bits(next_code[lens[s]]++, lens[s]);
+}
+
+/* Emit the pending symbols as one dynamic Huffman block */
+static Status flush_block(PngWriter *w, int final)
+{
+    uint8_t lens[286 + 30], lit_lens[286], dist_lens[30], clen_lens[19];
+    uint16_t lit_codes[286], dist_codes[30], clen_codes[19];
+    uint8_t rle[286 + 30], rle_extra[286 + 30];
+    uint32_t clen_freq[19] = {0};
+    int hlit = 286, hdist = 30, hclen = 19, nrle = 0;
+
+    // End of block, and at least two codes in each table so none is incomplete
+    w->lit_freq[256]++;
+    if (w->lit_freq[0] == 0)
+        w->lit_freq[0] = 1;
+    if (w->dist_freq[0] == 0)
+        w->dist_freq[0] = 1;
+    if (w->dist_freq[1] == 0)
+        w->dist_freq[1] = 1;
+    build_lengths(w->lit_freq, 286, MAX_BITS, lit_lens);
+    build_lengths(w->dist_freq, 30, MAX_BITS, dist_lens);
+    build_codes(lit_lens, 286, lit_codes);
+    build_codes(dist_lens, 30, dist_codes);
+    while (lit_lens[hlit - 1] == 0)
+        hlit--;
+    while (dist_lens[hdist - 1] == 0)
+        hdist--;
+
+    // Both length tables as one sequence, runs as code length symbols 16 to 18
+    memcpy(lens, lit_lens, hlit);
+    memcpy(lens + hlit, dist_lens, hdist);
+    for (int i = 0; i < hlit + hdist;)
+    {
+        int run = 1;
+        while (i + run < hlit + hdist && lens[i + run] == lens[i])
+            run++;
+        if (lens[i] == 0 && run >= 11)
+        {
+            run = run > 138 ? 138 : run;
+            rle[nrle] = 18;
+            rle_extra[nrle++] = run - 11;
+        }
+        else if (lens[i] == 0 && run >= 3)
+        {
+            rle[nrle] = 17;
+            rle_extra[nrle++] = run - 3;
+        }
+        else if (lens[i] != 0 && run >= 4)
+        {
+            // The length itself, then repeats of it
+            run = run > 7 ? 7 : run;
+            rle[nrle++] = lens[i];
+            rle[nrle] = 16;
+            rle_extra[nrle++] = run - 4;
+        }
+        else
+        {
+            run = 1;
+            rle[nrle++] = lens[i];
+        }
+        i += run;
+    }
+    for (int i = 0; i < nrle; i++)
+        clen_freq[rle[i]]++;
+    build_lengths(clen_freq, 19, 7, clen_lens);
+    build_codes(clen_lens, 19, clen_codes);
+    while (hclen > 4 && clen_lens[clen_order[hclen - 1]] == 0)
+        hclen--;
+
+    put_bits(w, final, 1);
+    put_bits(w, 2, 2);
+    put_bits(w, hlit - 257, 5);
+    put_bits(w, hdist - 1, 5);
+    put_bits(w, hclen - 4, 4);
+    for (int i = 0; i < hclen; i++)
+        put_bits(w, clen_lens[clen_order[i]], 3);
+    for (int i = 0; i < nrle; i++)
+    {
+        put_bits(w, clen_codes[rle[i]], clen_lens[rle[i]]);
+        if (rle[i] >= 16)
+            put_bits(w, rle_extra[i], rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : 7);
+    }
+
+    for (size_t i = 0; i < w->nsym; i++)
+    {
+        unsigned len = w->sym_len[i], dist = w->sym_dist[i];
+        if (dist == 0)
+        {
+            put_bits(w, lit_codes[len], lit_lens[len]);
+            continue;
+        }
+        len -= 256;
+        int lc = len_code[len], dc = dist_to_code(dist);
+        put_bits(w, lit_codes[257 + lc], lit_lens[257 + lc]);
+        put_bits(w, len - len_base[lc], len_extra[lc]);
+        put_bits(w, dist_codes[dc], dist_lens[dc]);
+        put_bits(w, dist - dist_base[dc], dist_extra[dc]);
+    }
+    put_bits(w, lit_codes[256], lit_lens[256]);
+
+    w->nsym = 0;
+    memset(w->lit_freq, 0, sizeof(w->lit_freq));
+    memset(w->dist_freq, 0, sizeof(w->dist_freq));
+    return w->error ? e_failure : e_success;
+}
+
+static Status emit_symbol(PngWriter *w, unsigned len, unsigned dist)
+{
+    if (dist == 0)
+        w->lit_freq[len]++;
+    else
+    {
+        w->lit_freq[257 + len_code[len]]++;
+        w->dist_freq[dist_to_code(dist)]++;
+        len += 256;
+    }
+    w->sym_len[w->nsym] = len;
+    w->sym_dist[w->nsym++] = dist;
+    return w->nsym == BLOCK_SYMBOLS ? flush_block(w, 0) : e_success;
+}
+
+static inline unsigned hash3(const unsigned char *p)
+{
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void insert_hash(PngWriter *w, size_t pos)
+{
+    if (pos + MIN_MATCH > w->end)
+        return;
+    unsigned h = hash3(w->win + pos);
+    w->chain[pos & (WSIZE - 1)] = w->head[h];
+    w->head[h] = pos;
+}
+
+/* Bytes p and q have in common, up to max, compared a word at a time */
+static unsigned match_len(const unsigned char *p, const unsigned char *q, unsigned max)
+{
+    unsigned len = 0;
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len + 8 <= max; len += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, p + len, 8);
+        memcpy(&b, q + len, 8);
+        if (a != b)
+            return len + (__builtin_ctzll(a ^ b) >> 3);
+    }
+#endif
+    while (len < max && p[len] == q[len])
+        len++;
+    return len;
+}
+
+/* Encode the window up to MAX_MATCH bytes from its end, or all of it at the end of the stream */
+static Status deflate_window(PngWriter *w, int flush)
+{
+    while (w->end - w->strstart >= (flush ? 1 : MAX_MATCH))
+    {
+        size_t s = w->strstart, avail = w->end - s;
+        unsigned best = 0, best_dist = 0;
+
+        if (avail >= MIN_MATCH)
+        {
+            unsigned max = avail < MAX_MATCH ? avail : MAX_MATCH;
+            int32_t cand = w->head[hash3(w->win + s)];
+            const unsigned char *p = w->win + s;
+
+            for (int tries = MAX_CHAIN; cand >= 0 && s - cand <= WSIZE && tries; tries--)
+            {
+                const unsigned char *q = w->win + cand;
+                if (q[best] == p[best] && q[0] == p[0])
+                {
+                    unsigned len = match_len(p, q, max);
+                    if (len > best)
+                    {
+                        best = len;
+                        best_dist = s - cand;
+                        if (len >= max || len >= NICE_MATCH)
+                            break;
+                    }
+                }
+                int32_t next = w->chain[cand & (WSIZE - 1)];
+                // The slot may already hold a newer position
+                if (next >= cand)
+                    break;
+                cand = next;
+            }
+        }
+
+        insert_hash(w, s);
+        if (best >= MIN_MATCH)
+        {
+            if (emit_symbol(w, best, best_dist) != e_success)
+                return e_failure;
+            for (size_t i = 1; i < best; i++)
+                insert_hash(w, s + i);
+            w->strstart = s + best;
+        }
+        else
+        {
+            if (emit_symbol(w, w->win[s], 0) != e_success)
+                return e_failure;
+            w->strstart = s + 1;
+        }
+    }
+    return e_success;
+}
+
+static Status deflate_feed(PngWriter *w, const unsigned char *p, size_t n)
+{
+    while (n)
+    {
+        if (w->end == sizeof(w->win))
+        {
+            // Drop the older half, positions move down by WSIZE
+            memcpy(w->win, w->win + WSIZE, WSIZE);
+            w->strstart -= WSIZE;
+            w->end -= WSIZE;
+            for (size_t i = 0; i < (1 << HASH_BITS); i++)
+                w->head[i] = w->head[i] >= WSIZE ? w->head[i] - WSIZE : -1;
+            for (size_t i = 0; i < WSIZE; i++)
+                w->chain[i] = w->chain[i] >= WSIZE ? w->chain[i] - WSIZE : -1;
+        }
+        size_t k = sizeof(w->win) - w->end;
+        if (k > n)
+            k = n;
+        memcpy(w->win + w->end, p, k);
+        w->end += k;
+        p += k;
+        n -= k;
+        if (deflate_window(w, 0) != e_success)
+            return e_failure;
+    }
+    return e_success;
+}
+
+/* Filter the full row with the type whose output has the smallest sum of absolute values, then deflate it */
+static Status filter_row(PngWriter *w)
+{
+    const unsigned char *cur = w->cur, *prev = w->prev;
+    size_t n = w->rowbytes, bpp = w->channels, stride = n + 1;
+    uint64_t sums[5] = {0};
+    int best = 0;
+
+    for (int t = 0; t < 5; t++)
+    {
+        unsigned char *out = w->cand + t * stride;
+        out[0] = t;
+        out++;
+        switch (t)
+        {
+            case 0:
+                memcpy(out, cur, n);
+                break;
+            case 1:
+                memcpy(out, cur, bpp);
+                for (size_t i = bpp; i < n; i++)
+                    out[i] = cur[i] - cur[i - bpp];
+                break;
+            case 2:
+                for (size_t i = 0; i < n; i++)
+                    out[i] = cur[i] - prev[i];
+                break;
+            case 3:
+                for (size_t i = 0; i < bpp; i++)
+                    out[i] = cur[i] - (prev[i] >> 1);
+                for (size_t i = bpp; i < n; i++)
+                    out[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+                break;
+            case 4:
+                for (size_t i = 0; i < bpp; i++)
+                    out[i] = cur[i] - prev[i];
+                for (size_t i = bpp; i < n; i++)
+                    out[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+                break;
+        }
+        for (size_t i = 0; i < n; i++)
+            sums[t] += abs((signed char)out[i]);
+        if (sums[t] < sums[best])
+            best = t;
+    }
+
+    const unsigned char *row = w->cand + best * stride;
+    w->adler = adler_update(w->adler, row, stride);
+    return deflate_feed(w, row, stride);
+}
+
+PngWriter *png_writer_open(FILE *fp, const PngReader *r, Arena *arena)
+{
+    PngWriter *w = arena_alloc(arena, sizeof(PngWriter));
+
+    if (w == NULL)
+        return NULL;
+    memset(w, 0, offsetof(PngWriter, out));
+    w->fp = fp;
+    w->arena = arena;
+    w->height = r->height;
+    w->channels = r->channels;
+    w->rowbytes = r->rowbytes;
+    w->adler = 1;
+    memset(w->head, 0xFF, sizeof(w->head));
+    memset(w->chain, 0xFF, sizeof(w->chain));
+
+    // Current and previous rows, then the five filtered candidates
+    w->rowbuf = arena_alloc(arena, 7 * (w->rowbytes + 1));
+    if (w->rowbuf == NULL)
+    {
+        png_writer_close(w);
+        return NULL;
+    }
+    w->cur = w->rowbuf;
+    w->prev = w->cur + w->rowbytes + 1;
+    w->cand = w->prev + w->rowbytes + 1;
+    memset(w->prev, 0, w->rowbytes + 1);
+
+    // zlib header: deflate with a 32K window, no preset dictionary
+    w->out[8] = 0x78;
+    w->out[9] = 0x9C;
+    w->out_len = 2;
+    return w;
+}
+
+Status png_write(PngWriter *w, const unsigned char *buf, size_t n)
+{
+    while (n)
+    {
+        size_t k = w->rowbytes - w->row_pos;
+        if (k > n)
+            k = n;
+        if (w->rows == w->height)
+            return e_failure;
+        memcpy(w->cur + w->row_pos, buf, k);
+        w->row_pos += k;
+        buf += k;
+        n -= k;
+
+        if (w->row_pos == w->rowbytes)
+        {
+            if (filter_row(w) != e_success)
+                return e_failure;
+            unsigned char *t = w->prev;
+            w->prev = w->cur;
+            w->cur = t;
+            w->row_pos = 0;
+            w->rows++;
+        }
+    }
+    return e_success;
+}
+
+Status png_writer_finish(PngWriter *w)
+{
+    unsigned char adler[4];
+
+    if (w->rows != w->height || deflate_window(w, 1) != e_success || flush_block(w, 1) != e_success)
+        return e_failure;
+    // Byte align, then the Adler-32 of the filtered rows
+    if (w->bitcnt)
+        put_bits(w, 0, 8 - w->bitcnt);
+    put_be32(adler, w->adler);
+    for (int i = 0; i < 4; i++)
+        put_bits(w, adler[i], 8);
+    return w->error || write_idat(w) != e_success ? e_failure : e_success;
+}
+
+void png_writer_close(PngWriter *w)
+{
+    if (w == NULL)
+        return;
+    arena_release(w->arena, w->rowbuf);
+    arena_release(w->arena, w);
+}
@@ -0,0 +1,65 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h"
+#include "bmp.h"
+#include "arena.h"
+
+/*
+ * PNG carriers, streamed one row at a time: memory holds a few rows and the
+ * deflate window whatever the size of the image, and no BMP copy of the
+ * pixels is ever made. The carrier bytes are the unfiltered samples of all
+ * rows in order, filter bytes excluded, so the encoder and the decoder
+ * address them through a flat plan (bmp_plan_flat()) exactly like the
+ * pixel bytes of a BMP. Only 8-bit grayscale, gray+alpha, RGB and RGBA
+ * images without interlacing are carriers: in palette and 16-bit images a
+ * changed low bit is not a small change of the pixel.
+ *
+ * The reader inflates the IDAT stream and unfilters each row as the carrier
+ * bytes are asked for. On the encoder side it also echoes every other chunk
+ * unchanged to the stego image, while the writer filters each embedded row
+ * (the per-row heuristic of the reference encoder) and deflates it into new
+ * IDAT chunks with dynamic Huffman blocks.
+ */
+
+#define PNG_SIGNATURE "\x89PNG\r\n\x1a\n"
+#define PNG_IDAT_SIZE 65536     // Compressed bytes per IDAT chunk written
+
+typedef struct _PngReader PngReader;
+typedef struct _PngWriter PngWriter;
+
+/* Whether fp is positioned on a PNG signature, the byte looked at is pushed back so pipes work too */
+int png_sniff(FILE *fp);
+
+/*
+ * Read the chunks in front of the pixel data and plan the carrier. echo,
+ * when not NULL, receives the signature and every chunk that is not IDAT.
+ * NULL when the image is not a supported PNG or out of memory.
+ */
+PngReader *png_reader_open(FILE *fp, FILE *echo, Arena *arena, BmpPlan *plan);
+
+/* Next n carrier bytes */
+Status png_read(PngReader *r, unsigned char *buf, size_t n);
+
+/* Check the end of the pixel data and echo the chunks after it, once every carrier byte has been read */
+Status png_reader_finish(PngReader *r);
+
+/* Bytes read from the file so far */
+uint64_t png_bytes_read(const PngReader *r);
+
+void png_reader_close(PngReader *r);
+
+/* Writer of the pixel data of an image shaped like the one r reads, its leading chunks were echoed by r */
+PngWriter *png_writer_open(FILE *fp, const PngReader *r, Arena *arena);
+
+/* Append n carrier bytes */
+Status png_write(PngWriter *w, const unsigned char *buf, size_t n);
+
+/* End the deflate stream in the last IDAT chunk, once every carrier byte has been written */
+Status png_writer_finish(PngWriter *w);
+
+void png_writer_close(PngWriter *w);
+
+#endif
@@ -0,0 +1,166 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "pool.h"
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t next;            // Next job the owner will take
+    size_t end;             // One past the last job in this range
+} PoolRange;
+
+typedef struct
+{
+    PoolRange *ranges;
+    int nthreads;
+    PoolJobFn fn;
+    void *arg;
+} Pool;
+
+typedef struct
+{
+    Pool *pool;
+    int id;
+} PoolWorker;
+
+int pool_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* Take the next job from the front of range r, 0 when it is empty */
+static int take_own(PoolRange *r, size_t *job)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->next < r->end)
+    {
+        *job = r->next++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ok;
+}
+
+/* Move the back half of the fullest other range into range self, 0 when nothing is left */
+static int steal(Pool *pool, int self)
+{
+    for (;;)
+    {
+        int victim = -1;
+        size_t best = 0;
+
+        // The sizes seen here are only a hint, the victim is re-checked below
+        for (int i = 0; i < pool->nthreads; i++)
+        {
+            PoolRange *r = &pool->ranges[i];
+            if (i == self)
+                continue;
+            pthread_mutex_lock(&r->lock);
+            size_t left = r->end - r->next;
+            pthread_mutex_unlock(&r->lock);
+            if (left > best)
+            {
+                best = left;
+                victim = i;
+            }
+        }
+        if (victim < 0)
+            return 0;
+
+        PoolRange *v = &pool->ranges[victim];
+        size_t lo = 0, hi = 0;
+        pthread_mutex_lock(&v->lock);
+        if (v->next < v->end)
+        {
+            size_t left = v->end - v->next;
+            hi = v->end;
+            lo = hi - (left + 1) / 2;
+            v->end = lo;
+        }
+        pthread_mutex_unlock(&v->lock);
+
+        if (hi > lo)
+        {
+            PoolRange *own = &pool->ranges[self];
+            pthread_mutex_lock(&own->lock);
+            own->next = lo;
+            own->end = hi;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+}
+
+static void *worker_main(void *p)
+{
+    PoolWorker *w = p;
+    Pool *pool = w->pool;
+    size_t job;
+
+    do
+    {
+        while (take_own(&pool->ranges[w->id], &job))
+            pool->fn(job, w->id, pool->arg);
+    } while (steal(pool, w->id));
+    return NULL;
+}
+
+int pool_run(size_t njobs, int nthreads, PoolJobFn fn, void *arg)
+{
+    Pool pool;
+    int ret = 0;
+
+    if (nthreads <= 0)
+        nthreads = pool_cpu_count();
+    if ((size_t)nthreads > njobs)
+        nthreads = njobs ? (int)njobs : 1;
+
+    pool.ranges = calloc(nthreads, sizeof(PoolRange));
+    PoolWorker *workers = calloc(nthreads, sizeof(PoolWorker));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool.ranges || !workers || !threads)
+    {
+        free(pool.ranges);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+    pool.nthreads = nthreads;
+    pool.fn = fn;
+    pool.arg = arg;
+
+    // Contiguous initial split, neighbouring jobs stay on the same worker
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_init(&pool.ranges[i].lock, NULL);
+        pool.ranges[i].next = njobs * i / nthreads;
+        pool.ranges[i].end = njobs * (i + 1) / nthreads;
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    // The calling thread is worker 0
+    int started = 1;
+    for (int i = 1; i < nthreads; i++, started++)
+    {
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]))
+        {
+            ret = -1;
+            break;
+        }
+    }
+    worker_main(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_destroy(&pool.ranges[i].lock);
+    free(pool.ranges);
+    free(workers);
+    free(threads);
+    return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Work-stealing thread pool for a fixed list of independent jobs.
+ * Jobs 0..njobs-1 are split into one contiguous range per worker, a worker
+ * takes jobs from the front of its own range and, once that is empty,
+ * steals the back half of the fullest other range.
+ */
+
+/* Called once per job, worker is the index of the calling thread */
+typedef void (*PoolJobFn)(size_t job, int worker, void *arg);
+
+/* Number of online CPUs, at least 1 */
+int pool_cpu_count(void);
+
+/* Run every job on nthreads workers (0 = one per CPU) and wait for all of them, 0 on success */
+int pool_run(size_t njobs, int nthreads, PoolJobFn fn, void *arg);
+
+#endif
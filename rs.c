@@ -0,0 +1,431 @@
+#include <string.h>
+#include "rs.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RS_X86 1
+#include <immintrin.h>
+#endif
+
+#define GF_POLY 0x11d   // x^8 + x^4 + x^3 + x^2 + 1, alpha = 2 generates the field
+
+/* exp[i] = alpha^i, doubled so that a sum of two logs needs no reduction, log[0] is unused */
+static unsigned char gf_exp[2 * RS_N];
+static unsigned char gf_log[256];
+
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static unsigned char gf_inv(unsigned char a)
+{
+    return gf_exp[RS_N - gf_log[a]];
+}
+
+/* c * x with the nibble tables of c */
+static unsigned char tab_mul(const unsigned char *tab, unsigned char x)
+{
+    return tab[x & 0xF] ^ tab[16 + (x >> 4)];
+}
+
+static void make_tab(unsigned char *tab, unsigned char c)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        tab[i] = gf_mul(c, i);
+        tab[16 + i] = gf_mul(c, i << 4);
+    }
+}
+
+/*
+ * Systematic encoding, one LFSR per lane run on all lanes of a row at once:
+ * the parity rows hold the remainder of payload * x^parity divided by the
+ * generator, the highest degree first.
+ */
+static void encode_scalar(const RsCode *rs, unsigned char *block)
+{
+    int k = RS_N - rs->parity;
+    unsigned char *par = block + k * RS_LANES;
+    unsigned char f[RS_LANES];
+
+    memset(par, 0, (size_t)rs->parity * RS_LANES);
+    for (int j = 0; j < k; j++)
+    {
+        for (int l = 0; l < RS_LANES; l++)
+            f[l] = block[j * RS_LANES + l] ^ par[l];
+        for (int t = 0; t < rs->parity; t++)
+        {
+            unsigned char *p = par + t * RS_LANES;
+            const unsigned char *next = t + 1 < rs->parity ? p + RS_LANES : NULL;
+            for (int l = 0; l < RS_LANES; l++)
+                p[l] = (next ? next[l] : 0) ^ tab_mul(rs->gen_tab[t], f[l]);
+        }
+    }
+}
+
+/* syn[i] = block(alpha^i) for every lane, by Horner over the rows */
+static void syndromes_scalar(const RsCode *rs, const unsigned char *block, unsigned char (*syn)[RS_LANES])
+{
+    for (int i = 0; i < rs->parity; i++)
+    {
+        unsigned char s[RS_LANES] = {0};
+        for (int j = 0; j < RS_N; j++)
+            for (int l = 0; l < RS_LANES; l++)
+                s[l] = tab_mul(rs->root_tab[i], s[l]) ^ block[j * RS_LANES + l];
+        memcpy(syn[i], s, RS_LANES);
+    }
+}
+
+#ifdef RS_X86
+/* c * x for 16 bytes, two pshufb in the nibble tables of c */
+__attribute__((target("ssse3")))
+static inline __m128i mul_ssse3(const unsigned char *tab, __m128i lo, __m128i hi)
+{
+    __m128i tlo = _mm_loadu_si128((const __m128i *)tab);
+    __m128i thi = _mm_loadu_si128((const __m128i *)(tab + 16));
+    return _mm_xor_si128(_mm_shuffle_epi8(tlo, lo), _mm_shuffle_epi8(thi, hi));
+}
+
+__attribute__((target("ssse3")))
+static void encode_ssse3(const RsCode *rs, unsigned char *block)
+{
+    int k = RS_N - rs->parity;
+    unsigned char *par = block + k * RS_LANES;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    memset(par, 0, (size_t)rs->parity * RS_LANES);
+    for (int j = 0; j < k; j++)
+        for (int h = 0; h < RS_LANES; h += 16)
+        {
+            __m128i f = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(block + j * RS_LANES + h)),
+                                      _mm_loadu_si128((const __m128i *)(par + h)));
+            __m128i lo = _mm_and_si128(f, mask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi64(f, 4), mask);
+            int t = 0;
+            for (; t + 1 < rs->parity; t++)
+            {
+                __m128i next = _mm_loadu_si128((const __m128i *)(par + (t + 1) * RS_LANES + h));
+                _mm_storeu_si128((__m128i *)(par + t * RS_LANES + h),
+                                 _mm_xor_si128(next, mul_ssse3(rs->gen_tab[t], lo, hi)));
+            }
+            _mm_storeu_si128((__m128i *)(par + t * RS_LANES + h), mul_ssse3(rs->gen_tab[t], lo, hi));
+        }
+}
+
+/* s * c + row for 16 bytes, the tables of c in tlo and thi */
+#define HORNER_SSSE3(s, tlo, thi, row) \
+    _mm_xor_si128(_mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s, mask)), \
+                                _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask))), row)
+
+/* Two syndromes per pass over the rows, both halves of each in flight at once */
+__attribute__((target("ssse3")))
+static void syndromes_ssse3(const RsCode *rs, const unsigned char *block, unsigned char (*syn)[RS_LANES])
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    for (int i = 0; i < rs->parity; i += 2)
+    {
+        // An odd last syndrome is computed twice
+        int i1 = i + 1 < rs->parity ? i + 1 : i;
+        __m128i alo = _mm_loadu_si128((const __m128i *)rs->root_tab[i]);
+        __m128i ahi = _mm_loadu_si128((const __m128i *)(rs->root_tab[i] + 16));
+        __m128i blo = _mm_loadu_si128((const __m128i *)rs->root_tab[i1]);
+        __m128i bhi = _mm_loadu_si128((const __m128i *)(rs->root_tab[i1] + 16));
+        __m128i a0 = _mm_setzero_si128(), a1 = a0, b0 = a0, b1 = a0;
+        for (int j = 0; j < RS_N; j++)
+        {
+            __m128i r0 = _mm_loadu_si128((const __m128i *)(block + j * RS_LANES));
+            __m128i r1 = _mm_loadu_si128((const __m128i *)(block + j * RS_LANES + 16));
+            a0 = HORNER_SSSE3(a0, alo, ahi, r0);
+            a1 = HORNER_SSSE3(a1, alo, ahi, r1);
+            b0 = HORNER_SSSE3(b0, blo, bhi, r0);
+            b1 = HORNER_SSSE3(b1, blo, bhi, r1);
+        }
+        _mm_storeu_si128((__m128i *)syn[i], a0);
+        _mm_storeu_si128((__m128i *)(syn[i] + 16), a1);
+        _mm_storeu_si128((__m128i *)syn[i1], b0);
+        _mm_storeu_si128((__m128i *)(syn[i1] + 16), b1);
+    }
+}
+
+/* c * x for 32 bytes, the 16-byte tables are repeated in both halves of the register */
+__attribute__((target("avx2")))
+static inline __m256i mul_avx2(const unsigned char *tab, __m256i lo, __m256i hi)
+{
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tab));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tab + 16)));
+    return _mm256_xor_si256(_mm256_shuffle_epi8(tlo, lo), _mm256_shuffle_epi8(thi, hi));
+}
+
+__attribute__((target("avx2")))
+static void encode_avx2(const RsCode *rs, unsigned char *block)
+{
+    int k = RS_N - rs->parity;
+    unsigned char *par = block + k * RS_LANES;
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+
+    memset(par, 0, (size_t)rs->parity * RS_LANES);
+    for (int j = 0; j < k; j++)
+    {
+        __m256i f = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(block + j * RS_LANES)),
+                                     _mm256_loadu_si256((const __m256i *)par));
+        __m256i lo = _mm256_and_si256(f, mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi64(f, 4), mask);
+        int t = 0;
+        for (; t + 1 < rs->parity; t++)
+        {
+            __m256i next = _mm256_loadu_si256((const __m256i *)(par + (t + 1) * RS_LANES));
+            _mm256_storeu_si256((__m256i *)(par + t * RS_LANES), _mm256_xor_si256(next, mul_avx2(rs->gen_tab[t], lo, hi)));
+        }
+        _mm256_storeu_si256((__m256i *)(par + t * RS_LANES), mul_avx2(rs->gen_tab[t], lo, hi));
+    }
+}
+
+/* s * c + row for 32 bytes, the tables of c in tlo and thi */
+#define HORNER_AVX2(s, tlo, thi, row) \
+    _mm256_xor_si256(_mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask)), \
+                                      _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask))), row)
+
+/* Four syndromes per pass over the rows, their chains overlap instead of waiting on each other */
+__attribute__((target("avx2")))
+static void syndromes_avx2(const RsCode *rs, const unsigned char *block, unsigned char (*syn)[RS_LANES])
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    int i = 0;
+
+    for (; i + 4 <= rs->parity; i += 4)
+    {
+        __m256i t[8];
+        for (int q = 0; q < 4; q++)
+        {
+            t[2 * q] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rs->root_tab[i + q]));
+            t[2 * q + 1] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(rs->root_tab[i + q] + 16)));
+        }
+        __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+        for (int j = 0; j < RS_N; j++)
+        {
+            __m256i row = _mm256_loadu_si256((const __m256i *)(block + j * RS_LANES));
+            s0 = HORNER_AVX2(s0, t[0], t[1], row);
+            s1 = HORNER_AVX2(s1, t[2], t[3], row);
+            s2 = HORNER_AVX2(s2, t[4], t[5], row);
+            s3 = HORNER_AVX2(s3, t[6], t[7], row);
+        }
+        _mm256_storeu_si256((__m256i *)syn[i], s0);
+        _mm256_storeu_si256((__m256i *)syn[i + 1], s1);
+        _mm256_storeu_si256((__m256i *)syn[i + 2], s2);
+        _mm256_storeu_si256((__m256i *)syn[i + 3], s3);
+    }
+    for (; i < rs->parity; i++)
+    {
+        __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rs->root_tab[i]));
+        __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(rs->root_tab[i] + 16)));
+        __m256i s = _mm256_setzero_si256();
+        for (int j = 0; j < RS_N; j++)
+            s = HORNER_AVX2(s, tlo, thi, _mm256_loadu_si256((const __m256i *)(block + j * RS_LANES)));
+        _mm256_storeu_si256((__m256i *)syn[i], s);
+    }
+}
+#endif
+
+typedef struct
+{
+    const char *name;
+    void (*encode)(const RsCode *rs, unsigned char *block);
+    void (*syndromes)(const RsCode *rs, const unsigned char *block, unsigned char (*syn)[RS_LANES]);
+    const char *feature;    // CPU feature the kernel needs, NULL for none
+} RsKernel;
+
+static const RsKernel kernels[] = {
+#ifdef RS_X86
+    {"avx2", encode_avx2, syndromes_avx2, "avx2"},
+    {"ssse3", encode_ssse3, syndromes_ssse3, "ssse3"},
+#endif
+    {"scalar", encode_scalar, syndromes_scalar, NULL},
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static const RsKernel *active = &kernels[NKERNELS - 1];
+
+/* Whether the CPU runs kernel k */
+static int kernel_supported(const RsKernel *k)
+{
+#ifdef RS_X86
+    if (k->feature && !strcmp(k->feature, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (k->feature && !strcmp(k->feature, "ssse3"))
+        return __builtin_cpu_supports("ssse3");
+#endif
+    return k->feature == NULL;
+}
+
+/* Build the field tables and pick the widest kernel the CPU has, before main() runs */
+__attribute__((constructor))
+static void rs_setup(void)
+{
+    unsigned x = 1;
+    for (int i = 0; i < RS_N; i++)
+    {
+        gf_exp[i] = gf_exp[i + RS_N] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+
+#ifdef RS_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t k = 0; k < NKERNELS; k++)
+        if (kernel_supported(&kernels[k]))
+        {
+            active = &kernels[k];
+            break;
+        }
+}
+
+int rs_init(RsCode *rs, int parity)
+{
+    unsigned char g[RS_MAX_PARITY + 1] = {1};
+
+    if (parity < RS_MIN_PARITY || parity > RS_MAX_PARITY)
+        return -1;
+    rs->parity = parity;
+
+    // g(x) = (x - alpha^0)(x - alpha^1)...(x - alpha^(parity - 1)), highest degree first
+    for (int i = 0; i < parity; i++)
+    {
+        for (int t = i + 1; t > 0; t--)
+            g[t] ^= gf_mul(gf_exp[i], g[t - 1]);
+        make_tab(rs->root_tab[i], gf_exp[i]);
+    }
+    for (int t = 0; t < parity; t++)
+    {
+        rs->gen[t] = g[t + 1];
+        make_tab(rs->gen_tab[t], g[t + 1]);
+    }
+    return 0;
+}
+
+void rs_encode_block(const RsCode *rs, unsigned char *block)
+{
+    active->encode(rs, block);
+}
+
+/*
+ * Repair lane l of block from its syndromes: Berlekamp-Massey finds the
+ * error locator, a Chien search its roots and Forney the error values.
+ * Returns the number of bytes corrected, -1 when there are more errors than
+ * the code can repair (as far as that can be told).
+ */
+static int correct_lane(const RsCode *rs, unsigned char *block, int l, const unsigned char *s)
+{
+    int n = rs->parity;
+    unsigned char lambda[RS_MAX_PARITY + 1] = {1}, prev[RS_MAX_PARITY + 1] = {1}, t[RS_MAX_PARITY + 1];
+    unsigned char b = 1;
+    int len = 0, m = 1;
+
+    for (int r = 0; r < n; r++)
+    {
+        unsigned char d = s[r];
+        for (int i = 1; i <= len; i++)
+            d ^= gf_mul(lambda[i], s[r - i]);
+        if (d == 0)
+        {
+            m++;
+            continue;
+        }
+        unsigned char coef = gf_mul(d, gf_inv(b));
+        memcpy(t, lambda, sizeof(t));
+        for (int i = 0; i + m <= n; i++)
+            lambda[i + m] ^= gf_mul(coef, prev[i]);
+        if (2 * len <= r)
+        {
+            len = r + 1 - len;
+            memcpy(prev, t, sizeof(prev));
+            b = d;
+            m = 1;
+        }
+        else
+            m++;
+    }
+    if (2 * len > n)
+        return -1;
+
+    // omega(x) = s(x) * lambda(x) mod x^n
+    unsigned char omega[RS_MAX_PARITY] = {0};
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j <= len && j <= i; j++)
+            omega[i] ^= gf_mul(s[i - j], lambda[j]);
+
+    // Row j holds the coefficient of x^(254 - j), an error there makes alpha^-(254 - j) a root of lambda
+    int found = 0;
+    for (int e = 0; e < RS_N && found <= len; e++)
+    {
+        unsigned char xinv = gf_exp[(RS_N - e) % RS_N];
+        unsigned char v = 0, xp = 1;
+        for (int i = 0; i <= len; i++, xp = gf_mul(xp, xinv))
+            v ^= gf_mul(lambda[i], xp);
+        if (v)
+            continue;
+
+        // Forney with the first root alpha^0: value = X * omega(X^-1) / lambda'(X^-1)
+        unsigned char num = 0, den = 0;
+        xp = 1;
+        for (int i = 0; i < n; i++, xp = gf_mul(xp, xinv))
+            num ^= gf_mul(omega[i], xp);
+        xp = 1;
+        for (int i = 1; i <= len; i += 2, xp = gf_mul(xp, gf_mul(xinv, xinv)))
+            den ^= gf_mul(lambda[i], xp);
+        if (den == 0)
+            return -1;
+        unsigned char val = gf_mul(gf_exp[e], gf_mul(num, gf_inv(den)));
+        if (val == 0)
+            return -1;
+        block[(RS_N - 1 - e) * RS_LANES + l] ^= val;
+        found++;
+    }
+    return found == len ? len : -1;
+}
+
+int rs_decode_block(const RsCode *rs, unsigned char *block)
+{
+    unsigned char syn[RS_MAX_PARITY][RS_LANES];
+    int fixed = 0;
+
+    active->syndromes(rs, block, syn);
+
+    // Lanes whose syndromes are all zero are valid codewords, the usual case
+    for (int l = 0; l < RS_LANES; l++)
+    {
+        unsigned char s[RS_MAX_PARITY], any = 0;
+        for (int i = 0; i < rs->parity; i++)
+            any |= s[i] = syn[i][l];
+        if (!any)
+            continue;
+        int k = correct_lane(rs, block, l, s);
+        if (k < 0)
+            return -1;
+        fixed += k;
+    }
+    return fixed;
+}
+
+const char *rs_kernel_name(void)
+{
+    return active->name;
+}
+
+int rs_select_kernel(const char *name)
+{
+    for (size_t k = 0; k < NKERNELS; k++)
+    {
+        if (strcmp(kernels[k].name, name))
+            continue;
+        if (!kernel_supported(&kernels[k]))
+            return -1;
+        active = &kernels[k];
+        return 0;
+    }
+    return -1;
+}
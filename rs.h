@@ -0,0 +1,53 @@
+#ifndef RS_H
+#define RS_H
+
+#include <stddef.h>
+
+/*
+ * Reed-Solomon error correction of the hidden data (FLAG_ECC_MASK). A block
+ * holds RS_LANES interleaved RS(255, 255 - parity) codewords over GF(256)
+ * (polynomial 0x11d, first root alpha^0): row j of the block is byte j of
+ * every codeword, so the payload bytes fill the first 255 - parity rows in
+ * stream order and the parity rows follow them. A burst of damaged carrier
+ * bytes is spread over all the codewords of its block, each of which repairs
+ * up to parity / 2 bad bytes.
+ *
+ * The row arithmetic multiplies 16 or 32 bytes by a constant at once with
+ * two pshufb lookups in nibble tables (SSSE3, AVX2), or one byte at a time
+ * through the same tables otherwise, all give the same results.
+ */
+
+#define RS_N 255                    // Bytes per codeword, payload plus parity
+#define RS_LANES 32                 // Codewords interleaved in a block
+#define RS_BLOCK (RS_N * RS_LANES)  // Bytes of a block, a multiple of every depth
+#define RS_MIN_PARITY 2
+#define RS_MAX_PARITY 64
+#define RS_DEFAULT_PARITY 16        // Repairs 8 bad bytes in every 255
+
+/* Payload bytes of a block with the given parity */
+#define RS_DATA_BYTES(parity) ((size_t)(RS_N - (parity)) * RS_LANES)
+
+typedef struct
+{
+    int parity;                                     // Parity bytes per codeword
+    unsigned char gen[RS_MAX_PARITY];               // Generator polynomial without its leading 1, highest degree first
+    unsigned char gen_tab[RS_MAX_PARITY][32];       // Nibble tables of gen: c * i, then c * (i << 4)
+    unsigned char root_tab[RS_MAX_PARITY][32];      // Nibble tables of the roots alpha^i
+} RsCode;
+
+/* Build the code for parity bytes per codeword, 0 on success */
+int rs_init(RsCode *rs, int parity);
+
+/* Fill the parity rows of block from its payload rows */
+void rs_encode_block(const RsCode *rs, unsigned char *block);
+
+/* Repair block in place, returns the number of bytes corrected or -1 when a codeword is beyond repair */
+int rs_decode_block(const RsCode *rs, unsigned char *block);
+
+/* Name of the implementation selected for this CPU, "avx2", "ssse3" or "scalar" */
+const char *rs_kernel_name(void);
+
+/* Force an implementation by name, 0 on success */
+int rs_select_kernel(const char *name);
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include "scatter.h"
+#include "lsb.h"
+
+#define GOLDEN 0x9E3779B97F4A7C15ULL
+
+/* SplitMix64 finalizer, output counter of the generator keyed by the caller */
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/* Feistel network over 2 * half bits, seed selects an independent bijection for every tile */
+static uint64_t feistel(const Scatter *sc, uint64_t seed, int half, uint64_t x)
+{
+    uint64_t mask = ((uint64_t)1 << half) - 1;
+    uint64_t l = x >> half, r = x & mask;
+
+    for (int i = 0; i < SCATTER_ROUNDS; i++)
+    {
+        uint64_t t = l ^ (mix64(sc->keys[i] + (seed << 32 | r) * GOLDEN) & mask);
+        l = r;
+        r = t;
+    }
+    return l << half | r;
+}
+
+/* Keyed bijection of [0, n): the Feistel network over the next even power of two, walked until it lands below n */
+static uint64_t permute(const Scatter *sc, uint64_t seed, uint64_t n, uint64_t x)
+{
+    int half = 1;
+
+    while (((uint64_t)1 << (2 * half)) < n)
+        half++;
+    do
+        x = feistel(sc, seed, half, x);
+    while (x >= n);
+    return x;
+}
+
+Scatter *scatter_new(const char *key, size_t base, size_t capacity)
+{
+    Scatter *sc = calloc(1, sizeof(Scatter));
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    if (sc == NULL)
+        return NULL;
+
+    // FNV-1a of the key seeds the round keys
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++)
+        h = (h ^ *p) * 0x100000001B3ULL;
+    for (int i = 0; i < SCATTER_ROUNDS; i++)
+        sc->keys[i] = mix64(h + (i + 1) * GOLDEN);
+
+    sc->base = base;
+    sc->nunits = capacity > base ? (capacity - base) / SCATTER_UNIT : 0;
+    sc->nfull = sc->nunits / SCATTER_TILE;
+
+    // The tile bijection is looked up for every unit, so it is computed once
+    sc->tiles = malloc((sc->nfull ? sc->nfull : 1) * sizeof(uint32_t));
+    if (sc->tiles == NULL)
+    {
+        free(sc);
+        return NULL;
+    }
+    for (size_t t = 0; t < sc->nfull; t++)
+        sc->tiles[t] = permute(sc, 0, sc->nfull, t);
+    return sc;
+}
+
+void scatter_free(Scatter *sc)
+{
+    if (sc)
+        free(sc->tiles);
+    free(sc);
+}
+
+size_t scatter_pos(const Scatter *sc, size_t pos)
+{
+    if (pos < sc->base || pos - sc->base >= sc->nunits * SCATTER_UNIT)
+        return pos;
+
+    size_t u = (pos - sc->base) / SCATTER_UNIT, off = (pos - sc->base) % SCATTER_UNIT;
+    size_t t = u / SCATTER_TILE, s = u % SCATTER_TILE;
+
+    // Units of the partial tile at the end stay in it, tile seeds start at 1 so they differ from the tile bijection
+    if (t < sc->nfull)
+        t = sc->tiles[t];
+    s = permute(sc, t + 1, t < sc->nfull ? SCATTER_TILE : sc->nunits - sc->nfull * SCATTER_TILE, s);
+    return sc->base + (t * SCATTER_TILE + s) * SCATTER_UNIT + off;
+}
+
+/* Logical end of the stretch around pos that is moved as one block */
+static size_t block_end(const Scatter *sc, size_t pos)
+{
+    if (pos < sc->base)
+        return sc->base;
+    if (pos - sc->base >= sc->nunits * SCATTER_UNIT)
+        return (size_t)-1;
+    return pos + SCATTER_UNIT - (pos - sc->base) % SCATTER_UNIT;
+}
+
+void scatter_encode_bits(const Scatter *sc, const BmpPlan *plan, size_t pos, const char *data, size_t n,
+                         char *map, int depth)
+{
+    while (n > 0)
+    {
+        size_t end = block_end(sc, pos);
+        size_t carrier = lsb_carrier_bytes(n, depth);
+
+        // The rest stays within one unit
+        if (pos + carrier <= end)
+        {
+            bmp_encode_bits(plan, scatter_pos(sc, pos), data, n, map, map, 0, depth, 1);
+            return;
+        }
+
+        // Whole groups up to the end of the unit
+        size_t groups = (end - pos) / 8;
+        if (groups)
+        {
+            bmp_encode_bits(plan, scatter_pos(sc, pos), data, groups * depth, map, map, 0, depth, 1);
+            pos += groups * 8;
+            data += groups * depth;
+            n -= groups * depth;
+            continue;
+        }
+
+        // One group split between two units, after a field that ended on a partial group
+        char tmp[8];
+        size_t len = n < (size_t)depth ? n : (size_t)depth;
+        size_t cb = lsb_carrier_bytes(len, depth);
+        for (size_t i = 0; i < cb; i++)
+            tmp[i] = map[bmp_phys(plan, scatter_pos(sc, pos + i))];
+        lsb_encode_bits(data, len, tmp, tmp, depth);
+        for (size_t i = 0; i < cb; i++)
+            map[bmp_phys(plan, scatter_pos(sc, pos + i))] = tmp[i];
+        pos += cb;
+        data += len;
+        n -= len;
+    }
+}
+
+void scatter_decode_bits(const Scatter *sc, const BmpPlan *plan, size_t pos, const char *map, size_t n,
+                         char *data, int depth)
+{
+    while (n > 0)
+    {
+        size_t end = block_end(sc, pos);
+        size_t carrier = lsb_carrier_bytes(n, depth);
+
+        if (pos + carrier <= end)
+        {
+            bmp_decode_bits(plan, scatter_pos(sc, pos), map, 0, n, data, depth, 1);
+            return;
+        }
+
+        size_t groups = (end - pos) / 8;
+        if (groups)
+        {
+            bmp_decode_bits(plan, scatter_pos(sc, pos), map, 0, groups * depth, data, depth, 1);
+            pos += groups * 8;
+            data += groups * depth;
+            n -= groups * depth;
+            continue;
+        }
+
+        char tmp[8];
+        size_t len = n < (size_t)depth ? n : (size_t)depth;
+        size_t cb = lsb_carrier_bytes(len, depth);
+        for (size_t i = 0; i < cb; i++)
+            tmp[i] = map[bmp_phys(plan, scatter_pos(sc, pos + i))];
+        lsb_decode_bits(tmp, len, data, depth);
+        pos += cb;
+        data += len;
+        n -= len;
+    }
+}
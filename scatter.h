@@ -0,0 +1,54 @@
+#ifndef SCATTER_H
+#define SCATTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bmp.h"
+
+/*
+ * Keyed scattering of the hidden fields over the whole pixel array
+ * (FLAG_SCATTER). Logical carrier positions from base on are cut into
+ * units of SCATTER_UNIT carrier bytes, which stay contiguous so every unit
+ * still goes through the bulk LSB kernels. Units are grouped in tiles of
+ * SCATTER_TILE units: a keyed bijection moves whole tiles across the image
+ * and a second one, seeded with the tile, shuffles the units inside it.
+ * Consecutive payload bytes therefore stay within one cache-sized tile
+ * instead of landing on a random page each. Both bijections are small
+ * Feistel networks whose round function is a counter-based generator
+ * (the SplitMix64 finalizer applied to key + counter), so a position is
+ * computed on demand and nothing per unit is stored.
+ *
+ * This hides where the payload is, it is not encryption: the magic string
+ * and the flags stay in front of base, readable without the key.
+ */
+
+#define SCATTER_UNIT 512        // Carrier bytes moved together, 8 cache lines and a multiple of every group
+#define SCATTER_TILE 256        // Units per tile, 128 KB of carrier shuffled while it sits in L2
+#define SCATTER_ROUNDS 4        // Feistel rounds of both bijections
+
+typedef struct _Scatter
+{
+    uint64_t keys[SCATTER_ROUNDS]; // Round keys derived from the key string
+    size_t base;                // First scattered logical carrier position
+    size_t nunits;              // Whole units between base and the capacity, the bytes after them stay in place
+    size_t nfull;               // Whole tiles, the units of the last partial tile are only shuffled among themselves
+    uint32_t *tiles;            // Destination of every whole tile
+} Scatter;
+
+/* Scatter the logical positions [base, capacity) with key, NULL when out of memory */
+Scatter *scatter_new(const char *key, size_t base, size_t capacity);
+
+void scatter_free(Scatter *sc);
+
+/* Logical position carrier byte pos is moved to */
+size_t scatter_pos(const Scatter *sc, size_t pos);
+
+/* Same as bmp_encode_bits() on a whole mapped image (base 0) that is both source and destination */
+void scatter_encode_bits(const Scatter *sc, const BmpPlan *plan, size_t pos, const char *data, size_t n,
+                         char *map, int depth);
+
+/* Same as bmp_decode_bits() on a whole mapped image */
+void scatter_decode_bits(const Scatter *sc, const BmpPlan *plan, size_t pos, const char *map, size_t n,
+                         char *data, int depth);
+
+#endif
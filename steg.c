@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "steg.h"
+#include "encode.h"
+#include "decode.h"
+#include "lsb.h"
+#include "common.h"
+#include "job.h"
+
+/*
+ * The library runs the same stages as the command line tool. The job state
+ * is pointed at the caller buffers exactly like the memory-mapped backend,
+ * so no FILE* is ever opened, and quiet keeps every stage silent.
+ */
+
+/* Check the options and the BMP header of a carrier */
+static StegStatus check_carrier(const uint8_t *carrier, size_t carrier_len, const StegOptions *opt)
+{
+    BmpPlan plan;
+
+    if (carrier == NULL)
+        return e_steg_invalid_arg;
+    if (opt && (opt->depth < 0 || opt->depth > LSB_MAX_DEPTH || opt->threads < 0 ||
+                (opt->extn && strlen(opt->extn) >= MAX_FILE_SUFFIX) ||
+                (opt->ecc && (opt->ecc < RS_MIN_PARITY || opt->ecc > RS_MAX_PARITY))))
+        return e_steg_invalid_arg;
+
+    // The pixel array must be as large as the header says
+    if (bmp_parse(carrier, carrier_len, carrier_len, &plan) == e_failure)
+        return e_steg_bad_carrier;
+    return e_steg_ok;
+}
+
+/* Reusable context, a Job whose arena holds the compressed payload */
+struct _StegContext
+{
+    Job job;
+};
+
+/* Point a cleared encoder state at the caller buffers */
+static void set_encode_job(EncodeInfo *encInfo, const uint8_t *carrier, size_t carrier_len, uint8_t *out,
+                           const StegOptions *opt)
+{
+    encInfo->src_map = (const char *)carrier;
+    encInfo->stego_map = (char *)out;
+    encInfo->map_size = carrier_len;
+    encInfo->quiet = 1;
+    encInfo->depth = opt ? opt->depth : 1;
+    encInfo->threads = opt ? opt->threads : 1;
+    encInfo->compress = opt ? opt->compress : 0;
+    encInfo->checksum = opt ? opt->checksum : 0;
+    encInfo->ecc = opt ? opt->ecc : 0;
+    strcpy(encInfo->extn_secret_file, opt && opt->extn ? opt->extn : ".txt");
+}
+
+StegContext *steg_context_new(void)
+{
+    return (StegContext *)job_new();
+}
+
+void steg_context_free(StegContext *ctx)
+{
+    job_free((Job *)ctx);
+}
+
+size_t steg_capacity(const uint8_t *carrier, size_t carrier_len, const StegOptions *opt)
+{
+    if (check_carrier(carrier, carrier_len, opt) != e_steg_ok)
+        return 0;
+    // On the heap since EncodeInfo holds large scratch buffers
+    EncodeInfo *encInfo = calloc(1, sizeof(EncodeInfo));
+    if (encInfo == NULL)
+        return 0;
+    set_encode_job(encInfo, carrier, carrier_len, NULL, opt);
+
+    // Binary search on check_capacity(), so the answer always matches the encoder
+    long lo = -1, hi = (long)(carrier_len < LONG_MAX ? carrier_len : LONG_MAX);
+    while (hi - lo > 1)
+    {
+        long mid = lo + (hi - lo) / 2;
+        encInfo->secret_mem = "";
+        encInfo->size_secret_file = mid;
+        if (check_capacity(encInfo) == e_success)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    free(encInfo);
+    return lo < 0 ? 0 : (size_t)lo;
+}
+
+StegStatus steg_encode_ctx(StegContext *ctx, const uint8_t *carrier, size_t carrier_len, const uint8_t *payload,
+                           size_t payload_len, uint8_t *out, const StegOptions *opt)
+{
+    StegStatus ret = check_carrier(carrier, carrier_len, opt);
+    if (ret != e_steg_ok)
+        return ret;
+    if (ctx == NULL || out == NULL || (payload == NULL && payload_len) || payload_len > LONG_MAX)
+        return e_steg_invalid_arg;
+
+    job_reset(&ctx->job);
+    EncodeInfo *encInfo = job_encode(&ctx->job);
+    set_encode_job(encInfo, carrier, carrier_len, out, opt);
+    encInfo->secret_mem = payload ? (const char *)payload : "";
+    encInfo->size_secret_file = payload_len;
+
+    // Capacity is the only stage that can fail on a valid carrier, it is checked on the compressed size
+    if (encInfo->compress && compress_secret(encInfo) == e_failure)
+        ret = e_steg_no_memory;
+    else if (check_capacity(encInfo) == e_failure)
+        ret = e_steg_no_capacity;
+    else if (encode_image(encInfo) == e_failure)
+        ret = e_steg_corrupt;
+    return ret;
+}
+
+StegStatus steg_decode_ctx(StegContext *ctx, const uint8_t *stego, size_t stego_len, uint8_t *out, size_t out_cap,
+                           size_t *out_len, char *extn)
+{
+    StegStatus ret = check_carrier(stego, stego_len, NULL);
+    if (ret != e_steg_ok)
+        return ret;
+    if (ctx == NULL || (out == NULL && out_cap))
+        return e_steg_invalid_arg;
+
+    job_reset(&ctx->job);
+    Dec_Info *decinfo = job_decode(&ctx->job);
+    decinfo->in_map = (const char *)stego;
+    decinfo->map_size = stego_len;
+    decinfo->out_mem = out ? (char *)out : decinfo->data;
+    decinfo->out_cap = out_cap;
+    decinfo->quiet = 1;
+    decinfo->threads = 1;
+    decinfo->data_len = -1;
+
+    if (decode_image(decinfo) == e_failure)
+    {
+        // Tell apart the stages that can fail from how far decoding got
+        if (strcmp(decinfo->magic_string, MAGIC_STRING) && strcmp(decinfo->magic_string, MAGIC_STRING_EXT))
+            ret = e_steg_no_payload;
+        else if (decinfo->data_len >= 0 && (size_t)decinfo->data_len > out_cap)
+            ret = e_steg_buffer_too_small;
+        else
+            ret = e_steg_corrupt;
+    }
+    if (out_len && decinfo->data_len >= 0)
+        *out_len = decinfo->data_len;
+    if (extn && ret == e_steg_ok)
+        strcpy(extn, decinfo->extn);
+    return ret;
+}
+
+StegStatus steg_encode(const uint8_t *carrier, size_t carrier_len, const uint8_t *payload, size_t payload_len,
+                       uint8_t *out, const StegOptions *opt)
+{
+    StegStatus ret = check_carrier(carrier, carrier_len, opt);
+    if (ret != e_steg_ok)
+        return ret;
+
+    StegContext *ctx = steg_context_new();
+    if (ctx == NULL)
+        return e_steg_no_memory;
+    ret = steg_encode_ctx(ctx, carrier, carrier_len, payload, payload_len, out, opt);
+    steg_context_free(ctx);
+    return ret;
+}
+
+StegStatus steg_decode(const uint8_t *stego, size_t stego_len, uint8_t *out, size_t out_cap, size_t *out_len,
+                       char *extn)
+{
+    StegStatus ret = check_carrier(stego, stego_len, NULL);
+    if (ret != e_steg_ok)
+        return ret;
+
+    StegContext *ctx = steg_context_new();
+    if (ctx == NULL)
+        return e_steg_no_memory;
+    ret = steg_decode_ctx(ctx, stego, stego_len, out, out_cap, out_len, extn);
+    steg_context_free(ctx);
+    return ret;
+}
+
+const char *steg_strerror(StegStatus status)
+{
+    switch (status)
+    {
+        case e_steg_ok:
+            return "success";
+        case e_steg_invalid_arg:
+            return "invalid argument";
+        case e_steg_bad_carrier:
+            return "carrier is not a complete BMP image";
+        case e_steg_no_capacity:
+            return "payload does not fit in the carrier";
+        case e_steg_no_payload:
+            return "image does not contain hidden data";
+        case e_steg_corrupt:
+            return "hidden data is corrupt";
+        case e_steg_buffer_too_small:
+            return "output buffer is too small";
+        case e_steg_no_memory:
+            return "out of memory";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,79 @@
+#ifndef STEG_H
+#define STEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libsteg: buffer to buffer encoding and decoding.
+ * Nothing is printed and no file is touched, every call keeps its state on
+ * its own heap allocation so any number of threads can call in parallel.
+ * Callers running many jobs keep a StegContext instead (one per thread):
+ * once it has seen the largest job, steg_encode_ctx() and steg_decode_ctx()
+ * make no heap allocation at all and memory use stays flat.
+ * Carriers are complete uncompressed 24bpp or 32bpp BMP images held in
+ * memory (any header version, either row order). PNG carriers are only
+ * streamed by the command line tool, libsteg refuses them with
+ * e_steg_bad_carrier. The output of steg_encode() is byte-for-byte what the
+ * command line tool writes.
+ */
+
+typedef enum
+{
+    e_steg_ok,              // Success
+    e_steg_invalid_arg,     // NULL buffer or bad option
+    e_steg_bad_carrier,     // Not a BMP image, or shorter than its header says
+    e_steg_no_capacity,     // The payload does not fit in the carrier
+    e_steg_no_payload,      // The image does not carry hidden data
+    e_steg_corrupt,         // The hidden header fields are inconsistent
+    e_steg_buffer_too_small,// The output buffer is smaller than the payload
+    e_steg_no_memory        // Allocating the job state failed
+} StegStatus;
+
+typedef struct
+{
+    int depth;              // Carrier LSBs used per carrier byte, 1..4 (0 = 1)
+    int threads;            // Worker threads for large payloads (0 = one per CPU, 1 = the calling thread only)
+    const char *extn;       // Extension recorded with the payload, NULL = ".txt"
+    int compress;           // Compress the payload, kept only when it shrinks
+    int checksum;           // Store a CRC32C of the payload, steg_decode() then fails with e_steg_corrupt on a mismatch
+    int ecc;                // Reed-Solomon parity bytes per 255 (2..64), steg_decode() repairs damaged bits. 0 = none
+} StegOptions;
+
+typedef struct _StegContext StegContext;
+
+/* Default options: depth 1, the calling thread only, ".txt", no compression, no checksum, no error correction */
+#define STEG_OPTIONS_INIT {1, 1, NULL, 0, 0, 0}
+
+/* Largest payload that fits in carrier with the given options (NULL = defaults), 0 when none fits */
+size_t steg_capacity(const uint8_t *carrier, size_t carrier_len, const StegOptions *opt);
+
+/* Hide payload in carrier, out receives carrier_len bytes and may be carrier itself */
+StegStatus steg_encode(const uint8_t *carrier, size_t carrier_len, const uint8_t *payload, size_t payload_len,
+                       uint8_t *out, const StegOptions *opt);
+
+/*
+ * Extract the payload of stego into out. *out_len receives the payload size,
+ * also when e_steg_buffer_too_small is returned so the caller can retry.
+ * extn, when not NULL, receives the recorded extension (at least 8 bytes).
+ */
+StegStatus steg_decode(const uint8_t *stego, size_t stego_len, uint8_t *out, size_t out_cap, size_t *out_len,
+                       char *extn);
+
+/* Reusable job state for the _ctx calls, NULL when out of memory. A context is used by one thread at a time */
+StegContext *steg_context_new(void);
+
+void steg_context_free(StegContext *ctx);
+
+/* steg_encode() on a context, with threads at most 1 it allocates nothing once the context is warm */
+StegStatus steg_encode_ctx(StegContext *ctx, const uint8_t *carrier, size_t carrier_len, const uint8_t *payload,
+                           size_t payload_len, uint8_t *out, const StegOptions *opt);
+
+/* steg_decode() on a context */
+StegStatus steg_decode_ctx(StegContext *ctx, const uint8_t *stego, size_t stego_len, uint8_t *out, size_t out_cap,
+                           size_t *out_len, char *extn);
+
+/* Short description of a status code */
+const char *steg_strerror(StegStatus status);
+
+#endif
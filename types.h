@@ -15,6 +15,14 @@ typedef enum
 {
     e_encode,
     e_decode,
+    e_batch,
+    e_inspect,
+    e_scan,
+    e_update,
+    e_pack,
+    e_list,
+    e_extract,
+    e_serve,
     e_unsupported
 } OperationType;
 
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include "update.h"
+#include "decode.h"
+#include "common.h"
+
+/* Print a progress message unless the job runs quietly */
+static void info(const EncodeInfo *encInfo, const char *msg)
+{
+    if (!encInfo->quiet)
+        printf("INFO : %s\n", msg);
+}
+
+/* Logical end of the payload hidden in the mapped image and its header flags, 0 when it carries none */
+static size_t old_payload_end(const char *map, size_t size, const char *key, uint *flags)
+{
+    Dec_Info *decinfo = calloc(1, sizeof(Dec_Info));
+    FILE *sink = fopen("/dev/null", "w");
+    size_t end = 0;
+
+    *flags = 0;
+    if (decinfo && sink)
+    {
+        decinfo->in_map = map;
+        decinfo->map_size = size;
+        decinfo->fp_output = sink;
+        decinfo->quiet = 1;
+        decinfo->threads = 1;
+        decinfo->key = key;
+
+        // A payload that fails to decode still covers the carrier bytes read so far
+        decode_image(decinfo);
+        if (!strcmp(decinfo->magic_string, MAGIC_STRING) || !strcmp(decinfo->magic_string, MAGIC_STRING_EXT))
+        {
+            end = decinfo->carrier_pos;
+            *flags = decinfo->flags;
+        }
+        scatter_free(decinfo->scatter);
+    }
+    if (sink)
+        fclose(sink);
+    free(decinfo);
+    return end;
+}
+
+/* Overwrite the LSBs of the carrier bytes [from, to) with random bits, nothing of the old payload is left */
+static Status scrub(EncodeInfo *encInfo, size_t from, size_t to)
+{
+    char rnd[4096];
+
+    for (size_t pos = from, n; pos < to; pos += 8 * n)
+    {
+        n = (to - pos + 7) / 8;
+        if (n > sizeof(rnd))
+            n = sizeof(rnd);
+        if (pos + 8 * n > encInfo->plan.capacity)
+            n = (encInfo->plan.capacity - pos) / 8;
+        if (n == 0)
+            break;
+        if (getrandom(rnd, n, 0) != (ssize_t)n)
+            return e_failure;
+        if (encInfo->scatter)
+            scatter_encode_bits(encInfo->scatter, &encInfo->plan, pos, rnd, n, encInfo->stego_map, 1);
+        else
+            bmp_encode_bits(&encInfo->plan, pos, rnd, n, encInfo->stego_map, encInfo->stego_map, 0, 1, 1);
+    }
+    return e_success;
+}
+
+/* Write the bytes of copy that differ from orig in [0, end) back to fd, nearby changes share one pwrite() */
+static Status write_changes(EncodeInfo *encInfo, const char *orig, const char *copy, size_t end, int fd)
+{
+    size_t i = 0;
+
+    while (i < end)
+    {
+        // Untouched pages compare equal in one call
+        if (end - i >= 4096 && !memcmp(orig + i, copy + i, 4096))
+        {
+            i += 4096;
+            continue;
+        }
+        if (orig[i] == copy[i])
+        {
+            i++;
+            continue;
+        }
+
+        size_t start = i, last = i;
+        for (i++; i < end && i - last <= UPDATE_GAP; i++)
+            if (orig[i] != copy[i])
+                last = i;
+
+        for (size_t off = start; off <= last;)
+        {
+            ssize_t n = pwrite(fd, copy + off, last + 1 - off, off);
+            if (n <= 0)
+                return e_failure;
+            metrics_io(encInfo->metrics, 0, n, 1);
+            off += n;
+        }
+        i = last + 1;
+    }
+    return e_success;
+}
+
+Status do_update(EncodeInfo *encInfo)
+{
+    struct stat st;
+    Status ret = e_failure;
+
+    info(encInfo, "Update started!");
+    metrics_start(encInfo->metrics, "update");
+    metrics_io(encInfo->metrics, 0, 0, 3);
+
+    // The secret is opened the way open_files() does it, a pipe is embedded in frames
+    encInfo->fptr_secret = open_stream(encInfo->secret_fname, "r");
+    if (encInfo->fptr_secret == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", encInfo->secret_fname);
+        return e_failure;
+    }
+    encInfo->framed = fstat(fileno(encInfo->fptr_secret), &st) || !S_ISREG(st.st_mode);
+
+    int fd = open(encInfo->stego_image_fname, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    {
+        fprintf(stderr, "ERROR: Unable to open %s for update, it must be an existing image file\n",
+                encInfo->stego_image_fname);
+        if (fd >= 0)
+            close(fd);
+        close_stream(encInfo->fptr_secret);
+        encInfo->fptr_secret = NULL;
+        return e_failure;
+    }
+    size_t size = st.st_size;
+
+    // orig follows the file, copy is private: the encoder writes into copy and the file stays as it is until the end
+    void *orig = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    void *copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // A PNG is deflated anew whenever a pixel changes, there are no carrier bytes to patch in place
+    if (orig != MAP_FAILED && size >= 8 && !memcmp(orig, PNG_SIGNATURE, 8))
+        fprintf(stderr, "ERROR: %s is a PNG image, only BMP images can be updated in place\n",
+                encInfo->stego_image_fname);
+    else if (orig != MAP_FAILED && copy != MAP_FAILED)
+    {
+        uint flags;
+        size_t old_end = old_payload_end(orig, size, encInfo->key, &flags);
+
+        // Options not given on the command line are taken from the old payload, an update keeps the layout
+        if (!encInfo->depth)
+            encInfo->depth = (flags & FLAG_DEPTH_MASK) + 1;
+        if (flags & FLAG_COMPRESSED)
+            encInfo->compress = 1;
+        if (flags & FLAG_CRC)
+            encInfo->checksum = 1;
+        if (!encInfo->ecc)
+            encInfo->ecc = (flags & FLAG_ECC_MASK) >> FLAG_ECC_SHIFT;
+
+        // Source and stego image are the same mapping, so the encoder copies neither header nor tail
+        encInfo->src_map = copy;
+        encInfo->stego_map = copy;
+        encInfo->map_size = size;
+        encInfo->carrier_pos = 0;
+        if (encInfo->metrics)
+            encInfo->metrics->backend = "update";
+
+        // Without the key the old payload cannot be found, let alone overwritten
+        if ((flags & FLAG_SCATTER) && encInfo->key == NULL)
+            fprintf(stderr, "ERROR: The hidden data in %s is scattered, updating it needs --key\n",
+                    encInfo->stego_image_fname);
+        else
+            ret = encode_image(encInfo);
+        size_t end = encInfo->carrier_pos > old_end ? encInfo->carrier_pos : old_end;
+        if (ret == e_success && old_end > encInfo->carrier_pos)
+            ret = scrub(encInfo, encInfo->carrier_pos, old_end);
+
+        // Charged to the tail stage, the write back takes the place of the tail copy. Scattered bits may be anywhere
+        if (ret == e_success)
+            ret = write_changes(encInfo, orig, copy, encInfo->scatter ? size : bmp_phys_end(&encInfo->plan, end), fd);
+    }
+
+    if (orig != MAP_FAILED)
+        munmap(orig, size);
+    if (copy != MAP_FAILED)
+        munmap(copy, size);
+    encInfo->src_map = NULL;
+    encInfo->stego_map = NULL;
+    scatter_free(encInfo->scatter);
+    encInfo->scatter = NULL;
+    if (close(fd))
+        ret = e_failure;
+    close_stream(encInfo->fptr_secret);
+    encInfo->fptr_secret = NULL;
+    if (ret == e_failure)
+        return e_failure;
+    metrics_finish(encInfo->metrics);
+
+    info(encInfo, "Update Successful!");
+    return e_success;
+}
@@ -0,0 +1,21 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include "types.h"
+#include "encode.h"
+
+/*
+ * Update mode: replace the secret hidden in an existing stego image in
+ * place. The new secret is embedded into a private copy-on-write mapping
+ * of the image, then only the byte ranges that differ from the file are
+ * written back with pwrite(). When the old payload reached further than
+ * the new one, the LSBs it leaves behind are overwritten with random bits.
+ * Pages outside the payload are neither read nor written.
+ */
+
+#define UPDATE_GAP 512      // Unchanged bytes a single write may span instead of being split in two
+
+/* Hide encInfo->secret_fname in encInfo->stego_image_fname, which is modified in place */
+Status do_update(EncodeInfo *encInfo);
+
+#endif